@@ -0,0 +1,739 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+
+/*
+ * The functions of a script are numbered in the order collectFunctions()
+ * visits them, the script first and every function right before the ones
+ * nested in it. aotInterpret() walks the freshly compiled script the same
+ * way to hand out the C functions.
+ */
+
+typedef struct {
+    ObjFunction **functions;
+    int count;
+    int capacity;
+    // The function a global slot was declared with by the script, NULL when
+    // there is no single one.
+    ObjFunction **globals;
+    int globalCount;
+} Program;
+
+static void collectFunctions(Program *program, ObjFunction *function) {
+    if (program->count == program->capacity) {
+        int capacity = program->capacity;
+        program->capacity = GROW_CAPACITY(capacity);
+        program->functions = GROW_ARRAY(ObjFunction *, program->functions,
+                                        capacity, program->capacity);
+    }
+    program->functions[program->count++] = function;
+
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            collectFunctions(program, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+static int functionIndex(Program *program, ObjFunction *function) {
+    for (int i = 0; i < program->count; i++) {
+        if (program->functions[i] == function) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Finds the "fun" declarations of the script, an OP_CLOSURE stored straight
+// into a global.
+static void findDeclarations(Program *program, ObjFunction *script) {
+    program->globalCount = vm.globalValues.count;
+    program->globals = ALLOCATE(ObjFunction *, program->globalCount);
+    bool *seen = ALLOCATE(bool, program->globalCount);
+    for (int i = 0; i < program->globalCount; i++) {
+        program->globals[i] = NULL;
+        seen[i] = false;
+    }
+
+    Chunk *chunk = &script->chunk;
+    int previous = -1;
+    for (int offset = 0; offset < chunk->count;
+         previous = offset, offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] != OP_DEFINE_GLOBAL) {
+            continue;
+        }
+        int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        ObjFunction *function = NULL;
+        if (previous >= 0 && chunk->code[previous] == OP_CLOSURE) {
+            function = AS_FUNCTION(chunk->constants.values[chunk->code[previous + 1]]);
+        }
+        program->globals[slot] = seen[slot] ? NULL : function;
+        seen[slot] = true;
+    }
+    FREE_ARRAY(bool, seen, program->globalCount);
+}
+
+// Writes one indented line of C.
+static void line(FILE *out, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fputs("    ", out);
+    vfprintf(out, format, args);
+    va_end(args);
+    fputc('\n', out);
+}
+
+// Spells out *value* as C when it is a number, nil or a boolean, otherwise
+// refers to constant *index* of the running function.
+static void formatConstant(char *buffer, size_t size, Value value, int index) {
+    if (IS_INT(value)) {
+        snprintf(buffer, size, "INT_VALUE(INT64_C(%" PRId64 "))", AS_INT(value));
+    } else if (IS_NUMBER(value) && isfinite(AS_NUMBER(value))) {
+        snprintf(buffer, size, "NUMBER_VALUE(%a)", AS_NUMBER(value));
+    } else if (IS_NIL(value)) {
+        snprintf(buffer, size, "NIL_VALUE");
+    } else if (IS_BOOL(value)) {
+        snprintf(buffer, size, "BOOL_VALUE(%s)", AS_BOOL(value) ? "true" : "false");
+    } else {
+        snprintf(buffer, size, "AOT_CONSTANT(%d)", index);
+    }
+}
+
+// How many values the instruction at *offset* consumes off the stack.
+static int operandCount(Chunk *chunk, int offset) {
+    switch (genericInstruction(chunk->code[offset])) {
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_RETURN_MEMO:
+        case OP_NOT:
+        case OP_NEGATE:
+            return 1;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            return 2;
+        case OP_POPN:
+            return chunk->code[offset + 1];
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_NATIVE:
+            return chunk->code[offset + 1] + 1;
+        case OP_CALL_KNOWN:
+            return chunk->code[offset + 3] + 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Stack slot n of the frame lives in the C variable "sn" so the C compiler
+ * can keep it in a register, slot 0 (the closure) is only ever read from
+ * memory. The VM sees the slots in memory, so they are stored there before
+ * anything that looks at the stack and loaded again after anything that
+ * may have changed it.
+ */
+
+static void writeSpill(FILE *out, int depth) {
+    for (int i = 1; i < depth; i++) {
+        line(out, "slots[%d] = s%d;", i, i);
+    }
+    line(out, "vm.stackTop = slots + %d;", depth);
+}
+
+static void writeReload(FILE *out, int depth) {
+    for (int i = 1; i < depth; i++) {
+        line(out, "s%d = slots[%d];", i, i);
+    }
+}
+
+static void writeLocal(FILE *out, int to, int local) {
+    if (local == 0) {
+        line(out, "s%d = slots[0];", to);
+    } else {
+        line(out, "s%d = s%d;", to, local);
+    }
+}
+
+// s(depth - 2) = *result*, which is formatted with both operands, when they
+// are numbers. jitBinary() deals with the rest.
+static void writeBinary(FILE *out, int depth, int end, const char *op, const char *result) {
+    int a = depth - 2;
+    int b = depth - 1;
+    char expression[128];
+    snprintf(expression, sizeof(expression), result, a, b);
+    line(out, "if (areNumbers(s%d, s%d)) {", a, b);
+    line(out, "    s%d = %s;", a, expression);
+    line(out, "} else {");
+    writeSpill(out, depth);
+    line(out, "if (!jitBinary(AOT_IP(%d), %s)) return JIT_ERROR;", end, op);
+    writeReload(out, depth - 1);
+    line(out, "}");
+}
+
+// Jumps to *target* when *condition* holds for the two numbers on top,
+// anything else goes through jitCompareJump().
+static void writeCompareJump(FILE *out, int depth, int end, int target,
+                             const char *op, const char *condition) {
+    int a = depth - 2;
+    int b = depth - 1;
+    char expression[128];
+    snprintf(expression, sizeof(expression), condition, a, b);
+    line(out, "if (areNumbers(s%d, s%d)) {", a, b);
+    line(out, "    if (%s) goto at%d;", expression, target);
+    line(out, "} else {");
+    writeSpill(out, depth);
+    line(out, "switch (jitCompareJump(AOT_IP(%d), %s)) {", end, op);
+    line(out, "    case -1: return JIT_ERROR;");
+    line(out, "    case 1: goto at%d;", target);
+    line(out, "}");
+    line(out, "}");
+}
+
+// The tick of a backward jump, see INTERRUPT_INTERVAL.
+static void writeTick(FILE *out, int depth, int end) {
+    line(out, "if (--vm.fuel < 0) {");
+    writeSpill(out, depth);
+    line(out, "if (!jitPoll(AOT_IP(%d))) return JIT_ERROR;", end);
+    line(out, "}");
+}
+
+// OP_FOR_PREP and OP_FOR_LOOP, as the increment and the comparison they
+// stand for.
+static void writeCountingLoop(FILE *out, Chunk *chunk, int offset, int depth, int end) {
+    uint8_t *code = &chunk->code[offset];
+    bool inclusive = (code[5] & FOR_INCLUSIVE) != 0;
+    char constant[64];
+
+    if (code[0] == OP_FOR_LOOP) {
+        writeTick(out, depth, end);
+        formatConstant(constant, sizeof(constant), chunk->constants.values[code[6]], code[6]);
+        writeLocal(out, depth, code[3]);
+        line(out, "s%d = %s;", depth + 1, constant);
+        writeBinary(out, depth + 2, end, "OP_ADD", "addNumbers(s%d, s%d)");
+        line(out, "s%d = s%d;", code[3], depth);
+    }
+
+    writeLocal(out, depth, code[3]);
+    if (code[5] & FOR_CONSTANT_LIMIT) {
+        formatConstant(constant, sizeof(constant), chunk->constants.values[code[4]], code[4]);
+        line(out, "s%d = %s;", depth + 1, constant);
+    } else {
+        writeLocal(out, depth + 1, code[4]);
+    }
+    int target = jumpTarget(chunk, offset);
+    if (code[0] == OP_FOR_LOOP) {
+        // Back to the body while the counter is still below the limit.
+        writeCompareJump(out, depth + 2, end, target,
+                         inclusive ? "OP_JUMP_IF_NOT_GREATER" : "OP_JUMP_IF_NOT_GREATER_EQUAL",
+                         inclusive ? "!greaterNumbers(s%d, s%d)" : "lessNumbers(s%d, s%d)");
+    } else {
+        writeCompareJump(out, depth + 2, end, target,
+                         inclusive ? "OP_JUMP_IF_NOT_LESS_EQUAL" : "OP_JUMP_IF_NOT_LESS",
+                         inclusive ? "greaterNumbers(s%d, s%d)" : "!lessNumbers(s%d, s%d)");
+    }
+}
+
+static void writeGlobalCheck(FILE *out, int depth, int end, int slot, const char *value) {
+    line(out, "if (IS_UNDEFINED(%s)) {", value);
+    line(out, "    vm.stackTop = slots + %d;", depth);
+    line(out, "    jitUndefinedGlobal(AOT_IP(%d), %d);", end, slot);
+    line(out, "    return JIT_ERROR;");
+    line(out, "}");
+}
+
+static void writeExit(FILE *out, int depth, int offset) {
+    writeSpill(out, depth);
+    line(out, "jitExit(AOT_IP(%d));", offset);
+    line(out, "return JIT_EXITED;");
+}
+
+static void writeFunction(FILE *out, Program *program, int index) {
+    ObjFunction *function = program->functions[index];
+    Chunk *chunk = &function->chunk;
+    int *depths = ALLOCATE(int, chunk->count + 1);
+    stackDepths(chunk, function->arity + 1, depths);
+
+    // Labels for the entry points: the start and every jump target.
+    bool *isTarget = ALLOCATE(bool, chunk->count + 1);
+    for (int offset = 0; offset <= chunk->count; offset++) {
+        isTarget[offset] = offset == 0;
+    }
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (isJump(chunk->code[offset])) {
+            isTarget[jumpTarget(chunk, offset)] = true;
+        }
+        if (chunk->code[offset] == OP_SWITCH) {
+            ObjSwitch *table = AS_SWITCH(chunk->constants.values[chunk->code[offset + 3]]);
+            for (int i = 0; i < table->caseCount; i++) {
+                isTarget[table->cases[i]] = true;
+            }
+        }
+    }
+    // Which global each stack slot was loaded from, to spot calls of a
+    // declared function.
+    int slotCount = function->maxStack + 2;
+    int *loadedGlobal = ALLOCATE(int, slotCount);
+
+    if (function->name == NULL) {
+        fprintf(out, "// script\n");
+    } else {
+        fprintf(out, "// %s()\n", function->name->chars);
+    }
+    fprintf(out, "static int function%d(Value *slots, int offset) {\n", index);
+    for (int i = 1; i < function->maxStack; i++) {
+        line(out, "AOT_UNUSED Value s%d;", i);
+    }
+    line(out, "switch (offset) {");
+    for (int offset = 0; offset <= chunk->count; offset++) {
+        if (isTarget[offset]) {
+            line(out, "case %d:", offset);
+            writeReload(out, depths[offset]);
+            line(out, "    goto at%d;", offset);
+        }
+    }
+    line(out, "default:");
+    line(out, "    return JIT_EXITED;");
+    line(out, "}");
+
+    // Code after a jump or return is left out until a label makes it
+    // reachable again.
+    bool reachable = true;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        int depth = depths[offset];
+        int end = offset + instructionLength(chunk, offset);
+        int top = depth - 1;
+        char constant[64];
+
+        if (isTarget[offset]) {
+            fprintf(out, "at%d:\n", offset);
+            for (int i = 0; i < slotCount; i++) {
+                loadedGlobal[i] = -1;
+            }
+            reachable = true;
+        }
+        if (!reachable) {
+            continue;
+        }
+
+        switch (genericInstruction(code[0])) {
+            case OP_CONSTANT:
+                formatConstant(constant, sizeof(constant),
+                               chunk->constants.values[code[1]], code[1]);
+                line(out, "s%d = %s;", depth, constant);
+                break;
+            case OP_NIL:    line(out, "s%d = NIL_VALUE;", depth); break;
+            case OP_TRUE:   line(out, "s%d = BOOL_VALUE(true);", depth); break;
+            case OP_FALSE:  line(out, "s%d = BOOL_VALUE(false);", depth); break;
+            case OP_POP:
+            case OP_POPN:
+                break;
+            case OP_GET_LOCAL:
+                writeLocal(out, depth, code[1]);
+                break;
+            case OP_GET_LOCAL_0:
+            case OP_GET_LOCAL_1:
+            case OP_GET_LOCAL_2:
+            case OP_GET_LOCAL_3:
+                writeLocal(out, depth, code[0] - OP_GET_LOCAL_0);
+                break;
+            case OP_SET_LOCAL:
+                line(out, "s%d = s%d;", code[1], top);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_DEFINED: {
+                int slot = (code[1] << 8) | code[2];
+                line(out, "s%d = vm.globalValues.values[%d];", depth, slot);
+                char value[32];
+                snprintf(value, sizeof(value), "s%d", depth);
+                writeGlobalCheck(out, depth, end, slot, value);
+                break;
+            }
+            case OP_DEFINE_GLOBAL:
+                line(out, "vm.globalValues.values[%d] = s%d;", (code[1] << 8) | code[2], top);
+                break;
+            case OP_SET_GLOBAL: {
+                int slot = (code[1] << 8) | code[2];
+                char value[48];
+                snprintf(value, sizeof(value), "vm.globalValues.values[%d]", slot);
+                writeGlobalCheck(out, depth, end, slot, value);
+                line(out, "%s = s%d;", value, top);
+                break;
+            }
+            case OP_GET_UPVALUE:
+                line(out, "s%d = *AOT_UPVALUE(%d)->location;", depth, code[1]);
+                break;
+            case OP_SET_UPVALUE:
+                line(out, "*AOT_UPVALUE(%d)->location = s%d;", code[1], top);
+                break;
+            case OP_EQUAL:
+                line(out, "s%d = BOOL_VALUE(valuesEqual(s%d, s%d));", top - 1, top - 1, top);
+                break;
+            case OP_NOT_EQUAL:
+                line(out, "s%d = BOOL_VALUE(!valuesEqual(s%d, s%d));", top - 1, top - 1, top);
+                break;
+            case OP_GREATER:
+                writeBinary(out, depth, end, "OP_GREATER", "BOOL_VALUE(greaterNumbers(s%d, s%d))");
+                break;
+            case OP_GREATER_EQUAL:
+                writeBinary(out, depth, end, "OP_GREATER_EQUAL", "BOOL_VALUE(!lessNumbers(s%d, s%d))");
+                break;
+            case OP_LESS:
+                writeBinary(out, depth, end, "OP_LESS", "BOOL_VALUE(lessNumbers(s%d, s%d))");
+                break;
+            case OP_LESS_EQUAL:
+                writeBinary(out, depth, end, "OP_LESS_EQUAL", "BOOL_VALUE(!greaterNumbers(s%d, s%d))");
+                break;
+            case OP_ADD:
+            case OP_ADD_NUMBER:
+            case OP_ADD_STRING:
+                writeBinary(out, depth, end, "OP_ADD", "addNumbers(s%d, s%d)");
+                break;
+            case OP_SUBTRACT:
+                writeBinary(out, depth, end, "OP_SUBTRACT", "subtractNumbers(s%d, s%d)");
+                break;
+            case OP_MULTIPLY:
+                writeBinary(out, depth, end, "OP_MULTIPLY", "multiplyNumbers(s%d, s%d)");
+                break;
+            case OP_DIVIDE:
+                writeBinary(out, depth, end, "OP_DIVIDE", "divideNumbers(s%d, s%d)");
+                break;
+            case OP_MODULO:
+                writeBinary(out, depth, end, "OP_MODULO", "moduloNumbers(s%d, s%d)");
+                break;
+            case OP_NOT:
+                line(out, "s%d = BOOL_VALUE(aotFalsey(s%d));", top, top);
+                break;
+            case OP_NEGATE:
+                line(out, "if (IS_NUMBER(s%d)) {", top);
+                line(out, "    s%d = negateNumber(s%d);", top, top);
+                line(out, "} else {");
+                writeSpill(out, depth);
+                line(out, "jitUnary(AOT_IP(%d), OP_NEGATE);", end);
+                line(out, "return JIT_ERROR;");
+                line(out, "}");
+                break;
+            case OP_PRINT:
+                writeSpill(out, depth);
+                line(out, "jitPrint();");
+                break;
+            case OP_JUMP_IF_FALSE:
+                line(out, "if (aotFalsey(s%d)) goto at%d;", top, jumpTarget(chunk, offset));
+                break;
+            case OP_JUMP:
+                line(out, "goto at%d;", jumpTarget(chunk, offset));
+                reachable = false;
+                break;
+            case OP_LOOP:
+                writeTick(out, depth, end);
+                line(out, "goto at%d;", jumpTarget(chunk, offset));
+                reachable = false;
+                break;
+            case OP_SWITCH: {
+                ObjSwitch *table = AS_SWITCH(chunk->constants.values[code[3]]);
+                line(out, "switch (switchCase(AS_SWITCH(AOT_CONSTANT(%d)), s%d)) {", code[3], top);
+                for (int i = 0; i < table->caseCount; i++) {
+                    line(out, "    case %d: goto at%d;", i, table->cases[i]);
+                }
+                line(out, "    default: goto at%d;", jumpTarget(chunk, offset));
+                line(out, "}");
+                reachable = false;
+                break;
+            }
+            case OP_DUP:
+                line(out, "s%d = s%d;", depth, top);
+                break;
+            case OP_CALL: {
+                int argCount = code[1];
+                int callee = depth - argCount - 1;
+                ObjFunction *known = NULL;
+                if (callee >= 0 && loadedGlobal[callee] >= 0 &&
+                    loadedGlobal[callee] < program->globalCount) {
+                    known = program->globals[loadedGlobal[callee]];
+                }
+                char target[32] = "NULL";
+                if (known != NULL && known->arity == argCount && !known->memoized) {
+                    snprintf(target, sizeof(target), "function%d", functionIndex(program, known));
+                }
+                writeSpill(out, depth);
+                line(out, "slots = aotCall(slots + %d, %d, %d, %s);", depth, end, argCount, target);
+                line(out, "if (slots == NULL) return JIT_ERROR;");
+                writeReload(out, callee + 1);
+                break;
+            }
+            case OP_CALL_NATIVE: {
+                int callee = depth - code[1] - 1;
+                if (IS_INTRINSIC(code[0])) {
+                    line(out, "if (!IS_OBJ(s%d) || AS_OBJ(s%d) != AS_OBJ(AOT_CONSTANT(%d)) ||",
+                         callee, callee, code[2]);
+                    line(out, "    !mathIntrinsic(%d, (Value[]) {s%d, s%d}, &s%d)) {",
+                         code[0], callee + 1, depth - 1, callee);
+                }
+                writeSpill(out, depth);
+                line(out, "slots = aotCallNative(slots + %d, %d, %d, AOT_CONSTANT(%d));",
+                     depth, end, code[1], code[2]);
+                line(out, "if (slots == NULL) return JIT_ERROR;");
+                writeReload(out, callee + 1);
+                if (IS_INTRINSIC(code[0])) {
+                    line(out, "}");
+                }
+                break;
+            }
+            case OP_CALL_KNOWN: {
+                int argCount = code[3];
+                int callee = depth - argCount - 1;
+                int target = jumpTarget(chunk, offset);
+                ObjFunction *known = AS_FUNCTION(chunk->constants.values[code[4]]);
+                int index = functionIndex(program, known);
+                char function[32] = "NULL";
+                if (index != -1) {
+                    snprintf(function, sizeof(function), "function%d", index);
+                }
+                if (hasInlinedBody(chunk, offset)) {
+                    line(out, "if (!IS_CLOSURE(s%d) || AS_CLOSURE(s%d)->function != "
+                              "AS_FUNCTION(AOT_CONSTANT(%d))) {", callee, callee, code[4]);
+                }
+                writeSpill(out, depth);
+                line(out, "slots = aotCall(slots + %d, %d, %d, %s);", depth, target, argCount, function);
+                line(out, "if (slots == NULL) return JIT_ERROR;");
+                writeReload(out, callee + 1);
+                if (hasInlinedBody(chunk, offset)) {
+                    line(out, "goto at%d;", target);
+                    line(out, "}");
+                }
+                break;
+            }
+            case OP_TAIL_CALL:
+                writeSpill(out, depth);
+                line(out, "switch (jitTailCall(AOT_IP(%d), %d)) {", end, code[1]);
+                line(out, "    case -1: return JIT_ERROR;");
+                line(out, "    case 1: return JIT_TAIL_CALLED;");
+                line(out, "}");
+                line(out, "slots = vm.frames[vm.frameCount - 1].slots;");
+                writeReload(out, depth - code[1]);
+                break;
+            case OP_CLOSURE:
+                writeSpill(out, depth);
+                line(out, "jitClosure(AOT_IP(%d));", offset + 1);
+                writeReload(out, depth + 1);
+                break;
+            case OP_CLOSE_UPVALUE:
+                writeSpill(out, depth);
+                line(out, "jitCloseUpvalue();");
+                break;
+            case OP_RETURN_MEMO:
+                // Never runs, see attachFunctions().
+            case OP_RETURN:
+                // Closed upvalues take the value the slot has in memory.
+                if (function->capturesLocals) {
+                    writeSpill(out, depth);
+                } else if (top > 0) {
+                    line(out, "slots[%d] = s%d;", top, top);
+                }
+                line(out, "aotReturn(slots, slots + %d, %s);", depth,
+                     function->capturesLocals ? "true" : "false");
+                line(out, "return JIT_RETURNED;");
+                reachable = false;
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+                writeCompareJump(out, depth, end, jumpTarget(chunk, offset), "OP_JUMP_IF_NOT_LESS",
+                                 "!lessNumbers(s%d, s%d)");
+                break;
+            case OP_JUMP_IF_NOT_LESS_EQUAL:
+                writeCompareJump(out, depth, end, jumpTarget(chunk, offset), "OP_JUMP_IF_NOT_LESS_EQUAL",
+                                 "greaterNumbers(s%d, s%d)");
+                break;
+            case OP_JUMP_IF_NOT_GREATER:
+                writeCompareJump(out, depth, end, jumpTarget(chunk, offset), "OP_JUMP_IF_NOT_GREATER",
+                                 "!greaterNumbers(s%d, s%d)");
+                break;
+            case OP_JUMP_IF_NOT_GREATER_EQUAL:
+                writeCompareJump(out, depth, end, jumpTarget(chunk, offset), "OP_JUMP_IF_NOT_GREATER_EQUAL",
+                                 "lessNumbers(s%d, s%d)");
+                break;
+            case OP_JUMP_IF_NOT_EQUAL:
+                line(out, "if (!valuesEqual(s%d, s%d)) goto at%d;", top - 1, top, jumpTarget(chunk, offset));
+                break;
+            case OP_JUMP_IF_EQUAL:
+                line(out, "if (valuesEqual(s%d, s%d)) goto at%d;", top - 1, top, jumpTarget(chunk, offset));
+                break;
+            case OP_INC_LOCAL:
+                formatConstant(constant, sizeof(constant),
+                               chunk->constants.values[code[2]], code[2]);
+                writeLocal(out, depth, code[1]);
+                line(out, "s%d = %s;", depth + 1, constant);
+                writeBinary(out, depth + 2, end, "OP_ADD", "addNumbers(s%d, s%d)");
+                line(out, "s%d = s%d;", code[1], depth);
+                break;
+            case OP_FOR_PREP:
+            case OP_FOR_LOOP:
+                writeCountingLoop(out, chunk, offset, depth, end);
+                break;
+            case OP_ADD_LOCALS:
+                writeLocal(out, depth, code[1]);
+                writeLocal(out, depth + 1, code[2]);
+                writeBinary(out, depth + 2, end, "OP_ADD", "addNumbers(s%d, s%d)");
+                break;
+            default:
+                // OP_CLASS, run() does the rest of the frame.
+                writeExit(out, depth, offset);
+                reachable = false;
+                break;
+        }
+
+        // The slots the instruction wrote no longer hold what they were
+        // loaded from.
+        for (int i = depth - operandCount(chunk, offset); i < slotCount; i++) {
+            if (i >= 0) {
+                loadedGlobal[i] = -1;
+            }
+        }
+        if (code[0] == OP_GET_GLOBAL || code[0] == OP_GET_GLOBAL_DEFINED) {
+            loadedGlobal[depth] = (code[1] << 8) | code[2];
+        }
+    }
+    if (isTarget[chunk->count]) {
+        fprintf(out, "at%d:\n", chunk->count);
+        writeExit(out, depths[chunk->count], chunk->count);
+    }
+    fprintf(out, "}\n\n");
+
+    FREE_ARRAY(int, loadedGlobal, slotCount);
+    FREE_ARRAY(bool, isTarget, chunk->count + 1);
+    FREE_ARRAY(int, depths, chunk->count + 1);
+}
+
+// The script as a C string literal.
+static void writeSource(FILE *out, const char *source) {
+    fprintf(out, "static const char source[] =\n    \"");
+    for (const char *c = source; *c != '\0'; c++) {
+        switch (*c) {
+            case '\n':
+                fputs(c[1] == '\0' ? "\\n" : "\\n\"\n    \"", out);
+                break;
+            case '"':   fputs("\\\"", out); break;
+            case '\\':  fputs("\\\\", out); break;
+            case '?':   fputs("\\?", out); break;   // no trigraphs
+            case '\t':  fputs("\\t", out); break;
+            default:
+                if (*c < ' ' || *c > '~') {
+                    fprintf(out, "\\%03o", (unsigned char) *c);
+                } else {
+                    fputc(*c, out);
+                }
+                break;
+        }
+    }
+    fprintf(out, "\";\n\n");
+}
+
+void aotWrite(FILE *out, ObjFunction *script, const char *source) {
+    // Keeps the script alive while the tables below are allocated.
+    push(OBJ_VALUE(script));
+
+    Program program;
+    program.functions = NULL;
+    program.count = 0;
+    program.capacity = 0;
+    collectFunctions(&program, script);
+    findDeclarations(&program, script);
+
+    fprintf(out, "// Written by clox --emit-c, see aot.h.\n\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    for (int i = 0; i < program.count; i++) {
+        fprintf(out, "static int function%d(Value *slots, int offset);\n", i);
+    }
+    fprintf(out, "\n");
+    for (int i = 0; i < program.count; i++) {
+        writeFunction(out, &program, i);
+    }
+
+    writeSource(out, source);
+    fprintf(out, "static const AotFunction functions[] = {\n");
+    for (int i = 0; i < program.count; i++) {
+        line(out, "function%d,", i);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "static const int codeSizes[] = {\n");
+    for (int i = 0; i < program.count; i++) {
+        line(out, "%d,", program.functions[i]->chunk.count);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int main() {\n");
+    line(out, "initVM();");
+    line(out, "InterpretResult result = aotInterpret(source, functions, codeSizes, %d);",
+         program.count);
+    line(out, "if (result == INTERPRET_COMPILE_ERROR) return 65;");
+    line(out, "if (result == INTERPRET_RUNTIME_ERROR) return 70;");
+    line(out, "freeVM();");
+    line(out, "return 0;");
+    fprintf(out, "}\n");
+
+    FREE_ARRAY(ObjFunction *, program.globals, program.globalCount);
+    FREE_ARRAY(ObjFunction *, program.functions, program.capacity);
+    pop();
+}
+
+// Hands out the C functions in the order collectFunctions() numbered them.
+static bool attachFunctions(ObjFunction *function, const AotFunction *functions,
+                            const int *codeSizes, int count, int *next) {
+    if (*next == count || function->chunk.count != codeSizes[*next]) {
+        return false;
+    }
+    // A memo fun stays on the interpreter, which has OP_RETURN_MEMO.
+    if (!function->memoized) {
+        function->aot = functions[*next];
+    }
+    (*next)++;
+
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i]) &&
+            !attachFunctions(AS_FUNCTION(constants->values[i]), functions, codeSizes, count, next)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+InterpretResult aotInterpret(const char *source, const AotFunction *functions,
+                             const int *codeSizes, int count) {
+    ObjFunction *script = compile(source);
+    if (script == NULL) {
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    int next = 0;
+    if (!attachFunctions(script, functions, codeSizes, count, &next) || next != count) {
+        fprintf(stderr, "The compiled program doesn't match its script, emit it again.\n");
+        return INTERPRET_COMPILE_ERROR;
+    }
+    return interpretScript(script);
+}
@@ -0,0 +1,134 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include <stdio.h>
+
+#include "intrinsic.h"
+#include "jit.h"
+
+/*
+ * Ahead-of-time compilation of a script to C. Every function of the script
+ * becomes one C function that runs its frame the way run() would, with the
+ * stack depth of each instruction worked out beforehand so locals and
+ * temporaries are addressed as slots[n] directly. Calls to a function a
+ * global was declared with go straight to its C function as long as the
+ * global still holds it. The few instructions without a translation
+ * (OP_CLASS) hand the frame to the interpreter.
+ *
+ * The emitted file keeps the source of the script, which is compiled again
+ * when the program starts so the bytecode, constants and global slots are
+ * exactly the ones the C was written for. It is built against the lox
+ * library:
+ *
+ *     clox --emit-c fib.c fib.lox
+ *     cc -O2 -I<clox> fib.c -L<build> -llox -lm
+ */
+
+/**
+ * Write the C translation of *script* to *out*.
+ * @param out
+ * @param script what compile() returned for *source*
+ * @param source the text of the script
+ */
+void aotWrite(FILE *out, ObjFunction *script, const char *source);
+
+/**
+ * Compile *source* and run it with the C functions of an emitted program.
+ * @param source the script the program was written for
+ * @param functions one per function of the script, in the order aotWrite()
+ *                  numbered them
+ * @param codeSizes the bytecode size of each, to notice a script or compiler
+ *                  that changed since
+ * @param count
+ */
+InterpretResult aotInterpret(const char *source, const AotFunction *functions,
+                             const int *codeSizes, int count);
+
+/*
+ * Used by the emitted code, which always has the current frame's slots in
+ * a local called "slots".
+ */
+
+// Not every function reads all of its slot variables.
+#if defined(__GNUC__)
+#define AOT_UNUSED __attribute__((unused))
+#else
+#define AOT_UNUSED
+#endif
+
+#define AOT_FUNCTION()      (vm.frames[vm.frameCount - 1].closure->function)
+#define AOT_UPVALUE(index)  (vm.frames[vm.frameCount - 1].closure->upvalues[index])
+#define AOT_IP(offset)      (AOT_FUNCTION()->chunk.code + (offset))
+#define AOT_CONSTANT(index) (AOT_FUNCTION()->chunk.constants.values[index])
+
+static inline bool aotFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// OP_CALL ending at *offset* with the stack up to *top*. *known* is the C
+// function of the closure the call site expects, which is called directly
+// when the callee is that closure. Returns the caller's slots, which the
+// call may have moved, or NULL after an error.
+static inline Value *aotCall(Value *top, int offset, int argCount, AotFunction known) {
+    vm.stackTop = top;
+    Value callee = top[-argCount - 1];
+    if (known == NULL || !IS_CLOSURE(callee) ||
+        AS_CLOSURE(callee)->function->aot != known || vm.jitDepth >= JIT_DEPTH_MAX ||
+        --vm.fuel < 0) {
+        // Out of fuel, pushFrame() polls.
+        return jitCall(AOT_IP(offset), argCount);
+    }
+
+    // What call() does, when there is room for the frame.
+    ObjClosure *closure = AS_CLOSURE(callee);
+    Value *slots = top - argCount - 1;
+    if (vm.frameCount < vm.frameCapacity &&
+        slots + closure->function->maxStack <= vm.stack + vm.stackCapacity) {
+        vm.frames[vm.frameCount - 1].ip = AOT_IP(offset);
+        CallFrame *frame = &vm.frames[vm.frameCount++];
+        frame->closure = closure;
+        frame->ip = closure->function->chunk.code;
+        frame->slots = slots;
+    } else if (!jitPushFrame(AOT_IP(offset), argCount)) {
+        return NULL;
+    }
+    vm.jitDepth++;
+    JitResult status = (JitResult) known(vm.frames[vm.frameCount - 1].slots, 0);
+    vm.jitDepth--;
+    if (status != JIT_RETURNED && !jitFinishCall(status)) {
+        return NULL;
+    }
+    return vm.frames[vm.frameCount - 1].slots;
+}
+
+// OP_CALL_NATIVE ending at *offset*, bound to *native*, which is called
+// directly while it is still the callee. Returns like aotCall().
+static inline Value *aotCallNative(Value *top, int offset, int argCount, Value native) {
+    Value *callee = top - argCount - 1;
+    if (!IS_OBJ(*callee) || AS_OBJ(*callee) != AS_OBJ(native)) {
+        return aotCall(top, offset, argCount, NULL);
+    }
+    vm.stackTop = top;
+    vm.frames[vm.frameCount - 1].ip = AOT_IP(offset);
+    if (!AS_NATIVE(native)->function(argCount, callee + 1, callee)) {
+        return NULL;
+    }
+    vm.stackTop = callee + 1;
+    return vm.frames[vm.frameCount - 1].slots;
+}
+
+// OP_RETURN of the value below *top*. Only a function that *captures* its
+// locals can have upvalues to close.
+static inline void aotReturn(Value *slots, Value *top, bool captures) {
+    vm.stackTop = top;
+    if (vm.frameCount == 1 ||
+        (captures && vm.openUpvalues != NULL && vm.openUpvalues->location >= slots)) {
+        jitReturn();
+        return;
+    }
+    vm.frameCount--;
+    slots[0] = top[-1];
+    vm.stackTop = slots + 1;
+}
+
+#endif //CLOX_AOT_H
@@ -39,4 +39,227 @@ int addConstant(Chunk *chunk, Value value){
     writeValueArray(&chunk->constants, value);
     pop();
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+// The size in bytes of the instruction at *offset*, opcode included.
+int instructionLength(Chunk *chunk, int offset) {
+    switch (genericInstruction(chunk->code[offset])) {
+        case OP_CLASS:
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_POPN:
+            return 2;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+        case OP_INC_LOCAL:
+        case OP_ADD_LOCALS:
+        case OP_CALL_NATIVE:
+            return 3;
+        case OP_SWITCH:
+            return 4;
+        case OP_CALL_KNOWN:
+            return 5;
+        case OP_FOR_PREP:
+            return 6;
+        case OP_FOR_LOOP:
+            return 7;
+        case OP_CLOSURE: {
+            uint8_t constant = chunk->code[offset + 1];
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 2 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+bool isJump(uint8_t instruction) {
+    switch (genericInstruction(instruction)) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+        case OP_SWITCH:
+        case OP_CALL_KNOWN:
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool jumpsBack(uint8_t instruction) {
+    return instruction == OP_LOOP || instruction == OP_FOR_LOOP;
+}
+
+// The offset the jump instruction at *offset* lands on.
+int jumpTarget(Chunk *chunk, int offset) {
+    uint16_t jump = (uint16_t) ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    if (jumpsBack(chunk->code[offset])) {
+        return offset + 3 - jump;
+    }
+    return offset + 3 + jump;
+}
+
+bool hasInlinedBody(Chunk *chunk, int offset) {
+    return jumpTarget(chunk, offset) != offset + 5;
+}
+
+uint8_t genericInstruction(uint8_t instruction) {
+    return IS_INTRINSIC(instruction) ? OP_CALL_NATIVE : instruction;
+}
+
+// How much the instruction at *offset* changes the stack depth by, and in
+// *peak* how far above the depth before it the stack gets while it runs.
+static int stackEffect(Chunk *chunk, int offset, int *peak) {
+    uint8_t *code = &chunk->code[offset];
+    *peak = 0;
+    switch (genericInstruction(code[0])) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_0:
+        case OP_GET_LOCAL_1:
+        case OP_GET_LOCAL_2:
+        case OP_GET_LOCAL_3:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED:
+        case OP_GET_UPVALUE:
+        case OP_DUP:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            *peak = 1;
+            return 1;
+        case OP_ADD_LOCALS:
+            // The slow path pushes both operands before adding them.
+            *peak = 2;
+            return 1;
+        case OP_INC_LOCAL:
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            // Their slow paths push two operands.
+            *peak = 2;
+            return 0;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_RETURN_MEMO:
+            return -1;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            return -2;
+        case OP_POPN:
+            return -code[1];
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_NATIVE:
+            // The callee and its arguments are replaced by the result.
+            return -code[1];
+        case OP_CALL_KNOWN:
+            // Into the inlined body everything stays where it is.
+            return hasInlinedBody(chunk, offset) ? 0 : -code[3];
+        default:
+            return 0;
+    }
+}
+
+// Records the depth before every instruction in *depths* and returns the
+// highest one reached.
+static int walkStack(Chunk *chunk, int depth, int *depths) {
+    for (int offset = 0; offset <= chunk->count; offset++) {
+        depths[offset] = -1;
+    }
+
+    int max = depth;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        // Code right after a jump or return is only reached by jumping
+        // there, whatever depth the jump had is the one that counts.
+        if (depths[offset] != -1) {
+            depth = depths[offset];
+        }
+        depths[offset] = depth;
+
+        int peak;
+        int effect = stackEffect(chunk, offset, &peak);
+        if (depth + peak > max) {
+            max = depth + peak;
+        }
+        depth += effect;
+
+        if (isJump(chunk->code[offset])) {
+            int target = jumpTarget(chunk, offset);
+            // A call around an inlined body leaves its result where the
+            // callee was.
+            int targetDepth = chunk->code[offset] == OP_CALL_KNOWN ?
+                              depths[offset] - chunk->code[offset + 3] : depth;
+            if (target >= 0 && target <= chunk->count && depths[target] == -1) {
+                depths[target] = targetDepth;
+            }
+        }
+        if (chunk->code[offset] == OP_SWITCH) {
+            ObjSwitch *table = AS_SWITCH(chunk->constants.values[chunk->code[offset + 3]]);
+            for (int i = 0; i < table->caseCount; i++) {
+                if (depths[table->cases[i]] == -1) {
+                    depths[table->cases[i]] = depth;
+                }
+            }
+        }
+    }
+
+    return max;
+}
+
+int maxStackDepth(Chunk *chunk, int depth) {
+    int *depths = ALLOCATE(int, chunk->count + 1);
+    int max = walkStack(chunk, depth, depths);
+    FREE_ARRAY(int, depths, chunk->count + 1);
+    return max;
+}
+
+void stackDepths(Chunk *chunk, int depth, int *depths) {
+    walkStack(chunk, depth, depths);
+}
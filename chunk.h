@@ -28,6 +28,7 @@ typedef enum {
 	OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_MODULO,
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
@@ -36,10 +37,97 @@ typedef enum {
     OP_LOOP,
     OP_DUP,
     OP_CALL,
+    OP_TAIL_CALL,       // an OP_CALL right before OP_RETURN
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
+
+    // Compare the two numbers on top of the stack, pop them and jump
+    // when the comparison a condition was written with is false.
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+
+    // Look the value on top of the stack up in the ObjSwitch constant after
+    // the jump offset and go to the case it matches, or jump when none does.
+    // The value stays on the stack either way.
+    OP_SWITCH,
+
+    // OP_CALL of the function constant after the argument count, which the
+    // global being called was declared with (see inliner.h). When the callee
+    // is a closure of that function its body follows, inlined, up to the
+    // jump target; otherwise the call is made as usual and continues there.
+    // A call with nothing inlined jumps to the next instruction.
+    OP_CALL_KNOWN,
+
+    // OP_CALL of the native constant after the argument count, which the
+    // global being called held when the call was compiled and whose arity
+    // the count matches. Called directly while the callee is still that
+    // native, like OP_CALL otherwise.
+    OP_CALL_NATIVE,
+
+    // A counting "for" loop, see forStatement() in compiler.c. Operands are
+    // the jump offset, the local slot of the counter, the limit (a local
+    // slot or, with FOR_CONSTANT_LIMIT, a constant) and FOR_ flags.
+    // OP_FOR_PREP jumps past the loop unless the counter is below the limit.
+    // OP_FOR_LOOP, which also takes the step constant, adds the step to the
+    // counter and jumps back to the body while it is still below the limit.
+    // Both read the counter and limit anew each time, like the condition
+    // and increment they replace.
+    OP_FOR_PREP,
+    OP_FOR_LOOP,
+
+    // OP_RETURN of a "memo fun", which also stores the result, see
+    // callMemoized() in vm.c.
+    OP_RETURN_MEMO,
+
+    // All there is to a function whose body is compiled at its first call,
+    // see compileFunction().
+    OP_COMPILE,
+
+    // OP_CALL_NATIVE of one of the math builtins, worked out in place rather
+    // than called while the callee is still that native, see intrinsic.h.
+    // Laid out like it, and genericInstruction() gives OP_CALL_NATIVE.
+    OP_SQRT,
+    OP_FLOOR,
+    OP_CEIL,
+    OP_ABS,
+    OP_SIN,
+    OP_COS,
+    OP_TAN,
+    OP_ATAN,
+    OP_MIN,
+    OP_MAX,
+    OP_POW,
+    OP_FMOD,
+
+    // Superinstructions, only produced by optimizeChunk().
+    OP_GET_LOCAL_0,
+    OP_GET_LOCAL_1,
+    OP_GET_LOCAL_2,
+    OP_GET_LOCAL_3,
+    OP_POPN,
+    OP_INC_LOCAL,
+    OP_ADD_LOCALS,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+
+    // Quickened forms, only written by run() over the instruction they
+    // specialize, see vm.c.
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_GET_GLOBAL_DEFINED,
 } OpCode;
 
+#define IS_INTRINSIC(instruction) ((instruction) >= OP_SQRT && (instruction) <= OP_FMOD)
+
+// Flags of OP_FOR_PREP and OP_FOR_LOOP.
+#define FOR_INCLUSIVE       0x01    // "<=" rather than "<"
+#define FOR_CONSTANT_LIMIT  0x02
+
 typedef struct {
 	int count;
 	int capacity;
@@ -52,6 +140,37 @@ void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int instructionLength(Chunk *chunk, int offset);
+bool isJump(uint8_t instruction);
+// Whether the jump *instruction* goes backwards.
+bool jumpsBack(uint8_t instruction);
+int jumpTarget(Chunk *chunk, int offset);
+
+/**
+ * Whether the OP_CALL_KNOWN at *offset* is followed by the inlined body of
+ * its function rather than just making the call.
+ */
+bool hasInlinedBody(Chunk *chunk, int offset);
+
+/**
+ * The instruction *instruction* is laid out like and stands for, which is
+ * *instruction* itself unless it is the OP_CALL_NATIVE a math intrinsic
+ * replaced.
+ */
+uint8_t genericInstruction(uint8_t instruction);
+
+/**
+ * The most values the code in *chunk* can have on the stack of its frame at
+ * once, *depth* being how many are there when it starts (the callee and its
+ * arguments).
+ */
+int maxStackDepth(Chunk *chunk, int depth);
+
+/**
+ * Fill *depths*, which has room for chunk->count + 1 entries, with the stack
+ * depth before each instruction, -1 at offsets where no instruction starts.
+ */
+void stackDepths(Chunk *chunk, int depth, int *depths);
 
 #endif
 
@@ -11,6 +11,32 @@
 //#define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
+// Dispatch instructions in run() through a table of label addresses
+// (computed goto) instead of a switch. Needs the GCC/Clang "labels as
+// values" extension, so other compilers always get the switch.
+#if defined(__GNUC__)
+#define THREADED_DISPATCH
+#endif
+
+// Pack every Value into a single 64-bit word using the spare bits of quiet
+// NaN doubles instead of a tagged struct. Halves the size of the VM stack,
+// constant arrays and hash table entries, see benchmark/README.md.
+//#define NAN_BOXING
+
+// Compile hot functions to machine code, see jit.h. The code generator only
+// knows x86-64 and gets its executable memory from mmap().
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_COMPILER
+#endif
+
+// Keeps a rarely taken path from being inlined into, and slowing down, the
+// common one next to it.
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
@@ -1,13 +1,17 @@
 //
 // Created by Javen on 2021/1/12.
 //
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "inliner.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "registers.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -18,6 +22,27 @@
 Parser parser;
 Compiler *current = NULL;
 
+// The function each global slot was last declared with by a "fun" at the
+// top level of the script being compiled, NULL for the rest.
+static struct {
+    ObjFunction **functions;
+    int count;
+    int capacity;
+} declared;
+
+// The source of the script being compiled, and the copy of it the functions
+// left for their first call compile from, made along with the first one.
+static struct {
+    const char *source;
+    ObjString *copy;
+} script;
+
+// How many of vm.globalConstants the code being compiled may fold, -1 for
+// all of them. A body compiled at its first call only sees the ones
+// declared before the function, like it would have when compiled with the
+// script (see compileFunction()).
+static int visibleConstants = -1;
+
 static Chunk *currentChunk() {
     return &current->function->chunk;
 }
@@ -97,6 +122,26 @@ static int emitJump(uint8_t instruction) {
     return currentChunk()->count - 2;
 }
 
+// Emit the jump that skips a branch when the condition just compiled is
+// false. A comparison that ends the condition is replaced by one of the
+// OP_JUMP_IF_NOT_* instructions, which consumes its operands. Otherwise the
+// condition stays on the stack and the caller has to pop it on both paths,
+// "*fused*" tells which one happened.
+static int emitConditionJump(bool *fused) {
+    *fused = current->comparisonEnd == currentChunk()->count &&
+             current->lastJumpTarget != currentChunk()->count;
+    if (!*fused) {
+        int jump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+        return jump;
+    }
+
+    // A jump landing right after the comparison (from "and"/"or") would
+    // need the boolean, that is what lastJumpTarget rules out above.
+    currentChunk()->count = current->comparisonStart;
+    return emitJump(current->comparisonJump);
+}
+
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
 
@@ -111,17 +156,31 @@ static void emitLoop(int loopStart) {
 
 static void emitReturn() {
     emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    emitByte(current->type == TYPE_MEMO ? OP_RETURN_MEMO : OP_RETURN);
 }
 
 static ObjFunction *endCompiler() {
     emitReturn();
     ObjFunction *function = current->function;
 
+    if (!parser.hadError) {
+        inlineCalls(function, declared.functions, declared.count);
+        optimizeChunk(currentChunk());
+        function->maxStack = maxStackDepth(currentChunk(), function->arity + 1);
+        // Only run() knows to keep the results of a memo fun.
+        if (vm.registerEngine && !function->memoized) {
+            compileRegisters(function);
+        }
+    }
+
 #ifdef DEBUG_PRINT_CODE
     if(!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL ?
                     function->name->chars : "<script>");
+        if (function->registerCode.count > 0) {
+            disassembleRegisterCode(function, function->name != NULL ?
+                        function->name->chars : "<script>");
+        }
     }
 #endif
 
@@ -138,7 +197,6 @@ static void endScope() {
 
     while(current->localCount > 0 &&
         current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        emitByte(OP_POP);
         if (current->locals[current->localCount - 1].isCaptured) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
@@ -146,6 +204,11 @@ static void endScope() {
         }
         current->localCount--;
     }
+
+    while (current->constantCount > 0 &&
+           current->constants[current->constantCount - 1].depth > current->scopeDepth) {
+        current->constantCount--;
+    }
 }
 
 static void expression();
@@ -154,6 +217,7 @@ static void declaration();
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 static uint8_t makeConstant(Value value);
+static void emitConstant(Value value);
 static void patchJump(int offset);
 
 static uint8_t identifierConstant(Token *name) {
@@ -161,10 +225,29 @@ static uint8_t identifierConstant(Token *name) {
                                              name->length)));
 }
 
+// Globals are addressed by their slot in vm.globalValues. A name gets its
+// slot the first time any code mentions it, so code can refer to globals
+// that are only defined later.
+static uint16_t globalVariable(Token *name) {
+    int slot = resolveGlobal(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t) slot;
+}
+
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+    emitByte(instruction);
+    emitByte((slot >> 8) & 0xff);
+    emitByte(slot & 0xff);
+}
+
 static void beginLoop(int loopStart) {
     Loop *currentLoop = &current->loops[current->loopCount++];
     currentLoop->loopStart = loopStart;
     currentLoop->loopEndsCount = 0;
+    currentLoop->continueJumpsCount = 0;
 }
 
 static void continueLoop() {
@@ -172,6 +255,10 @@ static void continueLoop() {
         errorAtCurrent("illegal use of 'continue', 'continue' should use in 'while' and 'for'");
     }
     Loop *currentLoop = &current->loops[current->loopCount - 1];
+    if (currentLoop->loopStart == -1) {
+        currentLoop->continueJumps[currentLoop->continueJumpsCount++] = emitJump(OP_JUMP);
+        return;
+    }
 
     emitByte(OP_LOOP);
     int offset = currentChunk()->count - currentLoop->loopStart + 2;
@@ -221,6 +308,70 @@ static int resolveLocal(Compiler *compiler, Token *name) {
     return -1;
 }
 
+// Whether *name* refers to a "const" of *compiler*, of a function around it
+// or of an earlier script rather than to a variable, with its value in
+// *value*.
+static bool resolveConstant(Compiler *compiler, Token *name, Value *value) {
+    for (; compiler != NULL; compiler = compiler->enclosing) {
+        int local = compiler->localCount - 1;
+        while (local >= 0 && !identifiersEqual(name, &compiler->locals[local].name)) {
+            local--;
+        }
+        for (int i = compiler->constantCount - 1; i >= 0; i--) {
+            Constant *constant = &compiler->constants[i];
+            if (identifiersEqual(name, &constant->name)) {
+                if (local >= constant->localCount) {
+                    return false;
+                }
+                *value = constant->value;
+                return true;
+            }
+        }
+        if (local != -1) {
+            return false;
+        }
+    }
+    Value index;
+    if (vm.globalConstants.count == 0 ||
+        !tableGet(&vm.globalConstants, copyString(name->start, name->length), &index) ||
+        (visibleConstants >= 0 && AS_INT(index) >= visibleConstants)) {
+        return false;
+    }
+    *value = vm.globalConstantValues.values[AS_INT(index)];
+    return true;
+}
+
+// Whether a constant called *name* was declared in the current scope, at
+// the top level that includes the scripts compiled before.
+static bool isScopeConstant(Token *name) {
+    for (int i = current->constantCount - 1; i >= 0; i--) {
+        Constant *constant = &current->constants[i];
+        if (constant->depth < current->scopeDepth) {
+            break;
+        }
+        if (identifiersEqual(name, &constant->name)) {
+            return true;
+        }
+    }
+    Value value;
+    return current->type == TYPE_SCRIPT && current->scopeDepth == 0 &&
+           vm.globalConstants.count > 0 &&
+           tableGet(&vm.globalConstants, copyString(name->start, name->length), &value);
+}
+
+// Keep the "const"s of the script for the ones compiled after it, and for
+// the bodies of its functions compiled at their first call.
+static void saveGlobalConstants() {
+    for (int i = 0; i < current->constantCount; i++) {
+        Constant *constant = &current->constants[i];
+        ObjString *name = copyString(constant->name.start, constant->name.length);
+        push(OBJ_VALUE(name));
+        tableSet(&vm.globalConstants, name, INT_VALUE(vm.globalConstantValues.count));
+        writeValueArray(&vm.globalConstantValues, constant->value);
+        pop();
+    }
+}
+
 static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -250,6 +401,7 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
+        compiler->enclosing->function->capturesLocals = true;
         return addUpvalue(compiler, (uint8_t) local, true);
     }
 
@@ -273,12 +425,14 @@ static void addLocal(Token name) {
 }
 
 static void declareVariable() {
+    Token *name = &parser.previous;
+    if (isScopeConstant(name)) {
+        error("Already constant with this name in this scope.");
+    }
     if(current->scopeDepth == 0) {
         return;
     }
 
-    Token *name = &parser.previous;
-
     for(int i = current->localCount - 1; i >= 0; i--) {
         Local *local = &current->locals[i];
         if(local->depth != -1 && local->depth < current->scopeDepth) {
@@ -293,7 +447,7 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
@@ -301,7 +455,7 @@ static uint8_t parseVariable(const char *errorMessage) {
         return 0;
     }
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -311,13 +465,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     if(current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -355,26 +509,156 @@ static void or_(bool canAssign) {
     patchJump(endJump);
 }
 
+// Whether the code in [start, end) is a single instruction pushing a
+// constant, which is stored in *value*. Code some jump lands in or after
+// has to stay.
+static bool constantAt(int start, int end, Value *value) {
+    Chunk *chunk = currentChunk();
+    if (current->lastJumpTarget > start) {
+        return false;
+    }
+    if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+        *value = chunk->constants.values[chunk->code[start + 1]];
+        return true;
+    }
+    if (end - start != 1) {
+        return false;
+    }
+    switch (chunk->code[start]) {
+        case OP_NIL:    *value = NIL_VALUE; return true;
+        case OP_TRUE:   *value = BOOL_VALUE(true); return true;
+        case OP_FALSE:  *value = BOOL_VALUE(false); return true;
+        default:        return false;
+    }
+}
+
+// Remove the code from *start* on, one or two constants constantAt()
+// accepted, along with the table entries only they used.
+static void dropCode(int start) {
+    Chunk *chunk = currentChunk();
+    int indexes[2];
+    int count = 0;
+    for (int offset = start; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == OP_CONSTANT) {
+            indexes[count++] = chunk->code[offset + 1];
+        }
+    }
+    // Nothing was added to the table after the operands.
+    while (count > 0 && indexes[count - 1] == chunk->constants.count - 1) {
+        chunk->constants.count--;
+        count--;
+    }
+    chunk->count = start;
+}
+
+static void emitValue(Value value) {
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
+// Evaluate a binary operator on the constant operands from *leftStart* and
+// *rightStart* at compile time, leaving the ones it would fail on, or whose
+// result depends on the program, to the runtime.
+static bool foldBinary(TokenType operatorType, int leftStart, int rightStart) {
+    Value a, b;
+    if (!constantAt(leftStart, rightStart, &a) ||
+        !constantAt(rightStart, currentChunk()->count, &b)) {
+        return false;
+    }
+
+    Value result;
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        result = BOOL_VALUE(valuesEqual(a, b) == (operatorType == TOKEN_EQUAL_EQUAL));
+    } else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        // The operands stay in the constant table while the result is made.
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        result = OBJ_VALUE(takeString(chars, length));
+    } else if (areNumbers(a, b)) {
+        switch (operatorType) {
+            case TOKEN_GREATER:         result = BOOL_VALUE(greaterNumbers(a, b)); break;
+            case TOKEN_GREATER_EQUAL:   result = BOOL_VALUE(!lessNumbers(a, b)); break;
+            case TOKEN_LESS:            result = BOOL_VALUE(lessNumbers(a, b)); break;
+            case TOKEN_LESS_EQUAL:      result = BOOL_VALUE(!greaterNumbers(a, b)); break;
+            case TOKEN_PLUS:            result = addNumbers(a, b); break;
+            case TOKEN_MINUS:           result = subtractNumbers(a, b); break;
+            case TOKEN_STAR:            result = multiplyNumbers(a, b); break;
+            case TOKEN_SLASH:           result = divideNumbers(a, b); break;
+            case TOKEN_PERCENT:         result = moduloNumbers(a, b); break;
+            default:
+                return false;
+        }
+    } else {
+        return false;
+    }
+
+    dropCode(leftStart);
+    emitValue(result);
+    return true;
+}
+
+static void markComparison(int start, uint8_t jump) {
+    current->comparisonStart = start;
+    current->comparisonEnd = currentChunk()->count;
+    current->comparisonJump = jump;
+}
+
 static void binary(bool canAssign) {
     // Remember the operator.
     TokenType operatorType = parser.previous.type;
+    int leftStart = current->operandStart;
 
     // Compile the right operand.
+    int rightStart = currentChunk()->count;
     ParseRule *rule = getRule(operatorType);
     parsePrecedence((Precedence) rule->precedence + 1);
 
+    if (foldBinary(operatorType, leftStart, rightStart)) {
+        return;
+    }
+
     // Emit the operator instruction.
+    int start = currentChunk()->count;
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:         emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL:   emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:            emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:      emitBytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_BANG_EQUAL:
+            emitBytes(OP_EQUAL, OP_NOT);
+            markComparison(start, OP_JUMP_IF_EQUAL);
+            break;
+        case TOKEN_EQUAL_EQUAL:
+            emitByte(OP_EQUAL);
+            markComparison(start, OP_JUMP_IF_NOT_EQUAL);
+            break;
+        case TOKEN_GREATER:
+            emitByte(OP_GREATER);
+            markComparison(start, OP_JUMP_IF_NOT_GREATER);
+            break;
+        case TOKEN_GREATER_EQUAL:
+            emitBytes(OP_LESS, OP_NOT);
+            markComparison(start, OP_JUMP_IF_NOT_GREATER_EQUAL);
+            break;
+        case TOKEN_LESS:
+            emitByte(OP_LESS);
+            markComparison(start, OP_JUMP_IF_NOT_LESS);
+            break;
+        case TOKEN_LESS_EQUAL:
+            emitBytes(OP_GREATER, OP_NOT);
+            markComparison(start, OP_JUMP_IF_NOT_LESS_EQUAL);
+            break;
         case TOKEN_PLUS:            emitByte(OP_ADD); break;
         case TOKEN_MINUS:           emitByte(OP_SUBTRACT); break;
         case TOKEN_STAR:            emitByte(OP_MULTIPLY); break;
         case TOKEN_SLASH:           emitByte(OP_DIVIDE); break;
+        case TOKEN_PERCENT:         emitByte(OP_MODULO); break;
         default:
             return; // Unreachable.
     }
@@ -383,6 +667,7 @@ static void binary(bool canAssign) {
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
     emitBytes(OP_CALL, argCount);
+    current->lastCallEnd = currentChunk()->count;
 }
 
 static void literal(bool canAssign) {
@@ -407,11 +692,10 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after a block.");
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type);
+static void initCompiler(Compiler *compiler, FunctionType type, ObjFunction *function);
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
+// The parameter list and the body of the function being compiled.
+static void functionBody() {
     beginScope();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -421,13 +705,19 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after function name.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' after function name.");
     block();
+}
+
+static void function(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    functionBody();
 
     ObjFunction *function = endCompiler();
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VALUE(function)));
@@ -442,24 +732,115 @@ static void function(FunctionType type) {
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name");
     uint8_t nameConstant = identifierConstant(&parser.previous);
+    uint16_t global = current->scopeDepth > 0 ? 0 : globalVariable(&parser.previous);
     declareVariable();
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(global);
 
     consume(TOKEN_LEFT_BRACE, "Expect '{' before class body");
     consume(TOKEN_RIGHT_BRACE, "Expect '}' before class body");
 }
 
-static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+// Remember that *global* is declared with the function the OP_CLOSURE
+// just emitted creates, for inlineCalls().
+static void declareFunction(uint16_t global) {
+    if (declared.capacity < global + 1) {
+        int oldCapacity = declared.capacity;
+        declared.capacity = GROW_CAPACITY(global + 1);
+        declared.functions = GROW_ARRAY(ObjFunction *, declared.functions,
+                                        oldCapacity, declared.capacity);
+        for (int i = oldCapacity; i < declared.capacity; i++) {
+            declared.functions[i] = NULL;
+        }
+    }
+    if (declared.count < global + 1) {
+        declared.count = global + 1;
+    }
+
+    Chunk *chunk = currentChunk();
+    Value function = chunk->constants.values[chunk->code[chunk->count - 1]];
+    declared.functions[global] = chunk->code[chunk->count - 2] == OP_CLOSURE ?
+                                 AS_FUNCTION(function) : NULL;
+}
+
+/**
+ * Skip over the parameters and body of a function declared at the top level
+ * of the script, only matching up the braces, and leave a function that
+ * compiles them at its first call. Nothing at the top level can be captured,
+ * so the closure has no upvalues whatever the body turns out to use.
+ * @param type
+ */
+static void lazyFunction(FunctionType type) {
+    Token name = parser.previous;
+    Parser parserStart = parser;
+
+    int arity = 0;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            if (++arity > 255) {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after function name.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after function name.");
+    if (parser.panicMode) {
+        return;
+    }
+    for (int depth = 1; depth > 0;) {
+        if (check(TOKEN_EOF)) {
+            errorAtCurrent("Expect '}' after a block.");
+            return;
+        }
+        if (check(TOKEN_LEFT_BRACE)) {
+            depth++;
+        } else if (check(TOKEN_RIGHT_BRACE)) {
+            depth--;
+        }
+        advance();
+    }
+
+    if (script.copy == NULL) {
+        script.copy = copyString(script.source, (int) strlen(script.source));
+    }
+    ObjFunction *function = newFunction();
+    push(OBJ_VALUE(function));
+    function->arity = arity;
+    function->memoized = type == TYPE_MEMO;
+    function->name = copyString(name.start, name.length);
+    function->lazySource = script.copy;
+    function->lazyStart = (int) (parserStart.current.start - script.source);
+    function->lazyLine = parserStart.current.line;
+    // The consts of the script are saved after the earlier ones once it is
+    // compiled, those before this point are the ones the body may see.
+    function->lazyConstants = vm.globalConstantValues.count + current->constantCount;
+    writeChunk(&function->chunk, OP_COMPILE, function->lazyLine);
+    // Room for what the compiler keeps on the stack while it allocates.
+    function->maxStack = arity + 3;
+    emitBytes(OP_CLOSURE, makeConstant(OBJ_VALUE(function)));
+    pop();
+}
+
+static void funDeclaration(FunctionType type) {
+    uint16_t global = parseVariable("Expect function name.");
     markInitialized();
-    function(TYPE_FUNCTION);
+    if (vm.lazyCompile && current->type == TYPE_SCRIPT && current->scopeDepth == 0) {
+        lazyFunction(type);
+    } else {
+        function(type);
+    }
+    // Functions declared at the top level have nothing to capture.
+    if (current->scopeDepth == 0 && !parser.hadError) {
+        declareFunction(global);
+    }
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
 
     if(match(TOKEN_EQUAL)) {
         expression();
@@ -470,12 +851,142 @@ static void varDeclaration() {
     defineVariable(global);
 }
 
+static void constDeclaration() {
+    consume(TOKEN_IDENTIFIER, "Expect constant name.");
+    Token name = parser.previous;
+    if (isScopeConstant(&name)) {
+        error("Already constant with this name in this scope.");
+    }
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        Local *local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth) {
+            break;
+        }
+        if (identifiersEqual(&name, &local->name)) {
+            error("Already variable with this name in this scope.");
+        }
+    }
+
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    int start = currentChunk()->count;
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+    Value value;
+    if (!constantAt(start, currentChunk()->count, &value)) {
+        error("Constant must be initialized with a constant expression.");
+        return;
+    }
+    if (current->constantCount == UINT8_COUNT) {
+        error("Too many constants in function.");
+        return;
+    }
+    // No code is left behind, every use pushes the value itself.
+    Constant *constant = &current->constants[current->constantCount++];
+    constant->name = name;
+    constant->value = value;
+    constant->depth = current->scopeDepth;
+    constant->localCount = current->localCount;
+    dropCode(start);
+
+    // At the top level it is a global as well, for the code compiled
+    // before it that reads the name as one. None of that code may assign
+    // it, or the name would have two values.
+    if (current->type == TYPE_SCRIPT && current->scopeDepth == 0) {
+        uint16_t global = globalVariable(&name);
+        Value assigned;
+        if (tableGet(&vm.assignedGlobals, copyString(name.start, name.length), &assigned)) {
+            errorAt(&name, "Can't make an assigned variable a constant.");
+        }
+        emitValue(value);
+        emitGlobal(OP_DEFINE_GLOBAL, global);
+    }
+}
+
 static void expressionStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
     emitByte(OP_POP);
 }
 
+// The operands of OP_FOR_PREP and OP_FOR_LOOP.
+typedef struct {
+    uint8_t counter;
+    uint8_t limit;
+    uint8_t flags;
+    uint8_t step;
+} CountingLoop;
+
+// Whether the condition of a "for" loop from *conditionStart*, followed by
+// the jump over the increment, and the increment from *incrementStart* to
+// the end of the chunk count a local up: "i < n" or "i <= n" with n a local
+// or a number, then "i = i + step" with a number as the step.
+static bool countingLoop(int conditionStart, int incrementStart, CountingLoop *loop) {
+    Chunk *chunk = currentChunk();
+    uint8_t *condition = &chunk->code[conditionStart];
+    uint8_t *increment = &chunk->code[incrementStart];
+    if (incrementStart - conditionStart != 10 || chunk->count - incrementStart != 8) {
+        return false;
+    }
+
+    if (condition[0] != OP_GET_LOCAL ||
+        (condition[4] != OP_JUMP_IF_NOT_LESS && condition[4] != OP_JUMP_IF_NOT_LESS_EQUAL)) {
+        return false;
+    }
+    loop->counter = condition[1];
+    loop->limit = condition[3];
+    loop->flags = condition[4] == OP_JUMP_IF_NOT_LESS_EQUAL ? FOR_INCLUSIVE : 0;
+    if (condition[2] == OP_CONSTANT && IS_NUMBER(chunk->constants.values[loop->limit])) {
+        loop->flags |= FOR_CONSTANT_LIMIT;
+    } else if (condition[2] != OP_GET_LOCAL) {
+        return false;
+    }
+
+    loop->step = increment[3];
+    return increment[0] == OP_GET_LOCAL && increment[1] == loop->counter &&
+           increment[2] == OP_CONSTANT && IS_NUMBER(chunk->constants.values[loop->step]) &&
+           increment[4] == OP_ADD &&
+           increment[5] == OP_SET_LOCAL && increment[6] == loop->counter &&
+           increment[7] == OP_POP;
+}
+
+// Compile the body of a counting loop whose condition and increment, from
+// *start* on, countingLoop() accepted. They become OP_FOR_PREP before the
+// body and OP_FOR_LOOP after it, which does the increment, the check and
+// the jump back in one go.
+static void countingForBody(int start, CountingLoop *loop) {
+    // Only the comparison in OP_FOR_LOOP can fail, it gets the line of
+    // the condition.
+    Chunk *chunk = currentChunk();
+    int line = chunk->lines[start + 4];
+    chunk->count = start;
+
+    int exitJump = emitJump(OP_FOR_PREP);
+    emitBytes(loop->counter, loop->limit);
+    emitByte(loop->flags);
+    int bodyStart = currentChunk()->count;
+
+    beginLoop(-1);
+    statement();
+    Loop *currentLoop = &current->loops[current->loopCount - 1];
+    for (int i = 0; i < currentLoop->continueJumpsCount; i++) {
+        patchJump(currentLoop->continueJumps[i]);
+    }
+
+    int offset = currentChunk()->count - bodyStart + 3;
+    if (offset > UINT16_MAX) {
+        error("Loop body too large.");
+    }
+    uint8_t bytes[] = {OP_FOR_LOOP, (offset >> 8) & 0xff, offset & 0xff,
+                       loop->counter, loop->limit, loop->flags, loop->step};
+    for (int i = 0; i < (int) sizeof(bytes); i++) {
+        writeChunk(currentChunk(), bytes[i], line);
+    }
+
+    patchJump(exitJump);
+    endLoop();
+}
+
 static void forStatement() {
     beginScope();
 
@@ -491,36 +1002,46 @@ static void forStatement() {
     int loopStart = currentChunk()->count;
 
     int exitJump = -1;
+    bool fused = false;
     if(!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitConditionJump(&fused);
     }
 
     if(!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
 
         int incrementStart = currentChunk()->count;
-        beginLoop(incrementStart);
         expression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
+        CountingLoop counting;
+        if (fused && countingLoop(loopStart, incrementStart, &counting)) {
+            countingForBody(loopStart, &counting);
+            endScope();
+            return;
+        }
+
         emitLoop(loopStart);
         loopStart = incrementStart;
         patchJump(bodyJump);
     }
 
+    // "continue" runs the increment, if there is one.
+    beginLoop(loopStart);
     statement();
 
     emitLoop(loopStart);
 
     if(exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP);
+        if (!fused) {
+            emitByte(OP_POP);
+        }
     }
 
     endLoop();
@@ -532,13 +1053,23 @@ static void ifStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'if'.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int thenJump = emitConditionJump(&fused);
     statement();
+
+    // Nothing is left to pop on the false path, so without an "else" it
+    // can simply land after the "then" branch.
+    if (fused && !check(TOKEN_ELSE)) {
+        patchJump(thenJump);
+        return;
+    }
+
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
-    emitByte(OP_POP);
+    if (!fused) {
+        emitByte(OP_POP);
+    }
 
     if(match(TOKEN_ELSE)) {
         statement();
@@ -561,7 +1092,16 @@ static void returnStatement() {
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value");
-        emitByte(OP_RETURN);
+
+        // "return f(x);" lets the callee take over this frame, unless some
+        // jump lands after the call and still needs to return another value.
+        // The frame of a memo fun has to return itself, its result is kept.
+        Chunk *chunk = currentChunk();
+        if (current->type != TYPE_MEMO && current->lastCallEnd == chunk->count &&
+            current->lastJumpTarget != chunk->count) {
+            chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+        }
+        emitByte(current->type == TYPE_MEMO ? OP_RETURN_MEMO : OP_RETURN);
     }
 }
 
@@ -573,19 +1113,41 @@ static void whileStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'while'.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    bool fused;
+    int exitJump = emitConditionJump(&fused);
 
     beginScope();
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
+    if (!fused) {
+        emitByte(OP_POP);
+    }
+    // "break" jumps land after the condition has been popped.
     endLoop();
-    emitByte(OP_POP);
     endScope();
 }
 
+// Keys of a switch table are strings and whole numbers in the range of an
+// int Value, where a table lookup finds the same case comparing the values
+// one by one would.
+static bool switchKey(Value value, Value *key) {
+    if (IS_STRING(value) || IS_INT(value)) {
+        *key = value;
+        return true;
+    }
+    if (IS_DOUBLE(value)) {
+        double number = AS_NUMBER(value);
+        if (number >= (double) INT_VALUE_MIN && number <= (double) INT_VALUE_MAX &&
+            (double) (int64_t) number == number) {
+            *key = INT_VALUE((int64_t) number);
+            return true;
+        }
+    }
+    return false;
+}
+
 static void switchStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
     expression();
@@ -593,24 +1155,72 @@ static void switchStatement() {
 
     consume(TOKEN_LEFT_BRACE, "Expect '{' after 'switch'.");
     int nextCase = -1;
-    // exit for every case, that means lox only support 30 cases.
-    int exitJumps[30];
+    int *exitJumps = NULL;
     int exitJumpCount = 0;
+    int exitJumpCapacity = 0;
+
+    // Cases up to the first one that is not a literal key go in a table
+    // OP_SWITCH looks the value up in, the rest compare one by one.
+    ObjSwitch *table = NULL;
+    int tableJump = -1;
+    bool chained = false;
 
     while(match(TOKEN_CASE)) {
         // compare the value which represent * in "switch(*)", with the
         // value that generate by current case expression * in "case *:".
+        int start = currentChunk()->count;
         emitByte(OP_DUP);
+        int keyStart = currentChunk()->count;
         expression();
-        emitByte(OP_EQUAL);
-
         consume(TOKEN_COLON, "Expect ':' after 'case'.");
-        nextCase = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+
+        Value value, key;
+        if (!chained && constantAt(keyStart, currentChunk()->count, &value) &&
+            switchKey(value, &key)) {
+            // The key may only be held by the constant about to go.
+            push(key);
+            dropCode(start);
+            if (table == NULL) {
+                table = newSwitch();
+                uint8_t constant = makeConstant(OBJ_VALUE(table));
+                tableJump = emitJump(OP_SWITCH);
+                emitByte(constant);
+            }
+            addSwitchCase(table, key, currentChunk()->count);
+            current->lastJumpTarget = currentChunk()->count;
+            pop();
+        } else {
+            if (!chained && table != NULL) {
+                // The table misses into the compare of this case.
+                int jump = start - tableJump - 2;
+                if (jump > UINT16_MAX) {
+                    error("Too much code to jump over.");
+                }
+                currentChunk()->code[tableJump] = (jump >> 8) & 0xff;
+                currentChunk()->code[tableJump + 1] = jump & 0xff;
+                current->lastJumpTarget = start;
+            }
+            chained = true;
+            emitByte(OP_EQUAL);
+            nextCase = emitJump(OP_JUMP_IF_FALSE);
+            emitByte(OP_POP);
+        }
+
         statement();
+        if (exitJumpCapacity < exitJumpCount + 1) {
+            int oldCapacity = exitJumpCapacity;
+            exitJumpCapacity = GROW_CAPACITY(oldCapacity);
+            exitJumps = GROW_ARRAY(int, exitJumps, oldCapacity, exitJumpCapacity);
+        }
         exitJumps[exitJumpCount++] = emitJump(OP_JUMP);
-        patchJump(nextCase);
-        emitByte(OP_POP);
+        if (chained) {
+            patchJump(nextCase);
+            emitByte(OP_POP);
+        }
+    }
+
+    if (table != NULL && !chained) {
+        patchJump(tableJump);
     }
 
     if(match(TOKEN_DEFAULT)) {
@@ -621,6 +1231,10 @@ static void switchStatement() {
     for (int i = 0; i < exitJumpCount; i++) {
         patchJump(exitJumps[i]);
     }
+    FREE_ARRAY(int, exitJumps, exitJumpCapacity);
+    if (table != NULL) {
+        finishSwitch(table);
+    }
     emitByte(OP_POP);
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after 'switch'.");
 }
@@ -647,7 +1261,9 @@ static void synchronize() {
         switch (parser.current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
+            case TOKEN_MEMO:
             case TOKEN_VAR:
+            case TOKEN_CONST:
             case TOKEN_FOR:
             case TOKEN_IF:
             case TOKEN_WHILE:
@@ -667,8 +1283,13 @@ static void declaration() {
         classDeclaration();
     } else if(match(TOKEN_VAR)) {
         varDeclaration();
+    } else if(match(TOKEN_CONST)) {
+        constDeclaration();
     } else if(match(TOKEN_FUN)) {
-        funDeclaration();
+        funDeclaration(TYPE_FUNCTION);
+    } else if(match(TOKEN_MEMO)) {
+        consume(TOKEN_FUN, "Expect 'fun' after 'memo'.");
+        funDeclaration(TYPE_MEMO);
     } else if(match(TOKEN_CLASS)) {
         // todo classDeclaration()
     } else {
@@ -734,19 +1355,29 @@ static void patchJump(int offset) {
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    current->lastJumpTarget = currentChunk()->count;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
+// Compiles into *function* when it is given, a new function otherwise.
+static void initCompiler(Compiler *compiler, FunctionType type, ObjFunction *function) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->loopCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    compiler->constantCount = 0;
+    compiler->operandStart = -1;
+    compiler->comparisonStart = -1;
+    compiler->comparisonEnd = -1;
+    compiler->comparisonJump = OP_JUMP_IF_FALSE;
+    compiler->lastJumpTarget = -1;
+    compiler->lastCallEnd = -1;
+    compiler->function = function != NULL ? function : newFunction();
+    compiler->function->memoized = type == TYPE_MEMO;
     current = compiler;
 
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && function == NULL) {
         current->function->name = copyString(parser.previous.start,
                                              parser.previous.length);
     }
@@ -763,12 +1394,34 @@ static void number(bool canAssign) {
     emitConstant(NUMBER_VALUE(value));
 }
 
+static void integer(bool canAssign) {
+    // Literals too big for an int are doubles instead.
+    errno = 0;
+    long long value = strtoll(parser.previous.start, NULL, 10);
+    if (errno == ERANGE || value > INT_VALUE_MAX) {
+        number(canAssign);
+        return;
+    }
+    emitConstant(INT_VALUE((int64_t) value));
+}
+
 static void string(bool canAssign) {
     emitConstant(OBJ_VALUE(copyString(parser.previous.start + 1,
                                       parser.previous.length - 2)));
 }
 
 static void namedVariable(Token name, bool canAssign) {
+    Value constant;
+    if (resolveConstant(current, &name, &constant)) {
+        if (canAssign && match(TOKEN_EQUAL)) {
+            error("Can't assign to a constant.");
+            expression();
+            return;
+        }
+        emitValue(constant);
+        return;
+    }
+
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
     if(arg != -1) {
@@ -778,9 +1431,22 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        uint16_t global = globalVariable(&name);
+        if(canAssign && match(TOKEN_EQUAL)) {
+            ObjString *string = copyString(name.start, name.length);
+            Value value;
+            if (tableGet(&vm.globalConstants, string, &value)) {
+                error("Can't assign to a constant.");
+            }
+            push(OBJ_VALUE(string));
+            tableSet(&vm.assignedGlobals, string, BOOL_VALUE(true));
+            pop();
+            expression();
+            emitGlobal(OP_SET_GLOBAL, global);
+        } else {
+            emitGlobal(OP_GET_GLOBAL, global);
+        }
+        return;
     }
 
     if(canAssign && match(TOKEN_EQUAL)) {
@@ -799,8 +1465,24 @@ static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand.
+    int start = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
 
+    // Fold it when it is a constant the operator can't fail on.
+    Value value;
+    if (constantAt(start, currentChunk()->count, &value)) {
+        if (operatorType == TOKEN_BANG) {
+            dropCode(start);
+            emitValue(BOOL_VALUE(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value))));
+            return;
+        }
+        if (IS_NUMBER(value)) {
+            dropCode(start);
+            emitValue(negateNumber(value));
+            return;
+        }
+    }
+
     // Emit the operator instruction.
     switch (operatorType) {
         case TOKEN_MINUS:   emitByte(OP_NEGATE); break;
@@ -822,6 +1504,7 @@ ParseRule rules[] = {
         [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
         [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
         [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
+        [TOKEN_PERCENT]       = {NULL,     binary, PREC_FACTOR},
         [TOKEN_BANG]          = {unary,     NULL,   PREC_NONE},
         [TOKEN_BANG_EQUAL]    = {NULL,     binary,   PREC_EQUALITY},
         [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
@@ -833,6 +1516,7 @@ ParseRule rules[] = {
         [TOKEN_IDENTIFIER]    = {variable,     NULL,   PREC_NONE},
         [TOKEN_STRING]        = {string,     NULL,   PREC_NONE},
         [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
+        [TOKEN_INTEGER]       = {integer,  NULL,   PREC_NONE},
         [TOKEN_AND]           = {NULL,     and_,   PREC_NONE},
         [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
         [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
@@ -849,6 +1533,7 @@ ParseRule rules[] = {
         [TOKEN_TRUE]          = {literal,     NULL,   PREC_NONE},
         [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
         [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+        [TOKEN_CONST]         = {NULL,     NULL,   PREC_NONE},
         [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
         [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
@@ -862,11 +1547,13 @@ static void parsePrecedence(Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int start = currentChunk()->count;
     prefixRule(canAssign);
 
     while(precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        current->operandStart = start;
         infixRule(canAssign);
     }
 
@@ -880,9 +1567,11 @@ static ParseRule *getRule(TokenType type) {
 }
 
 ObjFunction *compile(const char *source){
-    initScanner(source);
+    initScanner(source, 1);
+    script.source = source;
+    script.copy = NULL;
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -892,14 +1581,62 @@ ObjFunction *compile(const char *source){
         declaration();
     }
 
+    if (!parser.hadError) {
+        saveGlobalConstants();
+    }
     ObjFunction *function = endCompiler();
+    script.source = NULL;
+    script.copy = NULL;
+    // Functions compiled later bind their calls too.
+    if (!vm.lazyCompile) {
+        FREE_ARRAY(ObjFunction *, declared.functions, declared.capacity);
+        declared.functions = NULL;
+        declared.count = 0;
+        declared.capacity = 0;
+    }
     return parser.hadError ? NULL : function;
 }
 
+bool compileFunction(ObjFunction *function) {
+    ObjString *source = function->lazySource;
+    int arity = function->arity;
+    initScanner(source->chars + function->lazyStart, function->lazyLine);
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    freeChunk(&function->chunk);
+    function->arity = 0;
+    Compiler compiler;
+    initCompiler(&compiler, function->memoized ? TYPE_MEMO : TYPE_FUNCTION, function);
+    visibleConstants = function->lazyConstants;
+    advance();
+    functionBody();
+    endCompiler();
+    visibleConstants = -1;
+
+    if (parser.hadError) {
+        // Stays as it was, so every call reports the errors.
+        freeChunk(&function->chunk);
+        writeChunk(&function->chunk, OP_COMPILE, function->lazyLine);
+        function->arity = arity;
+        return false;
+    }
+    function->lazySource = NULL;
+    return true;
+}
+
 void markCompilerRoots() {
+    markObject((Obj *) script.copy);
+    for (int i = 0; i < declared.count; i++) {
+        markObject((Obj *) declared.functions[i]);
+    }
     Compiler *compiler = current;
     while (compiler != NULL) {
         markObject((Obj *) compiler->function);
+        // Their values may not be in any constant table.
+        for (int i = 0; i < compiler->constantCount; i++) {
+            markValue(compiler->constants[i].value);
+        }
         compiler = compiler->enclosing;
     }
 }
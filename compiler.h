@@ -50,14 +50,30 @@ typedef struct {
     bool isLocal;
 } Upvalue;
 
+// A "const" declaration, whose uses compile to its value.
 typedef struct {
+    Token name;
+    Value value;
+    int depth;
+    // Locals from this index on are declared after the constant and
+    // shadow it.
+    int localCount;
+} Constant;
+
+typedef struct {
+    // Where "continue" jumps back to, -1 when it jumps forward to the end
+    // of the body instead, the jumps collected in continueJumps.
     int loopStart;
     int loopEnds[50];
     int loopEndsCount;
+    int continueJumps[50];
+    int continueJumpsCount;
 } Loop;
 
 typedef enum {
     TYPE_FUNCTION,
+    // Declared with "memo fun".
+    TYPE_MEMO,
     TYPE_SCRIPT,
 } FunctionType;
 
@@ -76,9 +92,44 @@ typedef struct Compiler {
 
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+
+    Constant constants[UINT8_COUNT];
+    int constantCount;
+
+    // Where the code of the left operand starts while an infix rule runs,
+    // so operators on constants can be folded.
+    int operandStart;
+
+    // The code range of the last comparison compiled by binary(), and the
+    // conditional jump it folds into when it ends the condition of an
+    // "if", "while" or "for".
+    int comparisonStart;
+    int comparisonEnd;
+    uint8_t comparisonJump;
+    // The offset the most recently patched jump lands on.
+    int lastJumpTarget;
+    // Where the code of the last OP_CALL ends, so "return" can tell if its
+    // value is a call in tail position.
+    int lastCallEnd;
 } Compiler;
 
+/*
+ * With vm.lazyCompile set, compile() only skips over the bodies of the
+ * functions declared at the top level of the script. Each is left as a
+ * function whose code is OP_COMPILE, which compiles the body from a copy of
+ * the script in place the first time it runs. Compile errors in a body show
+ * up at its first call instead, and its calls can't be inlined into code
+ * compiled before that.
+ */
+
 ObjFunction *compile(const char *source);
+/**
+ * Compile the body of *function*, which compile() left for later.
+ * @param function
+ * @return false after reporting compile errors, the function still compiles
+ *         itself at its next call then
+ */
+bool compileFunction(ObjFunction *function);
 void markCompilerRoots();
 
 #endif //CLOX_COMPILER_H
@@ -7,6 +7,8 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "registers.h"
+#include "vm.h"
 
 static int simpleInstruction(const char *name, int offset){
     printf("%s\n", name);
@@ -27,6 +29,30 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+static int slotConstantInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int twoByteInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t slot = (uint16_t) (chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    ObjString *global = globalName(slot);
+    printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "?");
+    return offset + 3;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset) {
     uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -34,6 +60,54 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int switchInstruction(Chunk *chunk, int offset) {
+    int miss = jumpTarget(chunk, offset);
+    ObjSwitch *table = AS_SWITCH(chunk->constants.values[chunk->code[offset + 3]]);
+    printf("%-16s %4d -> %d, %d cases:", "OP_SWITCH", offset, miss, table->caseCount);
+    for (int i = 0; i < table->caseCount; i++) {
+        printf(" %d", table->cases[i]);
+    }
+    printf("\n");
+    return offset + 4;
+}
+
+static int callKnownInstruction(Chunk *chunk, int offset) {
+    uint8_t argCount = chunk->code[offset + 3];
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 4]]);
+    printf("%-16s %4d -> %d, (%d args) %s%s\n", "OP_CALL_KNOWN", offset,
+           jumpTarget(chunk, offset), argCount, function->name->chars,
+           hasInlinedBody(chunk, offset) ? " inlined" : "");
+    return offset + 5;
+}
+
+static int callNativeInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t argCount = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d (%d args) '", name, constant, argCount);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int forInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t *code = &chunk->code[offset];
+    printf("%-16s %4d -> %d, %d %s ", name, offset, jumpTarget(chunk, offset),
+           code[3], code[5] & FOR_INCLUSIVE ? "<=" : "<");
+    if (code[5] & FOR_CONSTANT_LIMIT) {
+        printValue(chunk->constants.values[code[4]]);
+    } else {
+        printf("%d", code[4]);
+    }
+    if (code[0] == OP_FOR_PREP) {
+        printf("\n");
+        return offset + 6;
+    }
+    printf(" step ");
+    printValue(chunk->constants.values[code[6]]);
+    printf("\n");
+    return offset + 7;
+}
+
 void disassembleChunk(Chunk *chunk, const char *name){
     printf("== %s ==\n", name);
 
@@ -54,10 +128,16 @@ int disassembleInstruction(Chunk *chunk, int offset){
     switch (instruction) {
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_RETURN_MEMO:
+            return simpleInstruction("OP_RETURN_MEMO", offset);
+        case OP_COMPILE:
+            return simpleInstruction("OP_COMPILE", offset);
         case OP_CLASS:
             return constantInstruction("OP_CLASS", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -88,6 +168,8 @@ int disassembleInstruction(Chunk *chunk, int offset){
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
             return simpleInstruction("OP_DIVIDE", offset);
+        case OP_MODULO:
+            return simpleInstruction("OP_MODULO", offset);
         case OP_NOT:
             return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
@@ -105,13 +187,13 @@ int disassembleInstruction(Chunk *chunk, int offset){
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
@@ -130,9 +212,257 @@ int disassembleInstruction(Chunk *chunk, int offset){
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_SWITCH:
+            return switchInstruction(chunk, offset);
+        case OP_CALL_KNOWN:
+            return callKnownInstruction(chunk, offset);
+        case OP_CALL_NATIVE:
+            return callNativeInstruction("OP_CALL_NATIVE", chunk, offset);
+        case OP_FOR_PREP:
+            return forInstruction("OP_FOR_PREP", chunk, offset);
+        case OP_FOR_LOOP:
+            return forInstruction("OP_FOR_LOOP", chunk, offset);
+        case OP_SQRT:
+            return callNativeInstruction("OP_SQRT", chunk, offset);
+        case OP_FLOOR:
+            return callNativeInstruction("OP_FLOOR", chunk, offset);
+        case OP_CEIL:
+            return callNativeInstruction("OP_CEIL", chunk, offset);
+        case OP_ABS:
+            return callNativeInstruction("OP_ABS", chunk, offset);
+        case OP_SIN:
+            return callNativeInstruction("OP_SIN", chunk, offset);
+        case OP_COS:
+            return callNativeInstruction("OP_COS", chunk, offset);
+        case OP_TAN:
+            return callNativeInstruction("OP_TAN", chunk, offset);
+        case OP_ATAN:
+            return callNativeInstruction("OP_ATAN", chunk, offset);
+        case OP_MIN:
+            return callNativeInstruction("OP_MIN", chunk, offset);
+        case OP_MAX:
+            return callNativeInstruction("OP_MAX", chunk, offset);
+        case OP_POW:
+            return callNativeInstruction("OP_POW", chunk, offset);
+        case OP_FMOD:
+            return callNativeInstruction("OP_FMOD", chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+        case OP_GET_LOCAL_0:
+            return simpleInstruction("OP_GET_LOCAL_0", offset);
+        case OP_GET_LOCAL_1:
+            return simpleInstruction("OP_GET_LOCAL_1", offset);
+        case OP_GET_LOCAL_2:
+            return simpleInstruction("OP_GET_LOCAL_2", offset);
+        case OP_GET_LOCAL_3:
+            return simpleInstruction("OP_GET_LOCAL_3", offset);
+        case OP_POPN:
+            return byteInstruction("OP_POPN", chunk, offset);
+        case OP_INC_LOCAL:
+            return slotConstantInstruction("OP_INC_LOCAL", chunk, offset);
+        case OP_ADD_LOCALS:
+            return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_GET_GLOBAL_DEFINED:
+            return globalInstruction("OP_GET_GLOBAL_DEFINED", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
 
+
+/************************* register code ******************************/
+
+static void printRK(Chunk *constants, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        printf(" k'");
+        printValue(constants->constants.values[operand & RK_MAX]);
+        printf("'");
+    } else {
+        printf(" r%d", operand);
+    }
+}
+
+static int registerInstruction(const char *name, Chunk *code, Chunk *constants,
+                               int offset, const char *operands) {
+    printf("%-16s", name);
+    int length = 1;
+    int i;
+    for (i = 0; operands[i] != '\0'; i++) {
+        uint8_t operand = code->code[offset + length];
+        switch (operands[i]) {
+            case 'A':
+                printf(" r%d", operand);
+                length++;
+                break;
+            case 'R':
+                printRK(constants, operand);
+                length++;
+                break;
+            case 'K':
+                printf(" k'");
+                printValue(constants->constants.values[operand]);
+                printf("'");
+                length++;
+                break;
+            case 'B':
+                printf(" %d", operand);
+                length++;
+                break;
+            case 'G': {
+                uint16_t slot = (uint16_t) ((operand << 8) | code->code[offset + length + 1]);
+                ObjString *global = globalName(slot);
+                printf(" g'%s'", global != NULL ? global->chars : "?");
+                length += 2;
+                break;
+            }
+            case 'J': {
+                uint16_t jump = (uint16_t) ((operand << 8) | code->code[offset + length + 1]);
+                int end = offset + length + 2;
+                printf(" -> %d", code->code[offset] == ROP_LOOP ? end - jump : end + jump);
+                length += 2;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    printf("\n");
+    return offset + length;
+}
+
+void disassembleRegisterCode(ObjFunction *function, const char *name) {
+    printf("== %s (%d registers) ==\n", name, function->registerCount);
+
+    for (int offset = 0; offset < function->registerCode.count;) {
+        offset = disassembleRegisterInstruction(function, offset);
+    }
+}
+
+int disassembleRegisterInstruction(ObjFunction *function, int offset) {
+    Chunk *code = &function->registerCode;
+    Chunk *constants = &function->chunk;
+    printf("%04d ", offset);
+    if (offset > 0 && code->lines[offset] == code->lines[offset - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", code->lines[offset]);
+    }
+
+    uint8_t instruction = code->code[offset];
+    switch (instruction) {
+        case ROP_MOVE:
+            return registerInstruction("ROP_MOVE", code, constants, offset, "AA");
+        case ROP_LOADK:
+            return registerInstruction("ROP_LOADK", code, constants, offset, "AK");
+        case ROP_LOADNIL:
+            return registerInstruction("ROP_LOADNIL", code, constants, offset, "A");
+        case ROP_LOADTRUE:
+            return registerInstruction("ROP_LOADTRUE", code, constants, offset, "A");
+        case ROP_LOADFALSE:
+            return registerInstruction("ROP_LOADFALSE", code, constants, offset, "A");
+        case ROP_GET_GLOBAL:
+            return registerInstruction("ROP_GET_GLOBAL", code, constants, offset, "AG");
+        case ROP_SET_GLOBAL:
+            return registerInstruction("ROP_SET_GLOBAL", code, constants, offset, "AG");
+        case ROP_DEFINE_GLOBAL:
+            return registerInstruction("ROP_DEFINE_GLOBAL", code, constants, offset, "AG");
+        case ROP_GET_UPVALUE:
+            return registerInstruction("ROP_GET_UPVALUE", code, constants, offset, "AB");
+        case ROP_SET_UPVALUE:
+            return registerInstruction("ROP_SET_UPVALUE", code, constants, offset, "AB");
+        case ROP_ADD:
+            return registerInstruction("ROP_ADD", code, constants, offset, "ARR");
+        case ROP_SUBTRACT:
+            return registerInstruction("ROP_SUBTRACT", code, constants, offset, "ARR");
+        case ROP_MULTIPLY:
+            return registerInstruction("ROP_MULTIPLY", code, constants, offset, "ARR");
+        case ROP_DIVIDE:
+            return registerInstruction("ROP_DIVIDE", code, constants, offset, "ARR");
+        case ROP_MODULO:
+            return registerInstruction("ROP_MODULO", code, constants, offset, "ARR");
+        case ROP_EQUAL:
+            return registerInstruction("ROP_EQUAL", code, constants, offset, "ARR");
+        case ROP_NOT_EQUAL:
+            return registerInstruction("ROP_NOT_EQUAL", code, constants, offset, "ARR");
+        case ROP_GREATER:
+            return registerInstruction("ROP_GREATER", code, constants, offset, "ARR");
+        case ROP_GREATER_EQUAL:
+            return registerInstruction("ROP_GREATER_EQUAL", code, constants, offset, "ARR");
+        case ROP_LESS:
+            return registerInstruction("ROP_LESS", code, constants, offset, "ARR");
+        case ROP_LESS_EQUAL:
+            return registerInstruction("ROP_LESS_EQUAL", code, constants, offset, "ARR");
+        case ROP_NOT:
+            return registerInstruction("ROP_NOT", code, constants, offset, "AA");
+        case ROP_NEGATE:
+            return registerInstruction("ROP_NEGATE", code, constants, offset, "AA");
+        case ROP_PRINT:
+            return registerInstruction("ROP_PRINT", code, constants, offset, "A");
+        case ROP_JUMP:
+            return registerInstruction("ROP_JUMP", code, constants, offset, "J");
+        case ROP_LOOP:
+            return registerInstruction("ROP_LOOP", code, constants, offset, "J");
+        case ROP_JUMP_IF_FALSE:
+            return registerInstruction("ROP_JUMP_IF_FALSE", code, constants, offset, "AJ");
+        case ROP_JUMP_IF_NOT_LESS:
+            return registerInstruction("ROP_JUMP_IF_NOT_LESS", code, constants, offset, "RRJ");
+        case ROP_JUMP_IF_NOT_LESS_EQUAL:
+            return registerInstruction("ROP_JUMP_IF_NOT_LESS_EQUAL", code, constants, offset, "RRJ");
+        case ROP_JUMP_IF_NOT_GREATER:
+            return registerInstruction("ROP_JUMP_IF_NOT_GREATER", code, constants, offset, "RRJ");
+        case ROP_JUMP_IF_NOT_GREATER_EQUAL:
+            return registerInstruction("ROP_JUMP_IF_NOT_GREATER_EQUAL", code, constants, offset, "RRJ");
+        case ROP_JUMP_IF_NOT_EQUAL:
+            return registerInstruction("ROP_JUMP_IF_NOT_EQUAL", code, constants, offset, "RRJ");
+        case ROP_JUMP_IF_EQUAL:
+            return registerInstruction("ROP_JUMP_IF_EQUAL", code, constants, offset, "RRJ");
+        case ROP_CALL:
+            return registerInstruction("ROP_CALL", code, constants, offset, "AB");
+        case ROP_TAIL_CALL:
+            return registerInstruction("ROP_TAIL_CALL", code, constants, offset, "AB");
+        case ROP_CALL_KNOWN:
+            return registerInstruction("ROP_CALL_KNOWN", code, constants, offset, "ABKJ");
+        case ROP_RETURN:
+            return registerInstruction("ROP_RETURN", code, constants, offset, "R");
+        case ROP_CLOSURE: {
+            ObjFunction *inner = AS_FUNCTION(constants->constants.values[code->code[offset + 2]]);
+            int next = registerInstruction("ROP_CLOSURE", code, constants, offset, "AK");
+            int i;
+            for (i = 0; i < inner->upvalueCount; i++) {
+                int isLocal = code->code[next++];
+                int index = code->code[next++];
+                printf("%04d    |                     %s %d\n",
+                       next - 2, isLocal ? "local" : "upvalue", index);
+            }
+            return next;
+        }
+        case ROP_CLOSE_UPVALUE:
+            return registerInstruction("ROP_CLOSE_UPVALUE", code, constants, offset, "A");
+        case ROP_CLASS:
+            return registerInstruction("ROP_CLASS", code, constants, offset, "AK");
+        default:
+            printf("Unknown register opcode %d\n", instruction);
+            return offset + 1;
+    }
+}
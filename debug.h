@@ -6,8 +6,11 @@
 #define CLOX_DEBUG_H
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+void disassembleRegisterCode(ObjFunction *function, const char *name);
+int disassembleRegisterInstruction(ObjFunction *function, int offset);
 
 #endif //CLOX_DEBUG_H
@@ -0,0 +1,460 @@
+#include <string.h>
+
+#include "inliner.h"
+#include "memory.h"
+#include "vm.h"
+
+typedef struct {
+    int at;         // offset of the jump instruction in the new code
+    int target;     // offset the jump went to in the old code
+} JumpFixup;
+
+typedef struct {
+    Chunk *chunk;
+    ObjFunction **declared;
+    int declaredCount;
+    // Indexed by old offset: the stack depth before the instruction, and
+    // whether some jump lands there.
+    int *depths;
+    bool *isTarget;
+    // The global each stack slot was loaded from, -1 for none.
+    int *loaded;
+    int width;
+
+    Chunk code;
+    // Indexed by old offset, where that instruction starts in the new code.
+    int *newOffsets;
+    JumpFixup *fixups;
+    int fixupCount;
+} Inliner;
+
+// Whether two constants are the same value, ints and doubles being
+// different ones even when they are equal.
+static bool sameValue(Value a, Value b) {
+    if (IS_INT(a) || IS_INT(b)) {
+        return IS_INT(a) && IS_INT(b) && AS_INT(a) == AS_INT(b);
+    }
+    if (IS_DOUBLE(a) || IS_DOUBLE(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return IS_DOUBLE(a) && IS_DOUBLE(b) && memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+}
+
+// The index of *value* in the constant table of *chunk*, which it is added
+// to unless it is there already, -1 when the table is full.
+static int constantIndex(Chunk *chunk, Value value) {
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (sameValue(chunk->constants.values[i], value)) {
+            return i;
+        }
+    }
+    if (chunk->constants.count > UINT8_MAX) {
+        return -1;
+    }
+    return addConstant(chunk, value);
+}
+
+// Whether the code of *callee* up to its first OP_RETURN can run in the
+// caller with its frame starting at stack slot *base*. Returns where that
+// OP_RETURN is in *end* and the stack depth before it in *depth*.
+static bool canInline(ObjFunction *callee, int base, int *end, int *depth) {
+    Chunk *chunk = &callee->chunk;
+    if (callee->upvalueCount > 0 || base + callee->maxStack > UINT8_COUNT) {
+        return false;
+    }
+
+    int offset = 0;
+    while (offset < chunk->count && chunk->code[offset] != OP_RETURN) {
+        if (offset >= INLINE_MAX) {
+            return false;
+        }
+        switch (genericInstruction(chunk->code[offset])) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_POP:
+            case OP_POPN:
+            case OP_DUP:
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_0:
+            case OP_GET_LOCAL_1:
+            case OP_GET_LOCAL_2:
+            case OP_GET_LOCAL_3:
+            case OP_SET_LOCAL:
+            case OP_INC_LOCAL:
+            case OP_ADD_LOCALS:
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_DEFINED:
+            case OP_SET_GLOBAL:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL:
+            case OP_ADD:
+            case OP_ADD_NUMBER:
+            case OP_ADD_STRING:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_MODULO:
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_PRINT:
+                break;
+            default:
+                // Calls, closures, upvalues and anything that jumps.
+                return false;
+        }
+        offset += instructionLength(chunk, offset);
+    }
+    if (offset >= chunk->count) {
+        return false;
+    }
+
+    int *depths = ALLOCATE(int, chunk->count + 1);
+    stackDepths(chunk, callee->arity + 1, depths);
+    *depth = depths[offset];
+    FREE_ARRAY(int, depths, chunk->count + 1);
+    *end = offset;
+    return *depth > 0;
+}
+
+static void emit(Inliner *inliner, uint8_t byte, int line) {
+    writeChunk(&inliner->code, byte, line);
+}
+
+// Copy one instruction over as it is, remembering where its jump went.
+static void copyInstruction(Inliner *inliner, int offset) {
+    Chunk *chunk = inliner->chunk;
+    if (isJump(chunk->code[offset])) {
+        JumpFixup *fixup = &inliner->fixups[inliner->fixupCount++];
+        fixup->at = inliner->code.count;
+        fixup->target = jumpTarget(chunk, offset);
+    }
+
+    int length = instructionLength(chunk, offset);
+    for (int i = 0; i < length; i++) {
+        emit(inliner, chunk->code[offset + i], chunk->lines[offset + i]);
+    }
+}
+
+// Copy the code of *callee* before *end* over, with its locals moved up by
+// *base* and its constants replaced by the ones in *constants*.
+static void copyBody(Inliner *inliner, ObjFunction *callee, int end, int base,
+                     const int *constants) {
+    Chunk *chunk = &callee->chunk;
+    for (int offset = 0; offset < end; offset += instructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        int line = chunk->lines[offset];
+        uint8_t instruction = genericInstruction(code[0]);
+        switch (instruction) {
+            case OP_GET_LOCAL_0:
+            case OP_GET_LOCAL_1:
+            case OP_GET_LOCAL_2:
+            case OP_GET_LOCAL_3:
+                emit(inliner, OP_GET_LOCAL, line);
+                emit(inliner, (uint8_t) (base + instruction - OP_GET_LOCAL_0), line);
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                emit(inliner, instruction, line);
+                emit(inliner, (uint8_t) (base + code[1]), line);
+                break;
+            case OP_INC_LOCAL:
+                emit(inliner, instruction, line);
+                emit(inliner, (uint8_t) (base + code[1]), line);
+                emit(inliner, (uint8_t) constants[code[2]], line);
+                break;
+            case OP_ADD_LOCALS:
+                emit(inliner, instruction, line);
+                emit(inliner, (uint8_t) (base + code[1]), line);
+                emit(inliner, (uint8_t) (base + code[2]), line);
+                break;
+            case OP_CONSTANT:
+                emit(inliner, instruction, line);
+                emit(inliner, (uint8_t) constants[code[1]], line);
+                break;
+            default: {
+                // Quickened forms are only right for the types the callee
+                // saw so far.
+                if (instruction == OP_ADD_NUMBER || instruction == OP_ADD_STRING) {
+                    instruction = OP_ADD;
+                } else if (instruction == OP_GET_GLOBAL_DEFINED) {
+                    instruction = OP_GET_GLOBAL;
+                }
+                emit(inliner, instruction, line);
+                int length = instructionLength(chunk, offset);
+                for (int i = 1; i < length; i++) {
+                    emit(inliner, code[i], line);
+                }
+                break;
+            }
+        }
+    }
+}
+
+// Add the constants the code of *callee* before *end* uses to the table of
+// the caller, filling in *constants* with their new indexes.
+static bool mapConstants(Inliner *inliner, ObjFunction *callee, int end, int *constants) {
+    Chunk *chunk = &callee->chunk;
+    for (int offset = 0; offset < end; offset += instructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        int index;
+        switch (genericInstruction(code[0])) {
+            case OP_CONSTANT:   index = code[1]; break;
+            case OP_INC_LOCAL:  index = code[2]; break;
+            default:            continue;
+        }
+        constants[index] = constantIndex(inliner->chunk, chunk->constants.values[index]);
+        if (constants[index] == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Replace the call at *offset*, whose callee in stack slot *base* was
+// loaded from a global declared with *callee*. Returns false when it has to
+// stay as it is.
+static bool bindCall(Inliner *inliner, int offset, int base, ObjFunction *callee) {
+    Chunk *chunk = inliner->chunk;
+    uint8_t *code = &chunk->code[offset];
+    int line = chunk->lines[offset];
+    int known = constantIndex(chunk, OBJ_VALUE(callee));
+    if (known == -1) {
+        return false;
+    }
+
+    int end, depth;
+    int constants[UINT8_COUNT];
+    if (!canInline(callee, base, &end, &depth) ||
+        !mapConstants(inliner, callee, end, constants)) {
+        // A tail call that isn't inlined is better off reusing the frame.
+        if (code[0] == OP_TAIL_CALL) {
+            return false;
+        }
+        emit(inliner, OP_CALL_KNOWN, line);
+        emit(inliner, 0, line);
+        emit(inliner, 2, line);
+        emit(inliner, code[1], line);
+        emit(inliner, (uint8_t) known, line);
+        return true;
+    }
+
+    int start = inliner->code.count;
+    emit(inliner, OP_CALL_KNOWN, line);
+    emit(inliner, 0xff, line);
+    emit(inliner, 0xff, line);
+    emit(inliner, code[1], line);
+    emit(inliner, (uint8_t) known, line);
+    copyBody(inliner, callee, end, base, constants);
+
+    // What OP_RETURN does: the result takes the place of the callee, and
+    // the arguments and locals above it go.
+    emit(inliner, OP_SET_LOCAL, line);
+    emit(inliner, (uint8_t) base, line);
+    for (int i = 1; i < depth; i++) {
+        emit(inliner, OP_POP, line);
+    }
+
+    int jump = inliner->code.count - start - 3;
+    if (jump > UINT16_MAX) {
+        inliner->code.count = start;
+        return false;
+    }
+    inliner->code.code[start + 1] = (jump >> 8) & 0xff;
+    inliner->code.code[start + 2] = jump & 0xff;
+    return true;
+}
+
+// Track which stack slots still hold the global they were loaded from once
+// the instruction at *offset* ran.
+static void trackGlobals(Inliner *inliner, int offset) {
+    Chunk *chunk = inliner->chunk;
+    int next = offset + instructionLength(chunk, offset);
+    int after = next <= chunk->count ? inliner->depths[next] : -1;
+    for (int i = after > 0 ? after - 1 : 0; i < inliner->width; i++) {
+        inliner->loaded[i] = -1;
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    int depth = inliner->depths[offset];
+    if ((instruction == OP_GET_GLOBAL || instruction == OP_GET_GLOBAL_DEFINED) &&
+        depth >= 0 && depth < inliner->width) {
+        inliner->loaded[depth] = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    }
+}
+
+// The global the callee of the call at *offset* was loaded from, -1 if
+// there is none. The callee's stack slot goes in *base*.
+static int calleeGlobal(Inliner *inliner, int offset, int *base) {
+    Chunk *chunk = inliner->chunk;
+    uint8_t instruction = chunk->code[offset];
+    if (instruction != OP_CALL && instruction != OP_TAIL_CALL) {
+        return -1;
+    }
+
+    int argCount = chunk->code[offset + 1];
+    *base = inliner->depths[offset] - argCount - 1;
+    if (*base < 0 || *base >= inliner->width) {
+        return -1;
+    }
+    return inliner->loaded[*base];
+}
+
+// The function the call at *offset* is known to call if the global it was
+// loaded from hasn't changed, NULL if there is none. The callee's stack slot
+// goes in *base*.
+static ObjFunction *knownCallee(Inliner *inliner, int offset, int *base) {
+    int global = calleeGlobal(inliner, offset, base);
+    if (global < 0 || global >= inliner->declaredCount) {
+        return NULL;
+    }
+    ObjFunction *callee = inliner->declared[global];
+    int argCount = inliner->chunk->code[offset + 1];
+    // A memo fun is only ever called through call().
+    if (callee == NULL || callee->memoized) {
+        return NULL;
+    }
+    return callee->arity == argCount ? callee : NULL;
+}
+
+// The native the global called at *offset* holds right now, if the call
+// passes it the right number of arguments.
+static ObjNative *knownNative(Inliner *inliner, int offset) {
+    int base;
+    int global = calleeGlobal(inliner, offset, &base);
+    if (global < 0 || global >= vm.globalValues.count ||
+        !IS_NATIVE(vm.globalValues.values[global])) {
+        return NULL;
+    }
+    ObjNative *native = AS_NATIVE(vm.globalValues.values[global]);
+    int argCount = inliner->chunk->code[offset + 1];
+    return native->arity == -1 || native->arity == argCount ? native : NULL;
+}
+
+// Replace the call at *offset* with the instruction that calls *native*,
+// OP_CALL_NATIVE or its math intrinsic.
+static bool bindNative(Inliner *inliner, int offset, ObjNative *native) {
+    Chunk *chunk = inliner->chunk;
+    int line = chunk->lines[offset];
+    int constant = constantIndex(chunk, OBJ_VALUE(native));
+    if (constant == -1) {
+        return false;
+    }
+    // A native has no frame for a tail call to reuse anyway.
+    emit(inliner, native->instruction, line);
+    emit(inliner, chunk->code[offset + 1], line);
+    emit(inliner, (uint8_t) constant, line);
+    return true;
+}
+
+void inlineCalls(ObjFunction *function, ObjFunction **declared, int declaredCount) {
+    Chunk *chunk = &function->chunk;
+    int oldCount = chunk->count;
+    Inliner inliner;
+    inliner.chunk = chunk;
+    inliner.declared = declared;
+    inliner.declaredCount = declaredCount;
+    inliner.depths = ALLOCATE(int, oldCount + 1);
+    inliner.isTarget = ALLOCATE(bool, oldCount + 1);
+    inliner.newOffsets = ALLOCATE(int, oldCount + 1);
+    inliner.fixups = ALLOCATE(JumpFixup, oldCount);
+    inliner.fixupCount = 0;
+    initChunk(&inliner.code);
+
+    stackDepths(chunk, function->arity + 1, inliner.depths);
+    inliner.width = 1;
+    for (int offset = 0; offset <= oldCount; offset++) {
+        inliner.isTarget[offset] = false;
+        if (inliner.depths[offset] >= inliner.width) {
+            inliner.width = inliner.depths[offset] + 1;
+        }
+    }
+    inliner.loaded = ALLOCATE(int, inliner.width);
+    for (int offset = 0; offset < oldCount; offset += instructionLength(chunk, offset)) {
+        if (isJump(chunk->code[offset])) {
+            inliner.isTarget[jumpTarget(chunk, offset)] = true;
+        }
+        if (chunk->code[offset] == OP_SWITCH) {
+            ObjSwitch *table = AS_SWITCH(chunk->constants.values[chunk->code[offset + 3]]);
+            for (int i = 0; i < table->caseCount; i++) {
+                inliner.isTarget[table->cases[i]] = true;
+            }
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < inliner.width; i++) {
+        inliner.loaded[i] = -1;
+    }
+    for (int offset = 0; offset < oldCount; offset += instructionLength(chunk, offset)) {
+        inliner.newOffsets[offset] = inliner.code.count;
+        if (inliner.isTarget[offset]) {
+            for (int i = 0; i < inliner.width; i++) {
+                inliner.loaded[i] = -1;
+            }
+        }
+
+        int base;
+        ObjFunction *callee = knownCallee(&inliner, offset, &base);
+        ObjNative *native = callee == NULL ? knownNative(&inliner, offset) : NULL;
+        if ((callee != NULL && bindCall(&inliner, offset, base, callee)) ||
+            (native != NULL && bindNative(&inliner, offset, native))) {
+            changed = true;
+        } else {
+            copyInstruction(&inliner, offset);
+        }
+        trackGlobals(&inliner, offset);
+    }
+    inliner.newOffsets[oldCount] = inliner.code.count;
+
+    if (changed) {
+        for (int i = 0; i < inliner.fixupCount; i++) {
+            JumpFixup *fixup = &inliner.fixups[i];
+            uint8_t *code = &inliner.code.code[fixup->at];
+            int target = inliner.newOffsets[fixup->target];
+            int jump = jumpsBack(code[0]) ? fixup->at + 3 - target : target - fixup->at - 3;
+            if (jump > UINT16_MAX) {
+                // The inlined code pushed the jump out of range, keep the
+                // chunk as it was.
+                changed = false;
+                break;
+            }
+            code[1] = (jump >> 8) & 0xff;
+            code[2] = jump & 0xff;
+        }
+    }
+
+    if (changed) {
+        for (int i = 0; i < inliner.fixupCount; i++) {
+            uint8_t *code = &inliner.code.code[inliner.fixups[i].at];
+            if (code[0] == OP_SWITCH) {
+                ObjSwitch *table = AS_SWITCH(chunk->constants.values[code[3]]);
+                for (int j = 0; j < table->caseCount; j++) {
+                    table->cases[j] = inliner.newOffsets[table->cases[j]];
+                }
+            }
+        }
+
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        chunk->code = inliner.code.code;
+        chunk->lines = inliner.code.lines;
+        chunk->count = inliner.code.count;
+        chunk->capacity = inliner.code.capacity;
+        initChunk(&inliner.code);
+    }
+
+    freeChunk(&inliner.code);
+    FREE_ARRAY(int, inliner.loaded, inliner.width);
+    FREE_ARRAY(int, inliner.depths, oldCount + 1);
+    FREE_ARRAY(bool, inliner.isTarget, oldCount + 1);
+    FREE_ARRAY(int, inliner.newOffsets, oldCount + 1);
+    FREE_ARRAY(JumpFixup, inliner.fixups, oldCount);
+}
@@ -0,0 +1,34 @@
+#ifndef CLOX_INLINER_H
+#define CLOX_INLINER_H
+
+#include "object.h"
+
+/*
+ * Calls of a global that the script declared with "fun" are bound to that
+ * function: OP_CALL becomes OP_CALL_KNOWN, which checks that the global
+ * still holds a closure of it and then skips the type dispatch and the
+ * arity check of a call. Small leaf functions, straight-line code without
+ * calls or closures, are copied into the caller instead, their locals moved
+ * up to where the callee's frame would have started. Calls of a global
+ * that holds a native while the script is compiled, the builtins, become
+ * OP_CALL_NATIVE when the argument count matches the native's arity.
+ *
+ * The global is checked on every call rather than proven constant, a later
+ * line of the REPL or a second declaration may well change it. Runtime
+ * errors in an inlined body are reported as if the call had been made.
+ */
+
+// The most bytes of code, up to its first OP_RETURN, a function can have
+// and still be inlined.
+#define INLINE_MAX 32
+
+/**
+ * Bind the calls in the stack code of *function* to the functions in
+ * *declared* and to natives, before the peephole pass runs over it.
+ * @param function
+ * @param declared the function each global slot was declared with, or NULL
+ * @param declaredCount
+ */
+void inlineCalls(ObjFunction *function, ObjFunction **declared, int declaredCount);
+
+#endif //CLOX_INLINER_H
@@ -0,0 +1,71 @@
+#ifndef CLOX_INTRINSIC_H
+#define CLOX_INTRINSIC_H
+
+#include "chunk.h"
+
+/*
+ * The math builtins: sqrt, floor, ceil, abs, sin, cos, tan, atan, min, max,
+ * pow and fmod. Each is a native like any other, but a call of one that the
+ * compiler binds (see inliner.h) becomes the instruction of the same name,
+ * which works the result out in place while the callee is still that
+ * native instead of calling it. Shared by vm.c and the C that aot.c writes.
+ *
+ * Whole results of whole arguments stay ints, so does rounding a double
+ * down or up to one that fits.
+ */
+
+static inline int intrinsicArity(uint8_t instruction) {
+    return instruction >= OP_MIN ? 2 : 1;
+}
+
+// *number* as an int Value when it is a whole number one can hold.
+static inline Value wholeNumber(double number) {
+    // Beyond 2^53 not every whole double is an int, and -0 isn't one.
+    if (number >= -9007199254740992.0 && number <= 9007199254740992.0 &&
+        number == (double) (int64_t) number && !(number == 0 && signbit(number)) &&
+        intFits((int64_t) number)) {
+        return INT_VALUE((int64_t) number);
+    }
+    return NUMBER_VALUE(number);
+}
+
+/**
+ * Apply the intrinsic *instruction* to *args*, leaving the result in
+ * *result*, which may be the slot right below them.
+ * @return false when an argument isn't a number
+ */
+static inline bool mathIntrinsic(uint8_t instruction, const Value *args, Value *result) {
+    Value a = args[0];
+    Value b = intrinsicArity(instruction) == 2 ? args[1] : a;
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+    }
+
+    switch (instruction) {
+        case OP_SQRT:   *result = NUMBER_VALUE(sqrt(AS_NUMBER(a))); break;
+        case OP_FLOOR:  *result = IS_INT(a) ? a : wholeNumber(floor(AS_NUMBER(a))); break;
+        case OP_CEIL:   *result = IS_INT(a) ? a : wholeNumber(ceil(AS_NUMBER(a))); break;
+        case OP_ABS:
+            if (IS_INT(a)) {
+                *result = AS_INT(a) < 0 ? negateNumber(a) : a;
+            } else {
+                *result = NUMBER_VALUE(fabs(AS_NUMBER(a)));
+            }
+            break;
+        case OP_SIN:    *result = NUMBER_VALUE(sin(AS_NUMBER(a))); break;
+        case OP_COS:    *result = NUMBER_VALUE(cos(AS_NUMBER(a))); break;
+        case OP_TAN:    *result = NUMBER_VALUE(tan(AS_NUMBER(a))); break;
+        case OP_ATAN:   *result = NUMBER_VALUE(atan(AS_NUMBER(a))); break;
+        case OP_MIN:    *result = lessNumbers(b, a) ? b : a; break;
+        case OP_MAX:    *result = greaterNumbers(b, a) ? b : a; break;
+        case OP_POW: {
+            double power = pow(AS_NUMBER(a), AS_NUMBER(b));
+            *result = ARE_INTS(a, b) ? wholeNumber(power) : NUMBER_VALUE(power);
+            break;
+        }
+        default:        *result = moduloNumbers(a, b); break;
+    }
+    return true;
+}
+
+#endif //CLOX_INTRINSIC_H
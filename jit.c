@@ -0,0 +1,1423 @@
+#include "jit.h"
+
+#ifdef JIT_COMPILER
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include <stdio.h>
+#endif
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+// Compiled code keeps its state in callee-saved registers, so it survives
+// the calls into the VM. RAX, RCX and RDX are scratch.
+#define SLOTS       RBX     // frame->slots
+#define STACK_TOP   R12     // vm.stackTop, stored before calling into the VM
+#define VM_BASE     R13     // &vm
+#define INT_TAG     R14     // QNAN | TAG_INT, only used with NaN boxing
+
+typedef enum {
+    CC_O = 0x0,
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf,
+} Condition;
+
+// The /digit of the "op r/m, imm" and shift instructions.
+typedef enum {
+    ALU_ADD = 0,
+    ALU_SUB = 5,
+    ALU_CMP = 7,
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7,
+} Extension;
+
+// Opcodes of the "op r/m, reg" forms.
+#define X86_ADD     0x01
+#define X86_OR      0x09
+#define X86_SUB     0x29
+#define X86_XOR     0x31
+#define X86_CMP     0x39
+#define X86_TEST    0x85
+#define X86_MOV     0x89
+
+#define VALUE_SIZE ((int32_t) sizeof(Value))
+
+// Compiled code handles ints in registers shifted left by INT_SHIFT, which
+// puts the 48 bits of an int Value at the top of the register. The
+// overflow flag then tells when a result doesn't fit an int Value any more,
+// exactly like intFits() in value.h.
+#define INT_SHIFT 16
+
+#ifndef NAN_BOXING
+#define PAYLOAD ((int32_t) offsetof(Value, as))
+#endif
+
+typedef struct {
+    int at;         // where the rel32 of the jump is in the code
+    int target;     // the bytecode offset it jumps to
+} JumpFixup;
+
+// A value on the operand stack whose push has been held back. Only reads of
+// locals and constants are, so it can be read again from where it is.
+typedef struct {
+    bool isConstant;
+    Value value;
+    Register base;      // otherwise the value is at [base + disp]
+    int32_t disp;
+    int slot;           // the local it reads, -1 for the value stack
+} Operand;
+
+#define PENDING_MAX 8
+
+typedef struct {
+    int at[8];
+    int count;
+} Patches;
+
+typedef struct {
+    ObjFunction *function;
+    Chunk *chunk;
+
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    // Indexed by bytecode offset.
+    int *entries;
+    bool *isTarget;
+    JumpFixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+
+    int epilogue;
+    int errorExit;
+    int exit;
+
+    // The top of the operand stack, not pushed yet. Everything below it is
+    // on the value stack.
+    Operand pending[PENDING_MAX];
+    int pendingCount;
+} Assembler;
+
+static void emitByte(Assembler *as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emitByte(as, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+    emit32(as, (uint32_t) value);
+    emit32(as, (uint32_t) (value >> 32));
+}
+
+static void emitRex(Assembler *as, bool wide, int reg, int base) {
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+    if (rex != 0x40) {
+        emitByte(as, rex);
+    }
+}
+
+// The ModRM byte for [base + disp], and the SIB byte RSP and R12 need.
+static void emitMemory(Assembler *as, int reg, Register base, int32_t disp) {
+    int mod = disp == 0 && (base & 7) != RBP ? 0 : (disp >= -128 && disp <= 127 ? 1 : 2);
+    emitByte(as, (uint8_t) ((mod << 6) | ((reg & 7) << 3) | (base & 7)));
+    if ((base & 7) == RSP) {
+        emitByte(as, 0x24);
+    }
+    if (mod == 1) {
+        emitByte(as, (uint8_t) disp);
+    } else if (mod == 2) {
+        emit32(as, (uint32_t) disp);
+    }
+}
+
+static void emitDirect(Assembler *as, int reg, Register rm) {
+    emitByte(as, (uint8_t) (0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// mov reg, [base + disp]
+static void emitLoad(Assembler *as, Register reg, Register base, int32_t disp) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x8b);
+    emitMemory(as, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void emitStore(Assembler *as, Register base, int32_t disp, Register reg) {
+    emitRex(as, true, reg, base);
+    emitByte(as, X86_MOV);
+    emitMemory(as, reg, base, disp);
+}
+
+// mov reg, imm
+static void emitMoveImmediate(Assembler *as, Register reg, uint64_t value) {
+    if (value <= UINT32_MAX) {
+        // Writing the low half clears the high one.
+        emitRex(as, false, 0, reg);
+        emitByte(as, (uint8_t) (0xb8 + (reg & 7)));
+        emit32(as, (uint32_t) value);
+        return;
+    }
+    emitRex(as, true, 0, reg);
+    emitByte(as, (uint8_t) (0xb8 + (reg & 7)));
+    emit64(as, value);
+}
+
+// op dst, src with one of the X86_* opcodes.
+static void emitAlu(Assembler *as, uint8_t opcode, Register dst, Register src) {
+    emitRex(as, true, src, dst);
+    emitByte(as, opcode);
+    emitDirect(as, src, dst);
+}
+
+// op reg, imm32
+static void emitAluImmediate(Assembler *as, Extension extension, Register reg, int32_t value) {
+    emitRex(as, true, 0, reg);
+    if (value >= -128 && value <= 127) {
+        emitByte(as, 0x83);
+        emitDirect(as, extension, reg);
+        emitByte(as, (uint8_t) value);
+    } else {
+        emitByte(as, 0x81);
+        emitDirect(as, extension, reg);
+        emit32(as, (uint32_t) value);
+    }
+}
+
+// Moves STACK_TOP by *count* values.
+static void emitAdjustStack(Assembler *as, int count) {
+    if (count != 0) {
+        emitAluImmediate(as, ALU_ADD, STACK_TOP, count * VALUE_SIZE);
+    }
+}
+
+static void emitShift(Assembler *as, Extension extension, Register reg, uint8_t count) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0xc1);
+    emitDirect(as, extension, reg);
+    emitByte(as, count);
+}
+
+// imul dst, src
+static void emitMultiply(Assembler *as, Register dst, Register src) {
+    emitRex(as, true, dst, src);
+    emitByte(as, 0x0f);
+    emitByte(as, 0xaf);
+    emitDirect(as, dst, src);
+}
+
+// cmp dword [base + disp], imm32
+static void emitCompareMemory(Assembler *as, Register base, int32_t disp, int32_t value) {
+    emitRex(as, false, 0, base);
+    if (value >= -128 && value <= 127) {
+        emitByte(as, 0x83);
+        emitMemory(as, ALU_CMP, base, disp);
+        emitByte(as, (uint8_t) value);
+    } else {
+        emitByte(as, 0x81);
+        emitMemory(as, ALU_CMP, base, disp);
+        emit32(as, (uint32_t) value);
+    }
+}
+
+// inc or dec dword [base + disp]
+static void emitIncrementMemory(Assembler *as, Register base, int32_t disp, bool decrement) {
+    emitRex(as, false, 0, base);
+    emitByte(as, 0xff);
+    emitMemory(as, decrement ? 1 : 0, base, disp);
+}
+
+// lea reg, [base + disp]
+static void emitLea(Assembler *as, Register reg, Register base, int32_t disp) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x8d);
+    emitMemory(as, reg, base, disp);
+}
+
+// movsxd reg, dword [base + disp]
+static void emitLoadInt32(Assembler *as, Register reg, Register base, int32_t disp) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x63);
+    emitMemory(as, reg, base, disp);
+}
+
+#ifndef NAN_BOXING
+static void emitCompareType(Assembler *as, Register base, int32_t disp, uint8_t type) {
+    emitCompareMemory(as, base, disp, type);
+}
+
+// mov dword [base + disp], imm32
+static void emitStoreType(Assembler *as, Register base, int32_t disp, uint32_t type) {
+    emitRex(as, false, 0, base);
+    emitByte(as, 0xc7);
+    emitMemory(as, 0, base, disp);
+    emit32(as, type);
+}
+#endif
+
+static void emitPush(Assembler *as, Register reg) {
+    emitRex(as, false, 0, reg);
+    emitByte(as, (uint8_t) (0x50 + (reg & 7)));
+}
+
+static void emitPop(Assembler *as, Register reg) {
+    emitRex(as, false, 0, reg);
+    emitByte(as, (uint8_t) (0x58 + (reg & 7)));
+}
+
+// Jumps return where their rel32 is, for patchJump().
+static int emitJump(Assembler *as) {
+    emitByte(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static int emitJumpIf(Assembler *as, Condition condition) {
+    emitByte(as, 0x0f);
+    emitByte(as, (uint8_t) (0x80 + condition));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void patchJumpTo(Assembler *as, int at, int target) {
+    uint32_t offset = (uint32_t) (target - (at + 4));
+    memcpy(&as->code[at], &offset, sizeof(offset));
+}
+
+static void patchJump(Assembler *as, int at) {
+    patchJumpTo(as, at, as->count);
+}
+
+static void addPatch(Patches *patches, int at) {
+    patches->at[patches->count++] = at;
+}
+
+static void patchAll(Assembler *as, Patches *patches) {
+    for (int i = 0; i < patches->count; i++) {
+        patchJump(as, patches->at[i]);
+    }
+}
+
+// A jump to a bytecode offset, resolved once all of the code is there.
+static void emitJumpToOffset(Assembler *as, int condition, int target) {
+    int at = condition < 0 ? emitJump(as) : emitJumpIf(as, (Condition) condition);
+    if (as->fixupCapacity < as->fixupCount + 1) {
+        int oldCapacity = as->fixupCapacity;
+        as->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        as->fixups = GROW_ARRAY(JumpFixup, as->fixups, oldCapacity, as->fixupCapacity);
+    }
+    as->fixups[as->fixupCount].at = at;
+    as->fixups[as->fixupCount].target = target;
+    as->fixupCount++;
+}
+
+/*
+ * Values.
+ */
+
+// Copy the value at [src + srcDisp] to [dst + dstDisp].
+static void copyValue(Assembler *as, Register dst, int32_t dstDisp, Register src, int32_t srcDisp) {
+#ifdef NAN_BOXING
+    emitLoad(as, RAX, src, srcDisp);
+    emitStore(as, dst, dstDisp, RAX);
+#else
+    // movups xmm0, [src]; movups [dst], xmm0
+    emitRex(as, false, 0, src);
+    emitByte(as, 0x0f);
+    emitByte(as, 0x10);
+    emitMemory(as, 0, src, srcDisp);
+    emitRex(as, false, 0, dst);
+    emitByte(as, 0x0f);
+    emitByte(as, 0x11);
+    emitMemory(as, 0, dst, dstDisp);
+#endif
+}
+
+static void storeConstant(Assembler *as, Register base, int32_t disp, Value value) {
+#ifdef NAN_BOXING
+    emitMoveImmediate(as, RAX, value);
+    emitStore(as, base, disp, RAX);
+#else
+    uint64_t payload;
+    memcpy(&payload, &value.as, sizeof(payload));
+    emitStoreType(as, base, disp, value.type);
+    emitMoveImmediate(as, RAX, payload);
+    emitStore(as, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+static void storeOperand(Assembler *as, Operand *operand, Register base, int32_t disp) {
+    if (operand->isConstant) {
+        storeConstant(as, base, disp, operand->value);
+    } else if (operand->base != base || operand->disp != disp) {
+        copyValue(as, base, disp, operand->base, operand->disp);
+    }
+}
+
+// A bool from the flags of the last comparison.
+static void storeCondition(Assembler *as, Register base, int32_t disp, Condition condition) {
+    // setcc al; movzx eax, al
+    emitByte(as, 0x0f);
+    emitByte(as, (uint8_t) (0x90 + condition));
+    emitDirect(as, 0, RAX);
+    emitByte(as, 0x0f);
+    emitByte(as, 0xb6);
+    emitDirect(as, RAX, RAX);
+#ifdef NAN_BOXING
+    // TRUE_VALUE is FALSE_VALUE | 1.
+    emitMoveImmediate(as, RCX, FALSE_VALUE);
+    emitAlu(as, X86_OR, RAX, RCX);
+    emitStore(as, base, disp, RAX);
+#else
+    emitStoreType(as, base, disp, VAL_BOOL);
+    emitStore(as, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+static bool canBeInt(Operand *operand) {
+    return !operand->isConstant || IS_INT(operand->value);
+}
+
+// Load *operand* as a shifted int, going to *slow* when it isn't an int.
+static void loadInt(Assembler *as, Register reg, Operand *operand, Patches *slow) {
+    if (operand->isConstant) {
+        emitMoveImmediate(as, reg, (uint64_t) AS_INT(operand->value) << INT_SHIFT);
+        return;
+    }
+#ifdef NAN_BOXING
+    emitLoad(as, reg, operand->base, operand->disp);
+    emitAlu(as, X86_MOV, RDX, reg);
+    emitAlu(as, X86_XOR, RDX, INT_TAG);
+    emitShift(as, SHIFT_SHR, RDX, 48);
+    addPatch(slow, emitJumpIf(as, CC_NE));
+    emitShift(as, SHIFT_SHL, reg, INT_SHIFT);
+#else
+    emitCompareType(as, operand->base, operand->disp, VAL_INT);
+    addPatch(slow, emitJumpIf(as, CC_NE));
+    emitLoad(as, reg, operand->base, operand->disp + PAYLOAD);
+    emitShift(as, SHIFT_SHL, reg, INT_SHIFT);
+#endif
+}
+
+static void storeInt(Assembler *as, Register base, int32_t disp, Register reg) {
+#ifdef NAN_BOXING
+    emitShift(as, SHIFT_SHR, reg, INT_SHIFT);
+    emitAlu(as, X86_OR, reg, INT_TAG);
+    emitStore(as, base, disp, reg);
+#else
+    emitShift(as, SHIFT_SAR, reg, INT_SHIFT);
+    emitStoreType(as, base, disp, VAL_INT);
+    emitStore(as, base, disp + PAYLOAD, reg);
+#endif
+}
+
+static void emitCallWithoutStackTop(Assembler *as, uintptr_t helper) {
+    emitMoveImmediate(as, RAX, (uint64_t) helper);
+    // call rax
+    emitByte(as, 0xff);
+    emitDirect(as, 2, RAX);
+}
+
+// Calls *helper* in vm.c, whose arguments are already in RDI and RSI.
+static void emitCall(Assembler *as, uintptr_t helper) {
+    emitStore(as, VM_BASE, (int32_t) offsetof(VM, stackTop), STACK_TOP);
+    emitCallWithoutStackTop(as, helper);
+}
+
+// Set the flags from the bool or int a helper returned.
+static void emitTestBool(Assembler *as) {
+    // test al, al
+    emitByte(as, 0x84);
+    emitDirect(as, RAX, RAX);
+}
+
+static void emitTestInt(Assembler *as) {
+    // test eax, eax
+    emitByte(as, X86_TEST);
+    emitDirect(as, RAX, RAX);
+}
+
+static void reloadStackTop(Assembler *as) {
+    emitLoad(as, STACK_TOP, VM_BASE, (int32_t) offsetof(VM, stackTop));
+}
+
+static void emitArguments(Assembler *as, uint8_t *ip, int argument) {
+    emitMoveImmediate(as, RDI, (uint64_t) (uintptr_t) ip);
+    emitMoveImmediate(as, RSI, (uint64_t) argument);
+}
+
+// Leave with *result* in EAX.
+static void emitLeave(Assembler *as, JitResult result) {
+    emitMoveImmediate(as, RAX, result);
+    patchJumpTo(as, emitJump(as), as->epilogue);
+}
+
+/*
+ * The operand stack.
+ */
+
+static void pushPending(Assembler *as, Operand operand);
+
+// Push all but the top *keep* pending operands, oldest first.
+static void flushPending(Assembler *as, int keep) {
+    int count = as->pendingCount - keep;
+    if (count <= 0) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        storeOperand(as, &as->pending[i], STACK_TOP, i * VALUE_SIZE);
+    }
+    emitAdjustStack(as, count);
+    memmove(as->pending, as->pending + count, sizeof(Operand) * keep);
+    as->pendingCount = keep;
+}
+
+static void pushPending(Assembler *as, Operand operand) {
+    if (as->pendingCount == PENDING_MAX) {
+        flushPending(as, PENDING_MAX - 1);
+    }
+    as->pending[as->pendingCount++] = operand;
+}
+
+static void pushLocal(Assembler *as, int slot) {
+    Operand operand = {false, NIL_VALUE, SLOTS, slot * VALUE_SIZE, slot};
+    pushPending(as, operand);
+}
+
+static void pushConstant(Assembler *as, Value value) {
+    Operand operand = {true, value, RAX, 0, -1};
+    pushPending(as, operand);
+}
+
+// Push whatever reads local *slot* before it is written.
+static void flushLocal(Assembler *as, int slot, int keep) {
+    for (int i = 0; i < as->pendingCount - keep; i++) {
+        if (!as->pending[i].isConstant && as->pending[i].slot == slot) {
+            flushPending(as, keep);
+            return;
+        }
+    }
+}
+
+// Pop the top *count* operands into *operands*, deepest first, and return
+// how many of them were on the value stack. Those are addressed relative to
+// STACK_TOP, which still has to be moved down past them.
+static int takeOperands(Assembler *as, Operand *operands, int count) {
+    flushPending(as, count);
+    int stacked = count - as->pendingCount;
+    for (int i = 0; i < stacked; i++) {
+        Operand operand = {false, NIL_VALUE, STACK_TOP, -(stacked - i) * VALUE_SIZE, -1};
+        operands[i] = operand;
+    }
+    for (int i = stacked; i < count; i++) {
+        operands[i] = as->pending[i - stacked];
+    }
+    as->pendingCount = 0;
+    return stacked;
+}
+
+// The top of the operand stack, without popping it.
+static Operand peekOperand(Assembler *as) {
+    if (as->pendingCount > 0) {
+        return as->pending[as->pendingCount - 1];
+    }
+    Operand operand = {false, NIL_VALUE, STACK_TOP, -VALUE_SIZE, -1};
+    return operand;
+}
+
+// Put the operands that weren't on the value stack there too, for the VM.
+static void spillOperands(Assembler *as, Operand *operands, int count, int stacked) {
+    for (int i = stacked; i < count; i++) {
+        storeOperand(as, &operands[i], STACK_TOP, (i - stacked) * VALUE_SIZE);
+    }
+    emitAdjustStack(as, count - stacked);
+}
+
+/*
+ * Instructions.
+ */
+
+static void binary(Assembler *as, uint8_t op, uint8_t *ip) {
+    Operand operands[2];
+    int stacked = takeOperands(as, operands, 2);
+    int32_t result = -stacked * VALUE_SIZE;
+    int done = -1;
+
+    if (op != OP_DIVIDE && op != OP_MODULO && op != OP_ADD_STRING &&
+        canBeInt(&operands[0]) && canBeInt(&operands[1])) {
+        Patches slow = {{0}, 0};
+        loadInt(as, RAX, &operands[0], &slow);
+        loadInt(as, RCX, &operands[1], &slow);
+        switch (op) {
+            case OP_ADD:
+            case OP_ADD_NUMBER:
+                emitAlu(as, X86_ADD, RAX, RCX);
+                addPatch(&slow, emitJumpIf(as, CC_O));
+                storeInt(as, STACK_TOP, result, RAX);
+                break;
+            case OP_SUBTRACT:
+                emitAlu(as, X86_SUB, RAX, RCX);
+                addPatch(&slow, emitJumpIf(as, CC_O));
+                storeInt(as, STACK_TOP, result, RAX);
+                break;
+            case OP_MULTIPLY:
+                // Only one of the factors may carry the shift.
+                emitShift(as, SHIFT_SAR, RCX, INT_SHIFT);
+                emitMultiply(as, RAX, RCX);
+                addPatch(&slow, emitJumpIf(as, CC_O));
+                // Which zero it is, see multiplyNumbers().
+                emitAlu(as, X86_TEST, RAX, RAX);
+                addPatch(&slow, emitJumpIf(as, CC_E));
+                storeInt(as, STACK_TOP, result, RAX);
+                break;
+            default: {
+                Condition condition;
+                switch (op) {
+                    case OP_EQUAL:          condition = CC_E; break;
+                    case OP_NOT_EQUAL:      condition = CC_NE; break;
+                    case OP_GREATER:        condition = CC_G; break;
+                    case OP_GREATER_EQUAL:  condition = CC_GE; break;
+                    case OP_LESS:           condition = CC_L; break;
+                    default:                condition = CC_LE; break;
+                }
+                emitAlu(as, X86_CMP, RAX, RCX);
+                storeCondition(as, STACK_TOP, result, condition);
+                break;
+            }
+        }
+        emitAdjustStack(as, 1 - stacked);
+        done = emitJump(as);
+        patchAll(as, &slow);
+    }
+
+    spillOperands(as, operands, 2, stacked);
+    emitArguments(as, ip, op);
+    emitCall(as, (uintptr_t) jitBinary);
+    reloadStackTop(as);
+    emitTestBool(as);
+    patchJumpTo(as, emitJumpIf(as, CC_E), as->errorExit);
+    if (done != -1) {
+        patchJump(as, done);
+    }
+}
+
+static void compareJump(Assembler *as, uint8_t op, uint8_t *ip, int target) {
+    Operand operands[2];
+    int stacked = takeOperands(as, operands, 2);
+    int done = -1;
+
+    if (canBeInt(&operands[0]) && canBeInt(&operands[1])) {
+        Patches slow = {{0}, 0};
+        loadInt(as, RAX, &operands[0], &slow);
+        loadInt(as, RCX, &operands[1], &slow);
+        // Before the comparison, adding clobbers the flags.
+        emitAdjustStack(as, -stacked);
+        emitAlu(as, X86_CMP, RAX, RCX);
+        Condition condition;
+        switch (op) {
+            case OP_JUMP_IF_NOT_LESS:           condition = CC_GE; break;
+            case OP_JUMP_IF_NOT_LESS_EQUAL:     condition = CC_G; break;
+            case OP_JUMP_IF_NOT_GREATER:        condition = CC_LE; break;
+            case OP_JUMP_IF_NOT_GREATER_EQUAL:  condition = CC_L; break;
+            case OP_JUMP_IF_NOT_EQUAL:          condition = CC_NE; break;
+            default:                            condition = CC_E; break;
+        }
+        emitJumpToOffset(as, condition, target);
+        done = emitJump(as);
+        patchAll(as, &slow);
+    }
+
+    spillOperands(as, operands, 2, stacked);
+    emitArguments(as, ip, op);
+    emitCall(as, (uintptr_t) jitCompareJump);
+    reloadStackTop(as);
+    emitTestInt(as);
+    patchJumpTo(as, emitJumpIf(as, CC_L), as->errorExit);
+    emitJumpToOffset(as, CC_NE, target);
+    if (done != -1) {
+        patchJump(as, done);
+    }
+}
+
+static void incrementLocal(Assembler *as, int slot, Value constant, uint8_t *ip) {
+    flushLocal(as, slot, 0);
+    int32_t local = slot * VALUE_SIZE;
+    int done = -1;
+
+    if (IS_INT(constant)) {
+        Patches slow = {{0}, 0};
+        Operand operand = {false, NIL_VALUE, SLOTS, local, slot};
+        loadInt(as, RAX, &operand, &slow);
+        int64_t increment = AS_INT(constant);
+        if (increment >= INT32_MIN >> INT_SHIFT && increment <= INT32_MAX >> INT_SHIFT) {
+            emitAluImmediate(as, ALU_ADD, RAX, (int32_t) ((uint64_t) increment << INT_SHIFT));
+        } else {
+            emitMoveImmediate(as, RCX, (uint64_t) increment << INT_SHIFT);
+            emitAlu(as, X86_ADD, RAX, RCX);
+        }
+        addPatch(&slow, emitJumpIf(as, CC_O));
+        storeInt(as, SLOTS, local, RAX);
+        done = emitJump(as);
+        patchAll(as, &slow);
+    }
+
+    // Held back operands stay where they are, the slow path works above
+    // the ones that were pushed.
+    copyValue(as, STACK_TOP, 0, SLOTS, local);
+    storeConstant(as, STACK_TOP, VALUE_SIZE, constant);
+    emitAdjustStack(as, 2);
+    emitArguments(as, ip, OP_ADD);
+    emitCall(as, (uintptr_t) jitBinary);
+    reloadStackTop(as);
+    emitTestBool(as);
+    patchJumpTo(as, emitJumpIf(as, CC_E), as->errorExit);
+    copyValue(as, SLOTS, local, STACK_TOP, -VALUE_SIZE);
+    emitAdjustStack(as, -1);
+    if (done != -1) {
+        patchJump(as, done);
+    }
+}
+
+// The tick of a backward jump ending at *ip*, see INTERRUPT_INTERVAL. Goes
+// on to *target* when it is set, else falls through.
+static void spendFuel(Assembler *as, uint8_t *ip, int target) {
+    emitIncrementMemory(as, VM_BASE, (int32_t) offsetof(VM, fuel), true);
+    int done = -1;
+    if (target == -1) {
+        done = emitJumpIf(as, CC_GE);
+    } else {
+        emitJumpToOffset(as, CC_GE, target);
+    }
+    emitArguments(as, ip, 0);
+    emitCall(as, (uintptr_t) jitPoll);
+    emitTestBool(as);
+    patchJumpTo(as, emitJumpIf(as, CC_E), as->errorExit);
+    if (done != -1) {
+        patchJump(as, done);
+    } else {
+        emitJumpToOffset(as, -1, target);
+    }
+}
+
+// OP_FOR_PREP and OP_FOR_LOOP, as the increment and the comparison they
+// stand for.
+static void countingLoop(Assembler *as, int offset) {
+    uint8_t *code = &as->chunk->code[offset];
+    uint8_t *next = code + instructionLength(as->chunk, offset);
+    Value *constants = as->chunk->constants.values;
+    bool inclusive = (code[5] & FOR_INCLUSIVE) != 0;
+
+    uint8_t op;
+    if (code[0] == OP_FOR_LOOP) {
+        flushPending(as, 0);
+        spendFuel(as, next, -1);
+        incrementLocal(as, code[3], constants[code[6]], next);
+        // Jumps back while the counter is still below the limit.
+        op = inclusive ? OP_JUMP_IF_NOT_GREATER : OP_JUMP_IF_NOT_GREATER_EQUAL;
+    } else {
+        op = inclusive ? OP_JUMP_IF_NOT_LESS_EQUAL : OP_JUMP_IF_NOT_LESS;
+    }
+    pushLocal(as, code[3]);
+    if (code[5] & FOR_CONSTANT_LIMIT) {
+        pushConstant(as, constants[code[4]]);
+    } else {
+        pushLocal(as, code[4]);
+    }
+    compareJump(as, op, next, jumpTarget(as->chunk, offset));
+}
+
+static void setLocal(Assembler *as, int slot) {
+    if (as->pendingCount == 0) {
+        copyValue(as, SLOTS, slot * VALUE_SIZE, STACK_TOP, -VALUE_SIZE);
+        return;
+    }
+
+    flushLocal(as, slot, 1);
+    Operand top = peekOperand(as);
+    storeOperand(as, &top, SLOTS, slot * VALUE_SIZE);
+}
+
+static void drop(Assembler *as, int count) {
+    while (count > 0 && as->pendingCount > 0) {
+        as->pendingCount--;
+        count--;
+    }
+    emitAdjustStack(as, -count);
+}
+
+// Leaves the address of global *slot* in RCX and errors out when it hasn't
+// been defined, unless *checked* says it already was.
+static void globalAddress(Assembler *as, int slot, bool checked, uint8_t *ip) {
+    // The array moves when it grows, so it is looked up every time.
+    emitLoad(as, RCX, VM_BASE, (int32_t) offsetof(VM, globalValues.values));
+    emitAluImmediate(as, ALU_ADD, RCX, slot * VALUE_SIZE);
+    if (checked) {
+        return;
+    }
+
+#ifdef NAN_BOXING
+    emitMoveImmediate(as, RDX, UNDEFINED_VALUE);
+    emitRex(as, true, RDX, RCX);
+    emitByte(as, 0x3b);     // cmp rdx, [rcx]
+    emitMemory(as, RDX, RCX, 0);
+#else
+    emitCompareType(as, RCX, 0, VAL_UNDEFINED);
+#endif
+    int defined = emitJumpIf(as, CC_NE);
+    emitArguments(as, ip, slot);
+    emitCall(as, (uintptr_t) jitUndefinedGlobal);
+    patchJumpTo(as, emitJump(as), as->errorExit);
+    patchJump(as, defined);
+}
+
+// Falsey values are nil and false.
+static void jumpIfFalse(Assembler *as, int target) {
+    flushPending(as, 0);
+#ifdef NAN_BOXING
+    // NIL_VALUE and FALSE_VALUE are next to each other.
+    emitLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+    emitMoveImmediate(as, RCX, NIL_VALUE);
+    emitAlu(as, X86_SUB, RAX, RCX);
+    emitAluImmediate(as, ALU_CMP, RAX, 1);
+    emitJumpToOffset(as, CC_BE, target);
+#else
+    emitCompareType(as, STACK_TOP, -VALUE_SIZE, VAL_NIL);
+    emitJumpToOffset(as, CC_E, target);
+    emitCompareType(as, STACK_TOP, -VALUE_SIZE, VAL_BOOL);
+    int truthy = emitJumpIf(as, CC_NE);
+    // cmp byte [r12 + disp], 0
+    emitRex(as, false, 0, STACK_TOP);
+    emitByte(as, 0x80);
+    emitMemory(as, ALU_CMP, STACK_TOP, -VALUE_SIZE + PAYLOAD);
+    emitByte(as, 0);
+    emitJumpToOffset(as, CC_E, target);
+    patchJump(as, truthy);
+#endif
+}
+
+// Leaves the address of vm.frames[vm.frameCount + index] in RDI.
+static void frameAddress(Assembler *as, int index) {
+    emitLoadInt32(as, R10, VM_BASE, (int32_t) offsetof(VM, frameCount));
+    // imul rdi, r10, sizeof(CallFrame)
+    emitRex(as, true, RDI, R10);
+    emitByte(as, 0x69);
+    emitDirect(as, RDI, R10);
+    emit32(as, (uint32_t) sizeof(CallFrame));
+    emitRex(as, true, RDI, VM_BASE);
+    emitByte(as, 0x03);     // add rdi, [r13 + frames]
+    emitMemory(as, RDI, VM_BASE, (int32_t) offsetof(VM, frames));
+    if (index != 0) {
+        emitAluImmediate(as, ALU_ADD, RDI, index * (int32_t) sizeof(CallFrame));
+    }
+}
+
+// Jump to where the code for the bytecode offset in EAX starts, which has
+// to be a jump target.
+static void jumpToEntry(Assembler *as) {
+    // mov ecx, eax
+    emitByte(as, X86_MOV);
+    emitDirect(as, RAX, RCX);
+    emitShift(as, SHIFT_SHL, RCX, 2);
+    // The entries move to the JitCode unchanged.
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) as->entries);
+    emitAlu(as, X86_ADD, RAX, RCX);
+    emitLoadInt32(as, RAX, RAX, 0);
+    // lea rcx, [rip + disp32] back to the start of the code
+    emitRex(as, true, RCX, 0);
+    emitByte(as, 0x8d);
+    emitByte(as, (uint8_t) (((RCX & 7) << 3) | 5));
+    emit32(as, (uint32_t) -(as->count + 4));
+    emitAlu(as, X86_ADD, RAX, RCX);
+    // jmp rax
+    emitByte(as, 0xff);
+    emitDirect(as, 4, RAX);
+}
+
+// Calls into compiled code go straight there when the callee is a compiled
+// closure and nothing needs to grow, doing what call() would inline. The
+// rest goes through jitCall().
+static void callValue(Assembler *as, int argCount, uint8_t *ip) {
+    flushPending(as, 0);
+    int32_t callee = -(argCount + 1) * VALUE_SIZE;
+    Patches slow = {{0}, 0};
+
+    // RCX = the closure, RDX = its function, RAX = its JitCode.
+#ifdef NAN_BOXING
+    emitLoad(as, RCX, STACK_TOP, callee);
+    emitAlu(as, X86_MOV, RAX, RCX);
+    emitShift(as, SHIFT_SHR, RAX, 50);
+    emitAluImmediate(as, ALU_CMP, RAX, (int32_t) ((SIGN_BIT | QNAN) >> 50));
+    addPatch(&slow, emitJumpIf(as, CC_NE));
+    emitShift(as, SHIFT_SHL, RCX, 16);
+    emitShift(as, SHIFT_SHR, RCX, 16);
+#else
+    emitCompareType(as, STACK_TOP, callee, VAL_OBJ);
+    addPatch(&slow, emitJumpIf(as, CC_NE));
+    emitLoad(as, RCX, STACK_TOP, callee + PAYLOAD);
+#endif
+    emitCompareMemory(as, RCX, (int32_t) offsetof(Obj, type), OBJ_CLOSURE);
+    addPatch(&slow, emitJumpIf(as, CC_NE));
+    emitLoad(as, RDX, RCX, (int32_t) offsetof(ObjClosure, function));
+    emitCompareMemory(as, RDX, (int32_t) offsetof(ObjFunction, arity), argCount);
+    addPatch(&slow, emitJumpIf(as, CC_NE));
+    emitLoad(as, RAX, RDX, (int32_t) offsetof(ObjFunction, jit));
+    emitAlu(as, X86_TEST, RAX, RAX);
+    addPatch(&slow, emitJumpIf(as, CC_E));
+    emitCompareMemory(as, VM_BASE, (int32_t) offsetof(VM, jitDepth), JIT_DEPTH_MAX);
+    addPatch(&slow, emitJumpIf(as, CC_GE));
+    emitLoadInt32(as, RSI, VM_BASE, (int32_t) offsetof(VM, frameCount));
+    emitRex(as, false, RSI, VM_BASE);
+    emitByte(as, 0x3b);     // cmp esi, [r13 + frameCapacity]
+    emitMemory(as, RSI, VM_BASE, (int32_t) offsetof(VM, frameCapacity));
+    addPatch(&slow, emitJumpIf(as, CC_GE));
+    // The callee's frame must fit on the stack: R8 = where it would end,
+    // R9 = where the stack ends.
+    emitLoadInt32(as, R8, RDX, (int32_t) offsetof(ObjFunction, maxStack));
+    emitShift(as, SHIFT_SHL, R8, VALUE_SIZE == 8 ? 3 : 4);
+    emitAlu(as, X86_ADD, R8, STACK_TOP);
+    emitLoadInt32(as, R9, VM_BASE, (int32_t) offsetof(VM, stackCapacity));
+    emitShift(as, SHIFT_SHL, R9, VALUE_SIZE == 8 ? 3 : 4);
+    emitRex(as, true, R9, VM_BASE);
+    emitByte(as, 0x03);     // add r9, [r13 + stack]
+    emitMemory(as, R9, VM_BASE, (int32_t) offsetof(VM, stack));
+    emitAluImmediate(as, ALU_ADD, R9, -callee);
+    emitAlu(as, X86_CMP, R8, R9);
+    addPatch(&slow, emitJumpIf(as, CC_A));
+    // Out of fuel, pushFrame() polls.
+    emitIncrementMemory(as, VM_BASE, (int32_t) offsetof(VM, fuel), true);
+    addPatch(&slow, emitJumpIf(as, CC_L));
+
+    // Push the frame, with our own ip stored for stack traces.
+    frameAddress(as, 0);
+    emitMoveImmediate(as, R8, (uint64_t) (uintptr_t) ip);
+    emitStore(as, RDI, (int32_t) (offsetof(CallFrame, ip) - sizeof(CallFrame)), R8);
+    emitStore(as, RDI, (int32_t) offsetof(CallFrame, closure), RCX);
+    emitLoad(as, R8, RDX, (int32_t) offsetof(ObjFunction, chunk.code));
+    emitStore(as, RDI, (int32_t) offsetof(CallFrame, ip), R8);
+    emitLea(as, R8, STACK_TOP, callee);
+    emitStore(as, RDI, (int32_t) offsetof(CallFrame, slots), R8);
+    emitIncrementMemory(as, VM_BASE, (int32_t) offsetof(VM, frameCount), false);
+    emitIncrementMemory(as, VM_BASE, (int32_t) offsetof(VM, jitDepth), false);
+    emitStore(as, VM_BASE, (int32_t) offsetof(VM, stackTop), STACK_TOP);
+
+    emitAlu(as, X86_MOV, RDI, R8);
+    emitLoad(as, RSI, RAX, (int32_t) offsetof(JitCode, start));
+    emitLoad(as, RAX, RAX, (int32_t) offsetof(JitCode, code));
+    emitByte(as, 0xff);     // call rax
+    emitDirect(as, 2, RAX);
+    emitIncrementMemory(as, VM_BASE, (int32_t) offsetof(VM, jitDepth), true);
+    emitAluImmediate(as, ALU_CMP, RAX, JIT_RETURNED);
+    int returned = emitJumpIf(as, CC_E);
+    // Tail calls, exits and errors are sorted out by the VM. The callee
+    // owns vm.stackTop now.
+    emitAlu(as, X86_MOV, RDI, RAX);
+    emitCallWithoutStackTop(as, (uintptr_t) jitFinishCall);
+    emitTestBool(as);
+    patchJumpTo(as, emitJumpIf(as, CC_E), as->errorExit);
+    patchJump(as, returned);
+    // The callee may have moved the stack.
+    frameAddress(as, -1);
+    emitLoad(as, SLOTS, RDI, (int32_t) offsetof(CallFrame, slots));
+    reloadStackTop(as);
+    int done = emitJump(as);
+
+    patchAll(as, &slow);
+    emitArguments(as, ip, argCount);
+    emitCall(as, (uintptr_t) jitCall);
+    emitAlu(as, X86_TEST, RAX, RAX);
+    patchJumpTo(as, emitJumpIf(as, CC_E), as->errorExit);
+    emitAlu(as, X86_MOV, SLOTS, RAX);
+    reloadStackTop(as);
+    patchJump(as, done);
+}
+
+// OP_CALL_KNOWN at *offset*: on into the inlined body when the callee is a
+// closure of the known function, otherwise a call that continues after it.
+static void callInlined(Assembler *as, int offset) {
+    uint8_t *code = &as->chunk->code[offset];
+    int target = jumpTarget(as->chunk, offset);
+    ObjFunction *known = AS_FUNCTION(as->chunk->constants.values[code[4]]);
+    flushPending(as, 0);
+    int32_t callee = -(code[3] + 1) * VALUE_SIZE;
+    Patches call = {{0}, 0};
+
+#ifdef NAN_BOXING
+    emitLoad(as, RCX, STACK_TOP, callee);
+    emitAlu(as, X86_MOV, RAX, RCX);
+    emitShift(as, SHIFT_SHR, RAX, 50);
+    emitAluImmediate(as, ALU_CMP, RAX, (int32_t) ((SIGN_BIT | QNAN) >> 50));
+    addPatch(&call, emitJumpIf(as, CC_NE));
+    emitShift(as, SHIFT_SHL, RCX, 16);
+    emitShift(as, SHIFT_SHR, RCX, 16);
+#else
+    emitCompareType(as, STACK_TOP, callee, VAL_OBJ);
+    addPatch(&call, emitJumpIf(as, CC_NE));
+    emitLoad(as, RCX, STACK_TOP, callee + PAYLOAD);
+#endif
+    emitCompareMemory(as, RCX, (int32_t) offsetof(Obj, type), OBJ_CLOSURE);
+    addPatch(&call, emitJumpIf(as, CC_NE));
+    emitLoad(as, RDX, RCX, (int32_t) offsetof(ObjClosure, function));
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) known);
+    emitAlu(as, X86_CMP, RDX, RAX);
+    int inlined = emitJumpIf(as, CC_E);
+
+    patchAll(as, &call);
+    callValue(as, code[3], as->chunk->code + target);
+    emitJumpToOffset(as, -1, target);
+    patchJump(as, inlined);
+}
+
+// OP_CALL_NATIVE at *offset*: straight into the C function when the callee
+// is still the native the call was bound to.
+static void callNative(Assembler *as, int offset) {
+    uint8_t *code = &as->chunk->code[offset];
+    int argCount = code[1];
+    Value value = as->chunk->constants.values[code[2]];
+    ObjNative *native = AS_NATIVE(value);
+    flushPending(as, 0);
+    int32_t callee = -(argCount + 1) * VALUE_SIZE;
+    Patches slow = {{0}, 0};
+
+#ifdef NAN_BOXING
+    emitLoad(as, RCX, STACK_TOP, callee);
+    emitMoveImmediate(as, RAX, value);
+#else
+    emitCompareType(as, STACK_TOP, callee, VAL_OBJ);
+    addPatch(&slow, emitJumpIf(as, CC_NE));
+    emitLoad(as, RCX, STACK_TOP, callee + PAYLOAD);
+    emitMoveImmediate(as, RAX, (uint64_t) (uintptr_t) native);
+#endif
+    emitAlu(as, X86_CMP, RCX, RAX);
+    addPatch(&slow, emitJumpIf(as, CC_NE));
+
+    // Our own ip, for the stack trace should the native fail.
+    frameAddress(as, -1);
+    emitMoveImmediate(as, R8, (uint64_t) (uintptr_t) (code + 3));
+    emitStore(as, RDI, (int32_t) offsetof(CallFrame, ip), R8);
+    emitMoveImmediate(as, RDI, (uint64_t) argCount);
+    emitLea(as, RSI, STACK_TOP, callee + VALUE_SIZE);
+    emitLea(as, RDX, STACK_TOP, callee);
+    if (native->flags & NATIVE_NO_ALLOC) {
+        // Nothing can look at the stack while it runs.
+        emitCallWithoutStackTop(as, (uintptr_t) native->function);
+    } else {
+        emitCall(as, (uintptr_t) native->function);
+    }
+    emitTestBool(as);
+    patchJumpTo(as, emitJumpIf(as, CC_E), as->errorExit);
+    emitLea(as, STACK_TOP, STACK_TOP, callee + VALUE_SIZE);
+    int done = emitJump(as);
+
+    patchAll(as, &slow);
+    callValue(as, argCount, code + 3);
+    patchJump(as, done);
+}
+
+// What jitReturn() does, inline unless upvalues need closing. Functions
+// whose locals no closure captures never have any.
+static void returnFromFrame(Assembler *as) {
+    flushPending(as, 0);
+    if (as->function->capturesLocals) {
+        // The open upvalues are sorted, the first one is the highest.
+        emitLoad(as, RAX, VM_BASE, (int32_t) offsetof(VM, openUpvalues));
+        emitAlu(as, X86_TEST, RAX, RAX);
+        int none = emitJumpIf(as, CC_E);
+        emitRex(as, true, SLOTS, RAX);
+        emitByte(as, X86_CMP);      // cmp [rax + location], rbx
+        emitMemory(as, SLOTS, RAX, (int32_t) offsetof(ObjUpvalue, location));
+        int below = emitJumpIf(as, CC_B);
+        emitCall(as, (uintptr_t) jitReturn);
+        emitLeave(as, JIT_RETURNED);
+        patchJump(as, none);
+        patchJump(as, below);
+    }
+
+    emitIncrementMemory(as, VM_BASE, (int32_t) offsetof(VM, frameCount), true);
+    // The script's own closure isn't replaced by a result.
+    int script = emitJumpIf(as, CC_E);
+    copyValue(as, SLOTS, 0, STACK_TOP, -VALUE_SIZE);
+    emitLea(as, RAX, SLOTS, VALUE_SIZE);
+    emitStore(as, VM_BASE, (int32_t) offsetof(VM, stackTop), RAX);
+    emitLeave(as, JIT_RETURNED);
+    patchJump(as, script);
+    emitStore(as, VM_BASE, (int32_t) offsetof(VM, stackTop), SLOTS);
+    emitLeave(as, JIT_RETURNED);
+}
+
+// Hand the frame over to the interpreter at *ip*.
+static void exitTo(Assembler *as, uint8_t *ip) {
+    flushPending(as, 0);
+    emitMoveImmediate(as, RDI, (uint64_t) (uintptr_t) ip);
+    patchJumpTo(as, emitJump(as), as->exit);
+}
+
+static void compileInstruction(Assembler *as, int offset) {
+    Chunk *chunk = as->chunk;
+    uint8_t *code = &chunk->code[offset];
+    uint8_t *next = code + instructionLength(chunk, offset);
+    Value *constants = chunk->constants.values;
+    uint8_t op = genericInstruction(code[0]);
+
+    switch (op) {
+        case OP_CONSTANT:   pushConstant(as, constants[code[1]]); break;
+        case OP_NIL:        pushConstant(as, NIL_VALUE); break;
+        case OP_TRUE:       pushConstant(as, BOOL_VALUE(true)); break;
+        case OP_FALSE:      pushConstant(as, BOOL_VALUE(false)); break;
+        case OP_POP:        drop(as, 1); break;
+        case OP_POPN:       drop(as, code[1]); break;
+        case OP_GET_LOCAL:  pushLocal(as, code[1]); break;
+        case OP_GET_LOCAL_0:
+        case OP_GET_LOCAL_1:
+        case OP_GET_LOCAL_2:
+        case OP_GET_LOCAL_3:
+            pushLocal(as, op - OP_GET_LOCAL_0);
+            break;
+        case OP_SET_LOCAL:  setLocal(as, code[1]); break;
+        case OP_DUP: {
+            if (as->pendingCount > 0) {
+                pushPending(as, peekOperand(as));
+            } else {
+                copyValue(as, STACK_TOP, 0, STACK_TOP, -VALUE_SIZE);
+                emitAdjustStack(as, 1);
+            }
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED: {
+            flushPending(as, 0);
+            globalAddress(as, (code[1] << 8) | code[2], op == OP_GET_GLOBAL_DEFINED, next);
+            copyValue(as, STACK_TOP, 0, RCX, 0);
+            emitAdjustStack(as, 1);
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL: {
+            Operand value = peekOperand(as);
+            globalAddress(as, (code[1] << 8) | code[2], op == OP_DEFINE_GLOBAL, next);
+            storeOperand(as, &value, RCX, 0);
+            if (op == OP_DEFINE_GLOBAL) {
+                drop(as, 1);
+            }
+            break;
+        }
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE: {
+            // Slot 0 holds the running closure.
+            Operand value = peekOperand(as);
+            if (op == OP_GET_UPVALUE) {
+                flushPending(as, 0);
+            }
+#ifdef NAN_BOXING
+            emitLoad(as, RCX, SLOTS, 0);
+            emitShift(as, SHIFT_SHL, RCX, 16);
+            emitShift(as, SHIFT_SHR, RCX, 16);
+#else
+            emitLoad(as, RCX, SLOTS, PAYLOAD);
+#endif
+            emitLoad(as, RCX, RCX, (int32_t) offsetof(ObjClosure, upvalues));
+            emitLoad(as, RCX, RCX, code[1] * (int32_t) sizeof(ObjUpvalue *));
+            emitLoad(as, RCX, RCX, (int32_t) offsetof(ObjUpvalue, location));
+            if (op == OP_GET_UPVALUE) {
+                copyValue(as, STACK_TOP, 0, RCX, 0);
+                emitAdjustStack(as, 1);
+            } else {
+                storeOperand(as, &value, RCX, 0);
+            }
+            break;
+        }
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+            binary(as, op, next);
+            break;
+        case OP_ADD_LOCALS:
+            pushLocal(as, code[1]);
+            pushLocal(as, code[2]);
+            binary(as, OP_ADD, next);
+            break;
+        case OP_INC_LOCAL:
+            incrementLocal(as, code[1], constants[code[2]], next);
+            break;
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            countingLoop(as, offset);
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            flushPending(as, 0);
+            emitArguments(as, next, op);
+            emitCall(as, (uintptr_t) jitUnary);
+            reloadStackTop(as);
+            emitTestBool(as);
+            patchJumpTo(as, emitJumpIf(as, CC_E), as->errorExit);
+            break;
+        case OP_PRINT:
+            flushPending(as, 0);
+            emitCall(as, (uintptr_t) jitPrint);
+            reloadStackTop(as);
+            break;
+        case OP_JUMP_IF_FALSE:
+            jumpIfFalse(as, jumpTarget(chunk, offset));
+            break;
+        case OP_JUMP:
+            flushPending(as, 0);
+            emitJumpToOffset(as, -1, jumpTarget(chunk, offset));
+            break;
+        case OP_LOOP:
+            flushPending(as, 0);
+            spendFuel(as, next, jumpTarget(chunk, offset));
+            break;
+        case OP_CALL_KNOWN:
+            if (hasInlinedBody(chunk, offset)) {
+                callInlined(as, offset);
+            } else {
+                callValue(as, code[3], next);
+            }
+            break;
+        case OP_SWITCH:
+            flushPending(as, 0);
+            emitMoveImmediate(as, RDI, (uint64_t) (uintptr_t) next);
+            emitCall(as, (uintptr_t) jitSwitch);
+            jumpToEntry(as);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            compareJump(as, op, next, jumpTarget(chunk, offset));
+            break;
+        case OP_CALL:
+            callValue(as, code[1], next);
+            break;
+        case OP_CALL_NATIVE:
+            callNative(as, offset);
+            break;
+        case OP_TAIL_CALL: {
+            flushPending(as, 0);
+            emitArguments(as, next, code[1]);
+            emitCall(as, (uintptr_t) jitTailCall);
+            reloadStackTop(as);
+            emitTestInt(as);
+            patchJumpTo(as, emitJumpIf(as, CC_L), as->errorExit);
+            // Natives just leave their result for the OP_RETURN that follows.
+            int native = emitJumpIf(as, CC_E);
+            emitLeave(as, JIT_TAIL_CALLED);
+            patchJump(as, native);
+            break;
+        }
+        case OP_CLOSURE: {
+            // Once made, the closure of a function without upvalues is a
+            // constant.
+            ObjFunction *function = AS_FUNCTION(constants[code[1]]);
+            if (function->closure != NULL) {
+                pushConstant(as, OBJ_VALUE(function->closure));
+                break;
+            }
+            flushPending(as, 0);
+            emitMoveImmediate(as, RDI, (uint64_t) (uintptr_t) (code + 1));
+            emitCall(as, (uintptr_t) jitClosure);
+            reloadStackTop(as);
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            flushPending(as, 0);
+            emitCall(as, (uintptr_t) jitCloseUpvalue);
+            reloadStackTop(as);
+            break;
+        case OP_RETURN:
+            returnFromFrame(as);
+            break;
+        default:
+            // Rare enough to leave to the interpreter (OP_CLASS).
+            exitTo(as, code);
+            break;
+    }
+}
+
+// The entry sequence and the ways out every instruction jumps to.
+static void compileStubs(Assembler *as) {
+    // The native signature is JitResult (Value *slots, void *entry). Five
+    // pushes keep the C stack 16-byte aligned for the calls into the VM.
+    emitPush(as, RBX);
+    emitPush(as, R12);
+    emitPush(as, R13);
+    emitPush(as, R14);
+    emitPush(as, R15);
+    emitAlu(as, X86_MOV, SLOTS, RDI);
+    emitMoveImmediate(as, VM_BASE, (uint64_t) (uintptr_t) &vm);
+    reloadStackTop(as);
+#ifdef NAN_BOXING
+    emitMoveImmediate(as, INT_TAG, QNAN | TAG_INT);
+#endif
+    // jmp rsi
+    emitByte(as, 0xff);
+    emitDirect(as, 4, RSI);
+
+    as->epilogue = as->count;
+    emitPop(as, R15);
+    emitPop(as, R14);
+    emitPop(as, R13);
+    emitPop(as, R12);
+    emitPop(as, RBX);
+    emitByte(as, 0xc3);
+
+    as->errorExit = as->count;
+    emitLeave(as, JIT_ERROR);
+
+    // Expects the bytecode to continue at in RDI.
+    as->exit = as->count;
+    emitCall(as, (uintptr_t) jitExit);
+    emitLeave(as, JIT_EXITED);
+}
+
+bool jitCompile(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    Assembler as;
+    as.function = function;
+    as.chunk = chunk;
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.entries = ALLOCATE(int, chunk->count + 1);
+    as.isTarget = ALLOCATE(bool, chunk->count + 1);
+    as.fixups = NULL;
+    as.fixupCount = 0;
+    as.fixupCapacity = 0;
+    as.pendingCount = 0;
+
+    for (int offset = 0; offset <= chunk->count; offset++) {
+        as.entries[offset] = -1;
+        as.isTarget[offset] = false;
+    }
+    as.isTarget[0] = true;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (isJump(chunk->code[offset])) {
+            as.isTarget[jumpTarget(chunk, offset)] = true;
+        }
+        if (chunk->code[offset] == OP_SWITCH) {
+            ObjSwitch *table = AS_SWITCH(chunk->constants.values[chunk->code[offset + 3]]);
+            for (int i = 0; i < table->caseCount; i++) {
+                as.isTarget[table->cases[i]] = true;
+            }
+        }
+    }
+
+    compileStubs(&as);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        // Whoever jumps here has pushed everything.
+        if (as.isTarget[offset]) {
+            flushPending(&as, 0);
+            as.entries[offset] = as.count;
+        }
+        compileInstruction(&as, offset);
+    }
+    // Nothing runs past the final OP_RETURN, but a jump may still land there.
+    as.entries[chunk->count] = as.count;
+    exitTo(&as, chunk->code + chunk->count);
+
+    for (int i = 0; i < as.fixupCount; i++) {
+        patchJumpTo(&as, as.fixups[i].at, as.entries[as.fixups[i].target]);
+    }
+
+    JitCode *jit = NULL;
+    void *memory = mmap(NULL, (size_t) as.count, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        memcpy(memory, as.code, (size_t) as.count);
+        if (mprotect(memory, (size_t) as.count, PROT_READ | PROT_EXEC) == 0) {
+            jit = ALLOCATE(JitCode, 1);
+            jit->code = memory;
+            jit->size = (size_t) as.count;
+            jit->start = jit->code + as.entries[0];
+            jit->entries = as.entries;
+            jit->entryCount = chunk->count + 1;
+            as.entries = NULL;
+        } else {
+            munmap(memory, (size_t) as.count);
+        }
+    }
+
+#ifdef DEBUG_PRINT_CODE
+    if (jit != NULL) {
+        printf("== %s: %d bytes of machine code ==\n",
+               function->name != NULL ? function->name->chars : "<script>", as.count);
+    }
+#endif
+
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    if (as.entries != NULL) {
+        FREE_ARRAY(int, as.entries, chunk->count + 1);
+    }
+    FREE_ARRAY(bool, as.isTarget, chunk->count + 1);
+    FREE_ARRAY(JumpFixup, as.fixups, as.fixupCapacity);
+
+    if (jit == NULL) {
+        function->hotness = 0;
+        return false;
+    }
+    function->jit = jit;
+    return true;
+}
+
+JitResult jitEnter(CallFrame *frame) {
+    ObjFunction *function = frame->closure->function;
+    JitCode *jit = function->jit;
+    int offset = (int) (frame->ip - function->chunk.code);
+    if (offset < 0 || offset >= jit->entryCount || jit->entries[offset] == -1) {
+        return JIT_EXITED;
+    }
+
+    JitResult (*code)(Value *, void *) = (JitResult (*)(Value *, void *)) (void *) jit->code;
+    return code(frame->slots, jit->code + jit->entries[offset]);
+}
+
+void freeJitCode(JitCode *code) {
+    if (code == NULL) {
+        return;
+    }
+    munmap(code->code, code->size);
+    FREE_ARRAY(int, code->entries, code->entryCount);
+    FREE(JitCode, code);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "vm.h"
+
+// Compiled code calls compiled code on the C stack. Past this many nested
+// activations calls stay in the interpreter, which doesn't recurse.
+#define JIT_DEPTH_MAX 1024
+
+typedef enum {
+    JIT_RETURNED,       // the frame returned, like OP_RETURN in run()
+    JIT_TAIL_CALLED,    // the frame now belongs to the callee of a tail call
+    JIT_EXITED,         // the interpreter has to continue at frame->ip
+    JIT_ERROR,          // a runtime error has been reported
+} JitResult;
+
+// Implemented in vm.c, compiled code calls them with vm.stackTop up to date.
+// *ip* is where the instruction making the call ends, for error messages.
+// The C written by aot.c uses them as well.
+bool jitBinary(uint8_t *ip, uint8_t op);
+int jitCompareJump(uint8_t *ip, uint8_t op);
+bool jitUnary(uint8_t *ip, uint8_t op);
+void jitPrint();
+void jitUndefinedGlobal(uint8_t *ip, int slot);
+Value *jitCall(uint8_t *ip, int argCount);
+bool jitPushFrame(uint8_t *ip, int argCount);
+bool jitFinishCall(JitResult status);
+int jitTailCall(uint8_t *ip, int argCount);
+void jitClosure(uint8_t *operands);
+void jitCloseUpvalue();
+void jitReturn();
+void jitExit(uint8_t *ip);
+bool jitPoll(uint8_t *ip);
+int jitSwitch(uint8_t *ip);
+
+#ifdef JIT_COMPILER
+
+/*
+ * Baseline compiler from stack bytecode to x86-64 machine code. Every
+ * instruction becomes a fixed template: the common cases (locals, constants,
+ * jumps, int arithmetic and comparisons) are inlined, everything else calls
+ * back into the VM through the jit*() functions above. Reads of locals and
+ * constants are held back until the instruction that consumes them, so most
+ * of them never go through the value stack.
+ *
+ * Compiled code shares the frame layout of run() and keeps frame->slots and
+ * vm.stackTop in registers. It can be entered at the start of the function
+ * or at any jump target, which is how a loop that got hot in the
+ * interpreter moves over to machine code.
+ */
+
+// Calls plus loop iterations before a function gets compiled.
+#define JIT_THRESHOLD 1000
+
+typedef struct JitCode {
+    uint8_t *code;
+    size_t size;
+    // Where a call starts running the function.
+    uint8_t *start;
+    // Where each bytecode offset starts in code, -1 unless the code can be
+    // entered there.
+    int *entries;
+    int entryCount;
+} JitCode;
+
+/**
+ * Compile the stack code of *function* into function->jit. A function that
+ * can't be compiled gets its hotness reset so it isn't tried again soon.
+ * @param function
+ * @return whether machine code was produced
+ */
+bool jitCompile(ObjFunction *function);
+
+/**
+ * Run the compiled code of the top frame from frame->ip.
+ * @param frame the top frame, its function must have been compiled
+ * @return how the frame was left, JIT_EXITED straight away when frame->ip
+ *         isn't an entry point
+ */
+JitResult jitEnter(CallFrame *frame);
+
+void freeJitCode(JitCode *code);
+
+#endif
+
+#endif //CLOX_JIT_H
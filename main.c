@@ -1,9 +1,12 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "aot.h"
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
 #include "rainbow.h"
@@ -57,24 +60,102 @@ static char *readFile(const char *path) {
     return buffer;
 }
 
-static void runFile(const char *path) {
+// Ctrl-C stops a script with a stack trace of where it was. A second one
+// before the script got to stop kills the process like Ctrl-C always would.
+static void onInterrupt(int number) {
+    if (atomic_load(&vm.interruptRequested)) {
+        signal(number, SIG_DFL);
+        raise(number);
+        return;
+    }
+    requestInterrupt();
+}
+
+// Saves the profile of the run to *profilePath* unless it is NULL, see
+// profile.h.
+static void runFile(const char *path, const char *profilePath) {
     char *source = readFile(path);
+    // Without SA_RESTART, so a read input() is blocked in returns.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onInterrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
     InterpretResult result = interpret(source);
     free(source);
 
+    if (profilePath != NULL && result != INTERPRET_COMPILE_ERROR &&
+        !saveProfile(profilePath)) {
+        errors("Could not write file \"");
+        errors(profilePath);
+        errors("\".\n");
+    }
+
     if(result == INTERPRET_COMPILE_ERROR) exit(65);
     if(result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Writes the C translation of the script at *path* to *outPath*, see aot.h.
+static void emitFile(const char *path, const char *outPath) {
+    char *source = readFile(path);
+    // --emit-c translates every function body, so lazy compilation stays off
+    // here.
+    vm.lazyCompile = false;
+    ObjFunction *script = compile(source);
+    if (script == NULL) exit(65);
+
+    FILE *out = fopen(outPath, "w");
+    if (out == NULL) {
+        errors("Could not write file \"");
+        errors(outPath);
+        errors("\".\n");
+        exit(74);
+    }
+    aotWrite(out, script, source);
+    fclose(out);
+    free(source);
+}
+
 int main(int argc, const char* argv[]) {
     initVM();
 
-    if(argc == 1){
+    const char *emitPath = NULL;
+    const char *profilePath = NULL;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--register") == 0) {
+            vm.registerEngine = true;
+        } else if (strcmp(argv[1], "--no-jit") == 0) {
+            vm.jitEnabled = false;
+        } else if (strcmp(argv[1], "--lazy") == 0) {
+            vm.lazyCompile = true;
+        } else if (strcmp(argv[1], "--emit-c") == 0 && argc > 2) {
+            emitPath = argv[2];
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--profile") == 0 && argc > 2) {
+            profilePath = argv[2];
+            loadProfile(profilePath);
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--budget") == 0 && argc > 2) {
+            setBudget(strtoll(argv[2], NULL, 10));
+            argc--;
+            argv++;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (emitPath != NULL && argc == 2) {
+        emitFile(argv[1], emitPath);
+    } else if(argc == 1 && emitPath == NULL){
         repl();
     } else if (argc == 2) {
-        runFile(argv[1]);
+        runFile(argv[1], profilePath);
     } else {
-        rainbows("Usage: clox [path]\n");
+        rainbows("Usage: clox [--register] [--no-jit] [--lazy] [--budget ticks] [--profile file] [--emit-c out.c] [path]\n");
         exit(64);
     }
 
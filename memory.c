@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
@@ -94,12 +95,18 @@ static void blackenObject(Obj *object) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
             markObject((Obj *) function->name);
+            markObject((Obj *) function->closure);
+            markObject((Obj *) function->lazySource);
             markArray(&function->chunk.constants);
+            markMemoTable(&function->memo);
             break;
         }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue *) object)->closed);
             break;
+        case OBJ_SWITCH:
+            markTable(&((ObjSwitch *) object)->strings);
+            break;
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
@@ -125,6 +132,11 @@ static void freeObject(Obj *object) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*) object;
             freeChunk(&function->chunk);
+            freeChunk(&function->registerCode);
+            freeMemoTable(&function->memo);
+#ifdef JIT_COMPILER
+            freeJitCode(function->jit);
+#endif
             FREE(ObjFunction, object);
             break;
         }
@@ -141,6 +153,16 @@ static void freeObject(Obj *object) {
         case OBJ_UPVALUE:
             FREE(ObjUpvalue, object);
             break;
+        case OBJ_SWITCH: {
+            ObjSwitch *table = (ObjSwitch *) object;
+            FREE_ARRAY(int, table->cases, table->caseCapacity);
+            FREE_ARRAY(int64_t, table->keys, table->keyCapacity);
+            FREE_ARRAY(int, table->keyCases, table->keyCapacity);
+            FREE_ARRAY(int, table->direct, table->directCount);
+            freeTable(&table->strings);
+            FREE(ObjSwitch, object);
+            break;
+        }
     }
 }
 
@@ -160,7 +182,12 @@ static void markRoots() {
         markObject((Obj *) upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalNames);
+    markTable(&vm.globalConstants);
+    markArray(&vm.globalConstantValues);
+    markTable(&vm.assignedGlobals);
+    markArray(&vm.globalValues);
+    markArray(&vm.profile.scripts);
     markCompilerRoots();
 }
 
@@ -49,19 +49,47 @@ ObjClosure *newClosure(ObjFunction *function) {
     return closure;
 }
 
+ObjClosure *functionClosure(ObjFunction *function) {
+    if (function->upvalueCount > 0) {
+        return newClosure(function);
+    }
+    if (function->closure == NULL) {
+        function->closure = newClosure(function);
+    }
+    return function->closure;
+}
+
 ObjFunction *newFunction() {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 
     function->arity = 0;
     function->upvalueCount = 0;
+    function->closure = NULL;
+    function->capturesLocals = false;
+    function->memoized = false;
+    initMemoTable(&function->memo);
+    function->profileKey = 0;
+    function->lazySource = NULL;
+    function->lazyStart = 0;
+    function->lazyLine = 0;
+    function->lazyConstants = 0;
     function->name = NULL;
     initChunk(&function->chunk);
+    initChunk(&function->registerCode);
+    function->registerCount = 0;
+    function->maxStack = 0;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->aot = NULL;
     return function;
 }
 
-ObjNative *newNative(NativeFn function) {
+ObjNative *newNative(NativeFn function, int arity, uint8_t flags) {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
+    native->flags = flags;
+    native->instruction = OP_CALL_NATIVE;
     return native;
 }
 
@@ -120,6 +148,137 @@ ObjUpvalue *newUpvalue(Value *slot) {
     return upvalue;
 }
 
+ObjSwitch *newSwitch() {
+    ObjSwitch *table = ALLOCATE_OBJ(ObjSwitch, OBJ_SWITCH);
+    table->cases = NULL;
+    table->caseCount = 0;
+    table->caseCapacity = 0;
+    table->keys = NULL;
+    table->keyCases = NULL;
+    table->keyCount = 0;
+    table->keyCapacity = 0;
+    table->direct = NULL;
+    table->directCount = 0;
+    initTable(&table->strings);
+    return table;
+}
+
+void addSwitchCase(ObjSwitch *table, Value key, int target) {
+    if (table->caseCapacity < table->caseCount + 1) {
+        int oldCapacity = table->caseCapacity;
+        table->caseCapacity = GROW_CAPACITY(oldCapacity);
+        table->cases = GROW_ARRAY(int, table->cases, oldCapacity, table->caseCapacity);
+    }
+    int index = table->caseCount++;
+    table->cases[index] = target;
+
+    if (IS_STRING(key)) {
+        Value existing;
+        if (!tableGet(&table->strings, AS_STRING(key), &existing)) {
+            tableSet(&table->strings, AS_STRING(key), INT_VALUE(index));
+        }
+        return;
+    }
+
+    // Duplicates are dropped by finishSwitch().
+    if (table->keyCapacity < table->keyCount + 1) {
+        int oldCapacity = table->keyCapacity;
+        table->keyCapacity = GROW_CAPACITY(oldCapacity);
+        table->keys = GROW_ARRAY(int64_t, table->keys, oldCapacity, table->keyCapacity);
+        table->keyCases = GROW_ARRAY(int, table->keyCases, oldCapacity, table->keyCapacity);
+    }
+    table->keys[table->keyCount] = AS_INT(key);
+    table->keyCases[table->keyCount] = index;
+    table->keyCount++;
+}
+
+void finishSwitch(ObjSwitch *table) {
+    // Insertion sort, ordered by case as well so the first case of a key
+    // comes first and is the one kept.
+    for (int i = 1; i < table->keyCount; i++) {
+        int64_t key = table->keys[i];
+        int index = table->keyCases[i];
+        int j = i;
+        while (j > 0 && table->keys[j - 1] > key) {
+            table->keys[j] = table->keys[j - 1];
+            table->keyCases[j] = table->keyCases[j - 1];
+            j--;
+        }
+        table->keys[j] = key;
+        table->keyCases[j] = index;
+    }
+    int count = 0;
+    for (int i = 0; i < table->keyCount; i++) {
+        if (count == 0 || table->keys[count - 1] != table->keys[i]) {
+            table->keys[count] = table->keys[i];
+            table->keyCases[count] = table->keyCases[i];
+            count++;
+        }
+    }
+    table->keyCount = count;
+
+    if (count > 0 && table->keys[count - 1] - table->keys[0] < 4 * (int64_t) count) {
+        table->directCount = (int) (table->keys[count - 1] - table->keys[0] + 1);
+        table->direct = ALLOCATE(int, table->directCount);
+        for (int i = 0; i < table->directCount; i++) {
+            table->direct[i] = -1;
+        }
+        for (int i = 0; i < count; i++) {
+            table->direct[table->keys[i] - table->keys[0]] = table->keyCases[i];
+        }
+    }
+}
+
+int switchCase(ObjSwitch *table, Value value) {
+    if (IS_STRING(value)) {
+        Value index;
+        return tableGet(&table->strings, AS_STRING(value), &index) ? (int) AS_INT(index) : -1;
+    }
+
+    if (table->keyCount == 0) {
+        return -1;
+    }
+    int64_t first = table->keys[0];
+    int64_t last = table->keys[table->keyCount - 1];
+    int64_t key;
+    if (IS_INT(value)) {
+        key = AS_INT(value);
+    } else if (IS_DOUBLE(value)) {
+        // Equal to an int key only when it is that int exactly, the
+        // compiler keeps keys small enough to convert without rounding.
+        double number = AS_NUMBER(value);
+        if (!(number >= (double) first && number <= (double) last)) {
+            return -1;
+        }
+        key = (int64_t) number;
+        if ((double) key != number) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    if (key < first || key > last) {
+        return -1;
+    }
+
+    if (table->direct != NULL) {
+        return table->direct[key - first];
+    }
+    int low = 0;
+    int high = table->keyCount - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (table->keys[middle] < key) {
+            low = middle + 1;
+        } else if (table->keys[middle] > key) {
+            high = middle - 1;
+        } else {
+            return table->keyCases[middle];
+        }
+    }
+    return -1;
+}
+
 static void printFunction(ObjFunction *function) {
     if(function->name == NULL) {
         printf("<script>");
@@ -148,5 +307,8 @@ void printObject(Value value) {
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
+        case OBJ_SWITCH:
+            printf("<switch table>");
+            break;
     }
 }
@@ -8,6 +8,7 @@
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
+#include "table.h"
 
 #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
 
@@ -16,13 +17,15 @@
 #define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)    isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)    isObjType(value, OBJ_STRING)
+#define IS_SWITCH(value)    isObjType(value, OBJ_SWITCH)
 
 #define AS_CLASS(value)     ((ObjClass *)AS_OBJ(value))
 #define AS_CLOSURE(value)   ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value)  ((ObjFunction *)AS_OBJ(value))
-#define AS_NATIVE(value)    (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value)    ((ObjNative *)AS_OBJ(value))
 #define AS_STRING(value)    ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString *)AS_OBJ(value))->chars)
+#define AS_SWITCH(value)    ((ObjSwitch *)AS_OBJ(value))
 
 typedef enum {
     OBJ_CLASS,
@@ -31,6 +34,7 @@ typedef enum {
     OBJ_NATIVE,
     OBJ_STRING,
     OBJ_UPVALUE,
+    OBJ_SWITCH,
 } ObjType;
 
 struct Obj {
@@ -39,19 +43,71 @@ struct Obj {
     struct Obj *next;
 };
 
+// The C translation of a function written by aot.c. It runs the top frame
+// from bytecode *offset* and returns a JitResult (see jit.h).
+typedef int (*AotFunction)(Value *slots, int offset);
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
     Chunk chunk;
+    // Filled in by compileRegisters() when running on the register engine,
+    // it shares the constant table of chunk.
+    Chunk registerCode;
+    int registerCount;
+    // Stack slots a frame of this function needs, including slot 0.
+    int maxStack;
+    // Calls and loop iterations counted towards compiling the function to
+    // machine code, which jit then points to (see jit.h).
+    int hotness;
+    struct JitCode *jit;
+    // Set when the program was compiled ahead of time, see aot.h.
+    AotFunction aot;
+    // The closure every OP_CLOSURE of a function without upvalues gives,
+    // see functionClosure().
+    struct ObjClosure *closure;
+    // Whether a closure captures any of its locals. When none does, returns
+    // have no upvalues to close.
+    bool capturesLocals;
+    // Declared with "memo fun", calls look their arguments up in memo
+    // before running the function, see callMemoized() in vm.c.
+    bool memoized;
+    MemoTable memo;
+    // The hash of the code as compiled, set when the run is profiled and
+    // cleared once saved (see profile.h).
+    uint32_t profileKey;
+    // Until the body is compiled at the first call, the script it is in and
+    // where its parameter list starts, see compileFunction().
+    ObjString *lazySource;
+    int lazyStart;
+    int lazyLine;
+    // The global "const"s declared before it, the only ones the body sees.
+    int lazyConstants;
     ObjString *name;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// Leaves the result of a native in *result*. A native that fails reports
+// the error through runtimeError() and returns false.
+typedef bool (*NativeFn)(int argCount, Value *args, Value *result);
+
+// The result depends on nothing but the arguments, and calling it has no
+// effect besides producing it.
+#define NATIVE_PURE     0x01
+// Never allocates, so a call can't start a collection either. Any other
+// native may.
+#define NATIVE_NO_ALLOC 0x02
 
 typedef struct {
     Obj obj;
     NativeFn function;
+    // The number of arguments every call passes, checked before the native
+    // is, or -1 for any number.
+    int arity;
+    uint8_t flags;
+    // What a call bound to the native compiles to (see inliner.h), either
+    // OP_CALL_NATIVE or the instruction of a math intrinsic.
+    uint8_t instruction;
 } ObjNative;
 
 typedef struct ObjUpvalue {
@@ -61,7 +117,7 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction *function;
     ObjUpvalue **upvalues;
@@ -80,13 +136,63 @@ struct ObjString {
     uint32_t hash;
 };
 
+// The jump table of an OP_SWITCH, a constant of the chunk it is in.
+typedef struct {
+    Obj obj;
+    // Where the body of each case starts in the chunk.
+    int *cases;
+    int caseCount;
+    int caseCapacity;
+    // Int keys sorted, each with the index of its case.
+    int64_t *keys;
+    int *keyCases;
+    int keyCount;
+    int keyCapacity;
+    // When the keys are close together, the case index of every int from
+    // keys[0] on (-1 for none), so no search is needed.
+    int *direct;
+    int directCount;
+    // String keys, with the case index as an int value.
+    Table strings;
+} ObjSwitch;
+
 ObjClass *newClass(ObjString *name);
 ObjClosure *newClosure(ObjFunction *function);
+/**
+ * A closure of *function* for OP_CLOSURE. Without upvalues there is nothing
+ * to tell two closures of a function apart, so that is always the same
+ * one, allocated the first time.
+ */
+ObjClosure *functionClosure(ObjFunction *function);
 ObjFunction *newFunction();
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(NativeFn function, int arity, uint8_t flags);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
 ObjUpvalue *newUpvalue(Value *slot);
+ObjSwitch *newSwitch();
+
+/**
+ * Add a case whose body starts at *target* to *table*. A key that is
+ * already there keeps the case it had.
+ * @param table
+ * @param key an int or a string
+ * @param target
+ */
+void addSwitchCase(ObjSwitch *table, Value key, int target);
+
+/**
+ * Sort the int keys of *table* once all its cases are in.
+ * @param table
+ */
+void finishSwitch(ObjSwitch *table);
+
+/**
+ * @param table
+ * @param value
+ * @return the index of the case *value* is equal to, -1 if there is none
+ */
+int switchCase(ObjSwitch *table, Value value);
+
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
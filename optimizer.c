@@ -0,0 +1,217 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+typedef struct {
+    int at;         // offset of the jump instruction in the new code
+    int target;     // offset the jump went to in the old code
+} JumpFixup;
+
+typedef struct {
+    Chunk *chunk;
+    // Start offset of every instruction in the old code, in order.
+    int *starts;
+    int count;
+    // Indexed by old offset, true if some jump lands there.
+    bool *isTarget;
+
+    Chunk code;
+    // Indexed by old offset, where that instruction starts in the new code.
+    int *newOffsets;
+    JumpFixup *fixups;
+    int fixupCount;
+} Peephole;
+
+static uint8_t opAt(Peephole *peephole, int index) {
+    return peephole->chunk->code[peephole->starts[index]];
+}
+
+static uint8_t operandAt(Peephole *peephole, int index, int operand) {
+    return peephole->chunk->code[peephole->starts[index] + 1 + operand];
+}
+
+// Whether instructions [index, index + length) exist and nothing jumps into
+// the middle of them, so they can be replaced by a single instruction.
+static bool canFuse(Peephole *peephole, int index, int length) {
+    if (index + length > peephole->count) {
+        return false;
+    }
+
+    for (int i = index + 1; i < index + length; i++) {
+        if (peephole->isTarget[peephole->starts[i]]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool matches(Peephole *peephole, int index, int length, const uint8_t *ops) {
+    if (!canFuse(peephole, index, length)) {
+        return false;
+    }
+
+    for (int i = 0; i < length; i++) {
+        if (opAt(peephole, index + i) != ops[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void emit(Peephole *peephole, uint8_t byte, int line) {
+    writeChunk(&peephole->code, byte, line);
+}
+
+// Copy one instruction over as it is, remembering where its jump went.
+static void copyInstruction(Peephole *peephole, int index) {
+    Chunk *chunk = peephole->chunk;
+    int offset = peephole->starts[index];
+    int length = instructionLength(chunk, offset);
+
+    if (isJump(chunk->code[offset])) {
+        JumpFixup *fixup = &peephole->fixups[peephole->fixupCount++];
+        fixup->at = peephole->code.count;
+        fixup->target = jumpTarget(chunk, offset);
+    }
+
+    for (int i = 0; i < length; i++) {
+        emit(peephole, chunk->code[offset + i], chunk->lines[offset + i]);
+    }
+}
+
+// Emit the replacement for the instructions starting at *index* and return
+// how many of them it covers.
+static int fuse(Peephole *peephole, int index) {
+    int line = peephole->chunk->lines[peephole->starts[index]];
+
+    // i = i + 1;
+    static const uint8_t increment[] = {
+            OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP
+    };
+    if (matches(peephole, index, 5, increment) &&
+        operandAt(peephole, index, 0) == operandAt(peephole, index + 3, 0)) {
+        emit(peephole, OP_INC_LOCAL, line);
+        emit(peephole, operandAt(peephole, index, 0), line);
+        emit(peephole, operandAt(peephole, index + 1, 0), line);
+        return 5;
+    }
+
+    // a + b
+    static const uint8_t addLocals[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD};
+    if (matches(peephole, index, 3, addLocals)) {
+        emit(peephole, OP_ADD_LOCALS, line);
+        emit(peephole, operandAt(peephole, index, 0), line);
+        emit(peephole, operandAt(peephole, index + 1, 0), line);
+        return 3;
+    }
+
+    // !=, >= and <= are compiled to a comparison followed by OP_NOT.
+    if (canFuse(peephole, index, 2) && opAt(peephole, index + 1) == OP_NOT) {
+        switch (opAt(peephole, index)) {
+            case OP_EQUAL:      emit(peephole, OP_NOT_EQUAL, line); return 2;
+            case OP_LESS:       emit(peephole, OP_GREATER_EQUAL, line); return 2;
+            case OP_GREATER:    emit(peephole, OP_LESS_EQUAL, line); return 2;
+            default:
+                break;
+        }
+    }
+
+    // Leaving a scope pops each of its locals.
+    if (opAt(peephole, index) == OP_POP) {
+        int count = 1;
+        while (count < UINT8_MAX && canFuse(peephole, index, count + 1) &&
+               opAt(peephole, index + count) == OP_POP) {
+            count++;
+        }
+
+        if (count > 1) {
+            emit(peephole, OP_POPN, line);
+            emit(peephole, (uint8_t) count, line);
+            return count;
+        }
+    }
+
+    if (opAt(peephole, index) == OP_GET_LOCAL && operandAt(peephole, index, 0) <= 3) {
+        emit(peephole, OP_GET_LOCAL_0 + operandAt(peephole, index, 0), line);
+        return 1;
+    }
+
+    copyInstruction(peephole, index);
+    return 1;
+}
+
+void optimizeChunk(Chunk *chunk) {
+    int oldCount = chunk->count;
+    Peephole peephole;
+    peephole.chunk = chunk;
+    peephole.starts = ALLOCATE(int, chunk->count);
+    peephole.count = 0;
+    peephole.isTarget = ALLOCATE(bool, chunk->count + 1);
+    peephole.newOffsets = ALLOCATE(int, chunk->count + 1);
+    peephole.fixups = ALLOCATE(JumpFixup, chunk->count);
+    peephole.fixupCount = 0;
+    initChunk(&peephole.code);
+
+    for (int offset = 0; offset <= chunk->count; offset++) {
+        peephole.isTarget[offset] = false;
+    }
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        peephole.starts[peephole.count++] = offset;
+        if (isJump(chunk->code[offset])) {
+            int target = jumpTarget(chunk, offset);
+            if (target < 0 || target > chunk->count) {
+                // Only a broken chunk gets here, leave it alone.
+                goto cleanup;
+            }
+            peephole.isTarget[target] = true;
+        }
+        if (chunk->code[offset] == OP_SWITCH) {
+            ObjSwitch *table = AS_SWITCH(chunk->constants.values[chunk->code[offset + 3]]);
+            for (int i = 0; i < table->caseCount; i++) {
+                peephole.isTarget[table->cases[i]] = true;
+            }
+        }
+    }
+
+    for (int i = 0; i < peephole.count;) {
+        peephole.newOffsets[peephole.starts[i]] = peephole.code.count;
+        i += fuse(&peephole, i);
+    }
+    peephole.newOffsets[chunk->count] = peephole.code.count;
+
+    // The code only got shorter, so every jump still fits in 16 bits.
+    for (int i = 0; i < peephole.fixupCount; i++) {
+        JumpFixup *fixup = &peephole.fixups[i];
+        int target = peephole.newOffsets[fixup->target];
+        int jump = jumpsBack(peephole.code.code[fixup->at]) ?
+                   fixup->at + 3 - target : target - fixup->at - 3;
+        peephole.code.code[fixup->at + 1] = (jump >> 8) & 0xff;
+        peephole.code.code[fixup->at + 2] = jump & 0xff;
+
+        if (peephole.code.code[fixup->at] == OP_SWITCH) {
+            uint8_t constant = peephole.code.code[fixup->at + 3];
+            ObjSwitch *table = AS_SWITCH(chunk->constants.values[constant]);
+            for (int j = 0; j < table->caseCount; j++) {
+                table->cases[j] = peephole.newOffsets[table->cases[j]];
+            }
+        }
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    chunk->code = peephole.code.code;
+    chunk->lines = peephole.code.lines;
+    chunk->count = peephole.code.count;
+    chunk->capacity = peephole.code.capacity;
+    initChunk(&peephole.code);
+
+cleanup:
+    freeChunk(&peephole.code);
+    FREE_ARRAY(int, peephole.starts, oldCount);
+    FREE_ARRAY(bool, peephole.isTarget, oldCount + 1);
+    FREE_ARRAY(int, peephole.newOffsets, oldCount + 1);
+    FREE_ARRAY(JumpFixup, peephole.fixups, oldCount);
+}
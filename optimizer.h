@@ -0,0 +1,15 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+
+/**
+ * Peephole pass over a finished chunk. Rewrites common instruction
+ * sequences into the fused superinstructions (OP_POPN, OP_INC_LOCAL, ...)
+ * and fixes every jump offset afterwards. Sequences that have a jump
+ * target in their middle are left untouched.
+ * @param chunk
+ */
+void optimizeChunk(Chunk *chunk);
+
+#endif //CLOX_OPTIMIZER_H
@@ -0,0 +1,401 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "profile.h"
+#include "vm.h"
+
+#define PROFILE_HEADER "clox profile 2\n"
+
+// Bounds on what a profile may ask for, it is only a hint.
+#define PROFILE_STRINGS_MAX (1 << 20)
+#define PROFILE_WIDTH_MAX 257
+
+void initProfile(Profile *profile) {
+    profile->enabled = false;
+    profile->count = 0;
+    profile->capacity = 0;
+    profile->entries = NULL;
+    profile->siteCount = 0;
+    profile->siteCapacity = 0;
+    profile->sites = NULL;
+    profile->stringCount = 0;
+    initValueArray(&profile->scripts);
+}
+
+void freeProfile(Profile *profile) {
+    FREE_ARRAY(ProfileEntry, profile->entries, profile->capacity);
+    FREE_ARRAY(ProfileSite, profile->sites, profile->siteCapacity);
+    freeValueArray(&profile->scripts);
+    initProfile(profile);
+}
+
+static void addEntry(Profile *profile, ProfileEntry entry) {
+    if (profile->capacity < profile->count + 1) {
+        int oldCapacity = profile->capacity;
+        profile->capacity = GROW_CAPACITY(oldCapacity);
+        profile->entries = GROW_ARRAY(ProfileEntry, profile->entries,
+                                      oldCapacity, profile->capacity);
+    }
+    profile->entries[profile->count++] = entry;
+}
+
+static void addSite(Profile *profile, ProfileSite site) {
+    if (profile->siteCapacity < profile->siteCount + 1) {
+        int oldCapacity = profile->siteCapacity;
+        profile->siteCapacity = GROW_CAPACITY(oldCapacity);
+        profile->sites = GROW_ARRAY(ProfileSite, profile->sites,
+                                    oldCapacity, profile->siteCapacity);
+    }
+    profile->sites[profile->siteCount++] = site;
+}
+
+static int compareEntries(const void *a, const void *b) {
+    uint32_t x = ((const ProfileEntry *) a)->key;
+    uint32_t y = ((const ProfileEntry *) b)->key;
+    return (x > y) - (x < y);
+}
+
+// Sort the entries and fold the ones of the same key into one, which is
+// as warm as the warmest of them and has the sites of one that has any.
+static void sortEntries(Profile *profile) {
+    if (profile->count == 0) {
+        return;
+    }
+    qsort(profile->entries, profile->count, sizeof(ProfileEntry), compareEntries);
+    int count = 0;
+    for (int i = 0; i < profile->count; i++) {
+        ProfileEntry *entry = &profile->entries[i];
+        ProfileEntry *last = count > 0 ? &profile->entries[count - 1] : NULL;
+        if (last == NULL || last->key != entry->key) {
+            profile->entries[count++] = *entry;
+            continue;
+        }
+        if (entry->hotness > last->hotness) {
+            last->hotness = entry->hotness;
+        }
+        if (entry->memoCapacity > last->memoCapacity) {
+            last->memoCapacity = entry->memoCapacity;
+            last->memoWidth = entry->memoWidth;
+        }
+        if (last->siteCount == 0) {
+            last->siteStart = entry->siteStart;
+            last->siteCount = entry->siteCount;
+        }
+    }
+    profile->count = count;
+}
+
+// Looks at the first *count* entries, which are sorted.
+static ProfileEntry *findEntry(Profile *profile, int count, uint32_t key) {
+    if (count == 0) {
+        return NULL;
+    }
+    ProfileEntry probe = {key, 0, 0, 0, 0, 0};
+    return bsearch(&probe, profile->entries, count, sizeof(ProfileEntry), compareEntries);
+}
+
+static uint32_t hashBytes(uint32_t hash, const void *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= ((const uint8_t *) bytes)[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Numbers by their value, strings by their hash, other objects only by
+// their type: a nested function has a key of its own.
+static uint32_t hashConstant(uint32_t hash, Value value) {
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        return hashBytes(hash, &number, sizeof(number));
+    }
+    if (IS_STRING(value)) {
+        return hashBytes(hash, &AS_STRING(value)->hash, sizeof(uint32_t));
+    }
+    uint8_t tag = IS_OBJ(value) ? (uint8_t) OBJ_TYPE(value) : IS_BOOL(value) ?
+                  (uint8_t) (AS_BOOL(value) ? 0xfe : 0xfd) : 0xff;
+    return hashBytes(hash, &tag, sizeof(tag));
+}
+
+// FNV-1a over the name, the shape, the code and the constants of the
+// function. Never 0, which stands for no key.
+static uint32_t functionKey(ObjFunction *function) {
+    uint32_t hash = 2166136261u;
+    if (function->name != NULL) {
+        hash = hashBytes(hash, function->name->chars, function->name->length);
+    }
+    uint8_t shape[] = {(uint8_t) function->arity, (uint8_t) function->upvalueCount,
+                       function->memoized};
+    hash = hashBytes(hash, shape, sizeof(shape));
+    hash = hashBytes(hash, function->chunk.code, function->chunk.count);
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        hash = hashConstant(hash, constants->values[i]);
+    }
+    return hash != 0 ? hash : 1;
+}
+
+// Values in a memo entry of *function*: the result, the arguments and the
+// closure when it has upvalues (see memoKey() in vm.c).
+static int memoWidth(ObjFunction *function) {
+    return function->arity + (function->upvalueCount > 0) + 1;
+}
+
+// The sites of a line, each a space and then the offset followed by 'n'
+// for numbers or 's' for strings, in increasing offsets. Returns false if
+// the line doesn't end after them.
+static bool loadSites(Profile *profile, FILE *file, ProfileEntry *entry) {
+    entry->siteStart = profile->siteCount;
+    entry->siteCount = 0;
+    int last = -1;
+    for (;;) {
+        int c = fgetc(file);
+        if (c == '\n') {
+            return true;
+        }
+        ProfileSite site;
+        char type;
+        if (c != ' ' || fscanf(file, "%d%c", &site.offset, &type) != 2 ||
+            site.offset <= last || (type != 'n' && type != 's')) {
+            return false;
+        }
+        site.instruction = type == 'n' ? OP_ADD_NUMBER : OP_ADD_STRING;
+        addSite(profile, site);
+        entry->siteCount++;
+        last = site.offset;
+    }
+}
+
+void loadProfile(const char *path) {
+    Profile *profile = &vm.profile;
+    profile->enabled = true;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    char header[sizeof(PROFILE_HEADER)];
+    int stringCount;
+    if (fgets(header, sizeof(header), file) == NULL ||
+        strcmp(header, PROFILE_HEADER) != 0 ||
+        fscanf(file, "strings %d\n", &stringCount) != 1) {
+        fclose(file);
+        return;
+    }
+
+    // Whatever follows a line that doesn't make sense is left out.
+    ProfileEntry entry;
+    while (fscanf(file, "%" SCNx32 " %d %d %d", &entry.key, &entry.hotness,
+                  &entry.memoCapacity, &entry.memoWidth) == 4) {
+        if (entry.hotness < 0 || entry.memoCapacity < 0 ||
+            entry.memoCapacity > MEMO_CAPACITY_MAX ||
+            entry.memoWidth < 0 || entry.memoWidth > PROFILE_WIDTH_MAX ||
+            !loadSites(profile, file, &entry)) {
+            break;
+        }
+        addEntry(profile, entry);
+    }
+    fclose(file);
+
+    sortEntries(profile);
+    if (stringCount > 0 && stringCount <= PROFILE_STRINGS_MAX) {
+        profile->stringCount = stringCount;
+        tableReserve(&vm.strings, stringCount);
+    }
+}
+
+// Quicken the OP_ADDs of *function* the entry has sites for. Offsets that
+// aren't an OP_ADD of this code are passed over.
+static void quickenSites(Profile *profile, ObjFunction *function, ProfileEntry *entry) {
+    Chunk *chunk = &function->chunk;
+    ProfileSite *site = &profile->sites[entry->siteStart];
+    ProfileSite *end = site + entry->siteCount;
+    for (int offset = 0; offset < chunk->count && site < end;
+         offset += instructionLength(chunk, offset)) {
+        while (site < end && site->offset < offset) {
+            site++;
+        }
+        if (site < end && site->offset == offset && chunk->code[offset] == OP_ADD) {
+            chunk->code[offset] = site->instruction;
+        }
+    }
+}
+
+// Functions are keyed once, lazily compiled ones can reach each other
+// through the calls bound to them (see inlineCalls()).
+static void warmUpFunction(Profile *profile, ObjFunction *function) {
+    // A lazy one has no code to key it by yet, see profileFunction().
+    if (function->profileKey != 0 || function->lazySource != NULL) {
+        return;
+    }
+    function->profileKey = functionKey(function);
+    ProfileEntry *entry = findEntry(profile, profile->count, function->profileKey);
+    if (entry != NULL) {
+        function->hotness = entry->hotness;
+        quickenSites(profile, function, entry);
+        if (function->memoized && entry->memoWidth == memoWidth(function)) {
+            memoReserve(&function->memo, entry->memoCapacity, entry->memoWidth);
+        }
+    }
+
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            warmUpFunction(profile, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+void profileScript(ObjFunction *script) {
+    push(OBJ_VALUE(script));
+    writeValueArray(&vm.profile.scripts, OBJ_VALUE(script));
+    pop();
+    warmUpFunction(&vm.profile, script);
+}
+
+void profileFunction(ObjFunction *function) {
+    warmUpFunction(&vm.profile, function);
+}
+
+// Adds the OP_ADDs of *function* that ended up quickened to the sites of
+// *entry*.
+static void addSites(Profile *profile, ObjFunction *function, ProfileEntry *entry) {
+    Chunk *chunk = &function->chunk;
+    entry->siteStart = profile->siteCount;
+    entry->siteCount = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_ADD_NUMBER || instruction == OP_ADD_STRING) {
+            addSite(profile, (ProfileSite) {offset, instruction});
+            entry->siteCount++;
+        }
+    }
+}
+
+static bool sameSites(Profile *profile, ProfileEntry *a, ProfileEntry *b) {
+    if (a->siteCount != b->siteCount) {
+        return false;
+    }
+    for (int i = 0; i < a->siteCount; i++) {
+        ProfileSite *x = &profile->sites[a->siteStart + i];
+        ProfileSite *y = &profile->sites[b->siteStart + i];
+        if (x->offset != y->offset || x->instruction != y->instruction) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds what this run did with *function*. The *loaded* entries it started
+// with are still sorted. Returns whether the profile learned anything new.
+// The key is cleared once added, see warmUpFunction().
+static bool addFunction(Profile *profile, int loaded, ObjFunction *function) {
+    // Added already, or lazy and never called.
+    if (function->profileKey == 0) {
+        return false;
+    }
+    // Only the calls of this run count, or a function called a few times
+    // by every run would end up compiled at its first call.
+    ProfileEntry entry = {function->profileKey, function->hotness, 0, 0, 0, 0};
+    ProfileEntry *start = findEntry(profile, loaded, function->profileKey);
+    // Register code never quickens, its run has nothing to say about types.
+    if (function->registerCode.count == 0) {
+        addSites(profile, function, &entry);
+    } else if (start != NULL) {
+        entry.siteStart = start->siteStart;
+        entry.siteCount = start->siteCount;
+    }
+    if (start != NULL) {
+        entry.hotness -= start->hotness;
+        if (entry.hotness < 0) {
+            entry.hotness = 0;
+        }
+    }
+    if (function->memoized) {
+        entry.memoCapacity = function->memo.capacity;
+        entry.memoWidth = memoWidth(function);
+    }
+    function->profileKey = 0;
+    bool learned = false;
+    // Types can change without the function getting any warmer, the entry
+    // it started with takes them over.
+    if (start != NULL && !sameSites(profile, start, &entry)) {
+        start->siteStart = entry.siteStart;
+        start->siteCount = entry.siteCount;
+        learned = true;
+    }
+    // Functions that never ran have nothing to say.
+    if (entry.hotness > 0 || entry.memoCapacity > 0) {
+        // Adding may move *start*.
+        learned = learned || start == NULL || entry.hotness > start->hotness ||
+                  entry.memoCapacity > start->memoCapacity;
+        addEntry(profile, entry);
+    }
+
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i]) &&
+            addFunction(profile, loaded, AS_FUNCTION(constants->values[i]))) {
+            learned = true;
+        }
+    }
+    return learned;
+}
+
+bool saveProfile(const char *path) {
+    Profile *profile = &vm.profile;
+    int loaded = profile->count;
+    bool learned = vm.strings.count > profile->stringCount;
+    for (int i = 0; i < profile->scripts.count; i++) {
+        if (addFunction(profile, loaded, AS_FUNCTION(profile->scripts.values[i]))) {
+            learned = true;
+        }
+    }
+    sortEntries(profile);
+    if (!learned) {
+        return true;
+    }
+    if (vm.strings.count > profile->stringCount) {
+        profile->stringCount = vm.strings.count;
+    }
+
+    // Written next to the profile and moved over it, so that a job starting
+    // meanwhile never reads half of one.
+    size_t length = strlen(path);
+    char *temporary = malloc(length + sizeof(".tmp"));
+    if (temporary == NULL) {
+        return false;
+    }
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) {
+        free(temporary);
+        return false;
+    }
+    fputs(PROFILE_HEADER, file);
+    fprintf(file, "strings %d\n", profile->stringCount);
+    for (int i = 0; i < profile->count; i++) {
+        ProfileEntry *entry = &profile->entries[i];
+        fprintf(file, "%08" PRIx32 " %d %d %d", entry->key, entry->hotness,
+                entry->memoCapacity, entry->memoWidth);
+        for (int j = 0; j < entry->siteCount; j++) {
+            ProfileSite *site = &profile->sites[entry->siteStart + j];
+            fprintf(file, " %d%c", site->offset,
+                    site->instruction == OP_ADD_NUMBER ? 'n' : 's');
+        }
+        fputc('\n', file);
+    }
+    bool written = !ferror(file);
+    written = fclose(file) == 0 && written;
+    written = written && rename(temporary, path) == 0;
+    if (!written) {
+        remove(temporary);
+    }
+    free(temporary);
+    return written;
+}
@@ -0,0 +1,91 @@
+#ifndef CLOX_PROFILE_H
+#define CLOX_PROFILE_H
+
+#include "object.h"
+#include "value.h"
+
+/*
+ * What a run learned about the script, saved for the next one so that a
+ * short job doesn't spend most of its time warming up. For each function
+ * that is how hot it got and which operand types each of its OP_ADDs saw,
+ * as far as quickening them into OP_ADD_NUMBER or OP_ADD_STRING tells.
+ * The next run quickens those sites before anything runs, so that the JIT
+ * starts from the same types, and a function that reached JIT_THRESHOLD
+ * goes to machine code at its first call. The memo table of a memo fun and
+ * the string table start out at the size they ended up with.
+ *
+ * Functions are keyed by a hash of their name, code and constants as the
+ * compiler left them, before any quickening, so an edited function starts
+ * cold while the rest of the script keeps its profile. Keys that collide
+ * only cost the warm-up they would otherwise save.
+ *
+ * Quickened sites keep their guard, so types that changed since cost no
+ * more than a site quickened by the run itself. Only sites that still hold
+ * the plain OP_ADD at that offset are quickened.
+ *
+ * The file is text, one line per function, and entries of functions this
+ * run didn't see are kept. It is only written when the run got further
+ * than the profile says or saw other types, a missing or unreadable one is
+ * a cold start.
+ */
+
+// An OP_ADD that was quickened, by its offset in the chunk.
+typedef struct {
+    int offset;
+    uint8_t instruction;
+} ProfileSite;
+
+typedef struct {
+    uint32_t key;
+    // Calls plus loop iterations, as far as ObjFunction.hotness counts.
+    int hotness;
+    int memoCapacity;
+    int memoWidth;
+    // The sites of the function, in Profile.sites and by offset.
+    int siteStart;
+    int siteCount;
+} ProfileEntry;
+
+typedef struct {
+    bool enabled;
+    // Sorted by key.
+    int count;
+    int capacity;
+    ProfileEntry *entries;
+    int siteCount;
+    int siteCapacity;
+    ProfileSite *sites;
+    // The most strings interned by a run so far.
+    int stringCount;
+    // The scripts of this run, whose functions are saved.
+    ValueArray scripts;
+} Profile;
+
+void initProfile(Profile *profile);
+void freeProfile(Profile *profile);
+/**
+ * Start profiling the run, warming up scripts from the profile at *path*
+ * if there is one.
+ * @param path
+ */
+void loadProfile(const char *path);
+/**
+ * Warm up the functions of a script compile() just returned, and have them
+ * saved with the profile. Called by interpret() when profiling.
+ * @param script
+ */
+void profileScript(ObjFunction *script);
+/**
+ * Warm up a function of a profiled script whose body was compiled at its
+ * first call (see compileFunction()).
+ * @param function
+ */
+void profileFunction(ObjFunction *function);
+/**
+ * Save what the run learned, once it is over.
+ * @param path
+ * @return false when the file couldn't be written
+ */
+bool saveProfile(const char *path);
+
+#endif //CLOX_PROFILE_H
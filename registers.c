@@ -0,0 +1,629 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "registers.h"
+
+/*
+ * The translator walks the stack code once, keeping a model of the operand
+ * stack. Stack slot n is register n, so most instructions just name the
+ * registers their operands already live in. Reading a local or a constant
+ * doesn't emit anything by itself: the slot remembers where the value can
+ * be found and the instruction that consumes it reads it from there. Such
+ * deferred slots are materialized (MOVE/LOADK into their own register)
+ * before anything that could observe the register: jumps and jump targets,
+ * calls, closures capturing locals and writes to the local they copy.
+ */
+
+typedef enum {
+    OPERAND_REGISTER,   // the value is in the slot's own register
+    OPERAND_LOCAL,      // the value is in register "index"
+    OPERAND_CONSTANT,   // the value is constant "index"
+} OperandType;
+
+typedef struct {
+    OperandType type;
+    uint8_t index;
+} Operand;
+
+typedef struct {
+    int at;         // where the two offset bytes are in the register code
+    int target;     // the offset the jump went to in the stack code
+} RegisterJump;
+
+typedef struct {
+    Chunk *chunk;
+    Chunk *code;
+    int line;
+
+    Operand stack[UINT8_COUNT];
+    int depth;
+    int maxDepth;
+
+    // Indexed by stack code offset.
+    bool *isTarget;
+    int *depths;
+    int *newOffsets;
+
+    RegisterJump *jumps;
+    int jumpCount;
+    bool failed;
+} Translator;
+
+static void emit(Translator *translator, uint8_t byte) {
+    writeChunk(translator->code, byte, translator->line);
+}
+
+static void emitJumpOffset(Translator *translator, int target) {
+    RegisterJump *jump = &translator->jumps[translator->jumpCount++];
+    jump->at = translator->code->count;
+    jump->target = target;
+    emit(translator, 0xff);
+    emit(translator, 0xff);
+}
+
+static void push(Translator *translator, OperandType type, uint8_t index) {
+    if (translator->depth == UINT8_COUNT) {
+        translator->failed = true;
+        return;
+    }
+
+    Operand *operand = &translator->stack[translator->depth++];
+    operand->type = type;
+    operand->index = index;
+    if (translator->depth > translator->maxDepth) {
+        translator->maxDepth = translator->depth;
+    }
+}
+
+// Push the result of an instruction that writes the register of the new
+// top slot, and return that register.
+static uint8_t pushRegister(Translator *translator) {
+    uint8_t reg = (uint8_t) translator->depth;
+    push(translator, OPERAND_REGISTER, 0);
+    return reg;
+}
+
+static void materialize(Translator *translator, int slot) {
+    Operand *operand = &translator->stack[slot];
+    switch (operand->type) {
+        case OPERAND_REGISTER:
+            return;
+        case OPERAND_LOCAL:
+            if (operand->index != slot) {
+                emit(translator, ROP_MOVE);
+                emit(translator, (uint8_t) slot);
+                emit(translator, operand->index);
+            }
+            break;
+        case OPERAND_CONSTANT:
+            emit(translator, ROP_LOADK);
+            emit(translator, (uint8_t) slot);
+            emit(translator, operand->index);
+            break;
+    }
+    operand->type = OPERAND_REGISTER;
+}
+
+static void materializeBelow(Translator *translator, int depth) {
+    for (int slot = 0; slot < depth; slot++) {
+        materialize(translator, slot);
+    }
+}
+
+// Register *reg* is about to change, so slots that still read it lazily
+// have to take their copy now.
+static void materializeCopiesOf(Translator *translator, uint8_t reg) {
+    for (int slot = 0; slot < translator->depth; slot++) {
+        Operand *operand = &translator->stack[slot];
+        if (operand->type == OPERAND_LOCAL && operand->index == reg) {
+            materialize(translator, slot);
+        }
+    }
+}
+
+// A register that holds the value of *slot*, without copying if possible.
+static uint8_t sourceRegister(Translator *translator, int slot) {
+    Operand *operand = &translator->stack[slot];
+    if (operand->type == OPERAND_LOCAL) {
+        return operand->index;
+    }
+    materialize(translator, slot);
+    return (uint8_t) slot;
+}
+
+static uint8_t rkOperand(Translator *translator, int slot) {
+    Operand *operand = &translator->stack[slot];
+    if (operand->type == OPERAND_CONSTANT && operand->index <= RK_MAX) {
+        return RK_CONSTANT | operand->index;
+    }
+
+    uint8_t reg = sourceRegister(translator, slot);
+    if (reg > RK_MAX) {
+        translator->failed = true;
+    }
+    return reg;
+}
+
+static void getLocal(Translator *translator, uint8_t slot) {
+    materialize(translator, slot);
+    push(translator, OPERAND_LOCAL, slot);
+}
+
+static void setLocal(Translator *translator, uint8_t slot) {
+    materializeCopiesOf(translator, slot);
+
+    int top = translator->depth - 1;
+    Operand *operand = &translator->stack[top];
+    switch (operand->type) {
+        case OPERAND_CONSTANT:
+            emit(translator, ROP_LOADK);
+            emit(translator, slot);
+            emit(translator, operand->index);
+            break;
+        case OPERAND_LOCAL:
+        case OPERAND_REGISTER: {
+            uint8_t source = sourceRegister(translator, top);
+            if (source != slot) {
+                emit(translator, ROP_MOVE);
+                emit(translator, slot);
+                emit(translator, source);
+            }
+            break;
+        }
+    }
+    translator->stack[slot].type = OPERAND_REGISTER;
+}
+
+static void binary(Translator *translator, RegisterOpCode instruction) {
+    uint8_t a = rkOperand(translator, translator->depth - 2);
+    uint8_t b = rkOperand(translator, translator->depth - 1);
+    translator->depth -= 2;
+    uint8_t dest = pushRegister(translator);
+
+    emit(translator, instruction);
+    emit(translator, dest);
+    emit(translator, a);
+    emit(translator, b);
+}
+
+static void unary(Translator *translator, RegisterOpCode instruction) {
+    int top = translator->depth - 1;
+    uint8_t source = sourceRegister(translator, top);
+    translator->stack[top].type = OPERAND_REGISTER;
+
+    emit(translator, instruction);
+    emit(translator, (uint8_t) top);
+    emit(translator, source);
+}
+
+static void jump(Translator *translator, RegisterOpCode instruction, int target) {
+    materializeBelow(translator, translator->depth);
+    translator->depths[target] = translator->depth;
+    emit(translator, instruction);
+    emitJumpOffset(translator, target);
+}
+
+static void compareJump(Translator *translator, RegisterOpCode instruction, int target) {
+    materializeBelow(translator, translator->depth - 2);
+    uint8_t a = rkOperand(translator, translator->depth - 2);
+    uint8_t b = rkOperand(translator, translator->depth - 1);
+    translator->depth -= 2;
+    translator->depths[target] = translator->depth;
+
+    emit(translator, instruction);
+    emit(translator, a);
+    emit(translator, b);
+    emitJumpOffset(translator, target);
+}
+
+static void incrementLocal(Translator *translator, uint8_t slot, uint8_t constant) {
+    if (slot <= RK_MAX && constant <= RK_MAX) {
+        materializeCopiesOf(translator, slot);
+        materialize(translator, slot);
+        emit(translator, ROP_ADD);
+        emit(translator, slot);
+        emit(translator, slot);
+        emit(translator, RK_CONSTANT | constant);
+        return;
+    }
+
+    getLocal(translator, slot);
+    push(translator, OPERAND_CONSTANT, constant);
+    binary(translator, ROP_ADD);
+    setLocal(translator, slot);
+    translator->depth--;
+}
+
+// OP_FOR_PREP and OP_FOR_LOOP, as the increment and the comparison they
+// stand for. Conditional jumps only go forwards, so OP_FOR_LOOP leaves the
+// loop with one and goes back to the body with ROP_LOOP.
+static void countingLoop(Translator *translator, int offset) {
+    Chunk *chunk = translator->chunk;
+    uint8_t *code = &chunk->code[offset];
+    RegisterOpCode exit = code[5] & FOR_INCLUSIVE ?
+                          ROP_JUMP_IF_NOT_LESS_EQUAL : ROP_JUMP_IF_NOT_LESS;
+
+    if (code[0] == OP_FOR_LOOP) {
+        incrementLocal(translator, code[3], code[6]);
+    }
+    getLocal(translator, code[3]);
+    if (code[5] & FOR_CONSTANT_LIMIT) {
+        push(translator, OPERAND_CONSTANT, code[4]);
+    } else {
+        getLocal(translator, code[4]);
+    }
+
+    if (code[0] == OP_FOR_PREP) {
+        compareJump(translator, exit, jumpTarget(chunk, offset));
+        return;
+    }
+    compareJump(translator, exit, offset + instructionLength(chunk, offset));
+    jump(translator, ROP_LOOP, jumpTarget(chunk, offset));
+}
+
+// Translate the instruction at *offset*, returns false when it isn't
+// supported by the register engine.
+static bool translateInstruction(Translator *translator, int offset) {
+    Chunk *chunk = translator->chunk;
+    uint8_t *code = &chunk->code[offset];
+
+    switch (genericInstruction(code[0])) {
+        case OP_CONSTANT:
+            push(translator, OPERAND_CONSTANT, code[1]);
+            return true;
+        case OP_NIL:
+            emit(translator, ROP_LOADNIL);
+            emit(translator, pushRegister(translator));
+            return true;
+        case OP_TRUE:
+            emit(translator, ROP_LOADTRUE);
+            emit(translator, pushRegister(translator));
+            return true;
+        case OP_FALSE:
+            emit(translator, ROP_LOADFALSE);
+            emit(translator, pushRegister(translator));
+            return true;
+        case OP_POP:
+            translator->depth--;
+            return true;
+        case OP_POPN:
+            translator->depth -= code[1];
+            return true;
+        case OP_GET_LOCAL:      getLocal(translator, code[1]); return true;
+        case OP_GET_LOCAL_0:    getLocal(translator, 0); return true;
+        case OP_GET_LOCAL_1:    getLocal(translator, 1); return true;
+        case OP_GET_LOCAL_2:    getLocal(translator, 2); return true;
+        case OP_GET_LOCAL_3:    getLocal(translator, 3); return true;
+        case OP_SET_LOCAL:      setLocal(translator, code[1]); return true;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_DEFINED:
+            emit(translator, ROP_GET_GLOBAL);
+            emit(translator, pushRegister(translator));
+            emit(translator, code[1]);
+            emit(translator, code[2]);
+            return true;
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL: {
+            uint8_t source = sourceRegister(translator, translator->depth - 1);
+            emit(translator, code[0] == OP_SET_GLOBAL ? ROP_SET_GLOBAL : ROP_DEFINE_GLOBAL);
+            emit(translator, source);
+            emit(translator, code[1]);
+            emit(translator, code[2]);
+            if (code[0] == OP_DEFINE_GLOBAL) {
+                translator->depth--;
+            }
+            return true;
+        }
+        case OP_GET_UPVALUE:
+            emit(translator, ROP_GET_UPVALUE);
+            emit(translator, pushRegister(translator));
+            emit(translator, code[1]);
+            return true;
+        case OP_SET_UPVALUE: {
+            uint8_t source = sourceRegister(translator, translator->depth - 1);
+            emit(translator, ROP_SET_UPVALUE);
+            emit(translator, source);
+            emit(translator, code[1]);
+            return true;
+        }
+        case OP_EQUAL:          binary(translator, ROP_EQUAL); return true;
+        case OP_NOT_EQUAL:      binary(translator, ROP_NOT_EQUAL); return true;
+        case OP_GREATER:        binary(translator, ROP_GREATER); return true;
+        case OP_GREATER_EQUAL:  binary(translator, ROP_GREATER_EQUAL); return true;
+        case OP_LESS:           binary(translator, ROP_LESS); return true;
+        case OP_LESS_EQUAL:     binary(translator, ROP_LESS_EQUAL); return true;
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:     binary(translator, ROP_ADD); return true;
+        case OP_SUBTRACT:       binary(translator, ROP_SUBTRACT); return true;
+        case OP_MULTIPLY:       binary(translator, ROP_MULTIPLY); return true;
+        case OP_DIVIDE:         binary(translator, ROP_DIVIDE); return true;
+        case OP_MODULO:         binary(translator, ROP_MODULO); return true;
+        case OP_ADD_LOCALS:
+            getLocal(translator, code[1]);
+            getLocal(translator, code[2]);
+            binary(translator, ROP_ADD);
+            return true;
+        case OP_INC_LOCAL:
+            incrementLocal(translator, code[1], code[2]);
+            return true;
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            countingLoop(translator, offset);
+            return true;
+        case OP_NOT:            unary(translator, ROP_NOT); return true;
+        case OP_NEGATE:         unary(translator, ROP_NEGATE); return true;
+        case OP_PRINT: {
+            uint8_t source = sourceRegister(translator, translator->depth - 1);
+            emit(translator, ROP_PRINT);
+            emit(translator, source);
+            translator->depth--;
+            return true;
+        }
+        case OP_JUMP:
+            jump(translator, ROP_JUMP, jumpTarget(chunk, offset));
+            return true;
+        case OP_LOOP:
+            jump(translator, ROP_LOOP, jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_FALSE:
+            materializeBelow(translator, translator->depth);
+            translator->depths[jumpTarget(chunk, offset)] = translator->depth;
+            emit(translator, ROP_JUMP_IF_FALSE);
+            emit(translator, (uint8_t) (translator->depth - 1));
+            emitJumpOffset(translator, jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_NOT_LESS:
+            compareJump(translator, ROP_JUMP_IF_NOT_LESS, jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            compareJump(translator, ROP_JUMP_IF_NOT_LESS_EQUAL, jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_NOT_GREATER:
+            compareJump(translator, ROP_JUMP_IF_NOT_GREATER, jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            compareJump(translator, ROP_JUMP_IF_NOT_GREATER_EQUAL, jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_NOT_EQUAL:
+            compareJump(translator, ROP_JUMP_IF_NOT_EQUAL, jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_EQUAL:
+            compareJump(translator, ROP_JUMP_IF_EQUAL, jumpTarget(chunk, offset));
+            return true;
+        case OP_DUP: {
+            Operand top = translator->stack[translator->depth - 1];
+            if (top.type == OPERAND_REGISTER) {
+                push(translator, OPERAND_LOCAL, (uint8_t) (translator->depth - 1));
+            } else {
+                push(translator, top.type, top.index);
+            }
+            return true;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_NATIVE: {
+            // Register code calls natives, math intrinsics too, the usual way.
+            uint8_t argCount = code[1];
+            materializeBelow(translator, translator->depth);
+            translator->depth -= argCount + 1;
+            emit(translator, code[0] == OP_TAIL_CALL ? ROP_TAIL_CALL : ROP_CALL);
+            emit(translator, pushRegister(translator));
+            emit(translator, argCount);
+            return true;
+        }
+        case OP_CALL_KNOWN: {
+            uint8_t argCount = code[3];
+            materializeBelow(translator, translator->depth);
+            uint8_t callee = (uint8_t) (translator->depth - argCount - 1);
+            int target = jumpTarget(chunk, offset);
+            if (!hasInlinedBody(chunk, offset)) {
+                translator->depth = callee;
+                emit(translator, ROP_CALL);
+                emit(translator, pushRegister(translator));
+                emit(translator, argCount);
+                return true;
+            }
+
+            // The call made instead of the body leaves its result where the
+            // body does, and the body goes on with the arguments in place.
+            translator->depths[target] = callee + 1;
+            emit(translator, ROP_CALL_KNOWN);
+            emit(translator, callee);
+            emit(translator, argCount);
+            emit(translator, code[4]);
+            emitJumpOffset(translator, target);
+            return true;
+        }
+        case OP_RETURN: {
+            uint8_t result = rkOperand(translator, translator->depth - 1);
+            emit(translator, ROP_RETURN);
+            emit(translator, result);
+            translator->depth--;
+            return true;
+        }
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[code[1]]);
+            materializeBelow(translator, translator->depth);
+            emit(translator, ROP_CLOSURE);
+            emit(translator, pushRegister(translator));
+            emit(translator, code[1]);
+            for (int i = 0; i < function->upvalueCount * 2; i++) {
+                emit(translator, code[2 + i]);
+            }
+            return true;
+        }
+        case OP_CLOSE_UPVALUE: {
+            int top = translator->depth - 1;
+            materialize(translator, top);
+            emit(translator, ROP_CLOSE_UPVALUE);
+            emit(translator, (uint8_t) top);
+            translator->depth--;
+            return true;
+        }
+        case OP_CLASS:
+            emit(translator, ROP_CLASS);
+            emit(translator, pushRegister(translator));
+            emit(translator, code[1]);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool translate(Translator *translator, int arity) {
+    Chunk *chunk = translator->chunk;
+
+    // The callee and its arguments are already in place.
+    for (int slot = 0; slot <= arity; slot++) {
+        push(translator, OPERAND_REGISTER, 0);
+    }
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        translator->line = chunk->lines[offset];
+
+        if (translator->isTarget[offset]) {
+            // Every jump to here left all its slots in registers, the code
+            // falling through has to do the same.
+            materializeBelow(translator, translator->depth);
+            if (translator->depths[offset] != -1) {
+                translator->depth = translator->depths[offset];
+            }
+            translator->depths[offset] = translator->depth;
+            for (int slot = 0; slot < translator->depth; slot++) {
+                translator->stack[slot].type = OPERAND_REGISTER;
+            }
+        }
+
+        translator->newOffsets[offset] = translator->code->count;
+        if (!translateInstruction(translator, offset) || translator->failed) {
+            return false;
+        }
+        if (translator->depth < 0) {
+            return false;
+        }
+    }
+    translator->newOffsets[chunk->count] = translator->code->count;
+
+    for (int i = 0; i < translator->jumpCount; i++) {
+        RegisterJump *jump = &translator->jumps[i];
+        int end = jump->at + 2;
+        int target = translator->newOffsets[jump->target];
+        int offset = target >= end ? target - end : end - target;
+        if (offset > UINT16_MAX) {
+            return false;
+        }
+        translator->code->code[jump->at] = (offset >> 8) & 0xff;
+        translator->code->code[jump->at + 1] = offset & 0xff;
+    }
+    return true;
+}
+
+bool compileRegisters(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+
+    Translator translator;
+    translator.chunk = chunk;
+    translator.code = &function->registerCode;
+    translator.line = 0;
+    translator.depth = 0;
+    translator.maxDepth = 0;
+    translator.isTarget = ALLOCATE(bool, count + 1);
+    translator.depths = ALLOCATE(int, count + 1);
+    translator.newOffsets = ALLOCATE(int, count + 1);
+    translator.jumps = ALLOCATE(RegisterJump, count);
+    translator.jumpCount = 0;
+    translator.failed = false;
+
+    for (int offset = 0; offset <= count; offset++) {
+        translator.isTarget[offset] = false;
+        translator.depths[offset] = -1;
+    }
+
+    bool broken = false;
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        if (isJump(chunk->code[offset])) {
+            int target = jumpTarget(chunk, offset);
+            if (target < 0 || target > count) {
+                broken = true;
+                break;
+            }
+            translator.isTarget[target] = true;
+        }
+    }
+
+    bool translated = !broken && translate(&translator, function->arity);
+    if (translated) {
+        function->registerCount = translator.maxDepth;
+        // The slow path of ROP_ADD pushes its operands above the registers.
+        if (function->maxStack < translator.maxDepth + 2) {
+            function->maxStack = translator.maxDepth + 2;
+        }
+    } else {
+        freeChunk(&function->registerCode);
+    }
+
+    FREE_ARRAY(bool, translator.isTarget, count + 1);
+    FREE_ARRAY(int, translator.depths, count + 1);
+    FREE_ARRAY(int, translator.newOffsets, count + 1);
+    FREE_ARRAY(RegisterJump, translator.jumps, count);
+    return translated;
+}
+
+int registerInstructionLength(ObjFunction *function, int offset) {
+    uint8_t *code = &function->registerCode.code[offset];
+    switch (code[0]) {
+        case ROP_LOADNIL:
+        case ROP_LOADTRUE:
+        case ROP_LOADFALSE:
+        case ROP_PRINT:
+        case ROP_RETURN:
+        case ROP_CLOSE_UPVALUE:
+            return 2;
+        case ROP_MOVE:
+        case ROP_LOADK:
+        case ROP_GET_UPVALUE:
+        case ROP_SET_UPVALUE:
+        case ROP_NOT:
+        case ROP_NEGATE:
+        case ROP_JUMP:
+        case ROP_LOOP:
+        case ROP_CALL:
+        case ROP_TAIL_CALL:
+        case ROP_CLASS:
+            return 3;
+        case ROP_GET_GLOBAL:
+        case ROP_SET_GLOBAL:
+        case ROP_DEFINE_GLOBAL:
+        case ROP_ADD:
+        case ROP_SUBTRACT:
+        case ROP_MULTIPLY:
+        case ROP_DIVIDE:
+        case ROP_MODULO:
+        case ROP_EQUAL:
+        case ROP_NOT_EQUAL:
+        case ROP_GREATER:
+        case ROP_GREATER_EQUAL:
+        case ROP_LESS:
+        case ROP_LESS_EQUAL:
+        case ROP_JUMP_IF_FALSE:
+            return 4;
+        case ROP_JUMP_IF_NOT_LESS:
+        case ROP_JUMP_IF_NOT_LESS_EQUAL:
+        case ROP_JUMP_IF_NOT_GREATER:
+        case ROP_JUMP_IF_NOT_GREATER_EQUAL:
+        case ROP_JUMP_IF_NOT_EQUAL:
+        case ROP_JUMP_IF_EQUAL:
+            return 5;
+        case ROP_CALL_KNOWN:
+            return 6;
+        case ROP_CLOSURE: {
+            Value constant = function->chunk.constants.values[code[2]];
+            return 3 + AS_FUNCTION(constant)->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef CLOX_REGISTERS_H
+#define CLOX_REGISTERS_H
+
+#include "object.h"
+
+/*
+ * Three-address instructions for the register engine. Register n is the
+ * stack slot n of the frame (slot 0 holds the callee, then the parameters
+ * and the locals), so both engines share the same frame layout and can call
+ * each other.
+ *
+ * A, B, C are one-byte register operands. RK operands are a register when
+ * the top bit is clear, otherwise the low 7 bits are an index into the
+ * constant table of the function's stack chunk. Jump offsets are two bytes,
+ * relative to the end of the instruction.
+ */
+typedef enum {
+    ROP_MOVE,               // A B          R[A] = R[B]
+    ROP_LOADK,              // A K          R[A] = K
+    ROP_LOADNIL,            // A            R[A] = nil
+    ROP_LOADTRUE,           // A            R[A] = true
+    ROP_LOADFALSE,          // A            R[A] = false
+    ROP_GET_GLOBAL,         // A G G        R[A] = globals[G]
+    ROP_SET_GLOBAL,         // A G G        globals[G] = R[A]
+    ROP_DEFINE_GLOBAL,      // A G G        define globals[G] = R[A]
+    ROP_GET_UPVALUE,        // A U          R[A] = upvalue U
+    ROP_SET_UPVALUE,        // A U          upvalue U = R[A]
+    ROP_ADD,                // A RK RK      R[A] = RK + RK
+    ROP_SUBTRACT,           // A RK RK
+    ROP_MULTIPLY,           // A RK RK
+    ROP_DIVIDE,             // A RK RK
+    ROP_MODULO,             // A RK RK
+    ROP_EQUAL,              // A RK RK      R[A] = RK == RK
+    ROP_NOT_EQUAL,          // A RK RK
+    ROP_GREATER,            // A RK RK
+    ROP_GREATER_EQUAL,      // A RK RK
+    ROP_LESS,               // A RK RK
+    ROP_LESS_EQUAL,         // A RK RK
+    ROP_NOT,                // A B          R[A] = !R[B]
+    ROP_NEGATE,             // A B          R[A] = -R[B]
+    ROP_PRINT,              // A
+    ROP_JUMP,               // J J
+    ROP_LOOP,               // J J          jumps backwards
+    ROP_JUMP_IF_FALSE,      // A J J
+    ROP_JUMP_IF_NOT_LESS,           // RK RK J J
+    ROP_JUMP_IF_NOT_LESS_EQUAL,     // RK RK J J
+    ROP_JUMP_IF_NOT_GREATER,        // RK RK J J
+    ROP_JUMP_IF_NOT_GREATER_EQUAL,  // RK RK J J
+    ROP_JUMP_IF_NOT_EQUAL,          // RK RK J J
+    ROP_JUMP_IF_EQUAL,              // RK RK J J
+    ROP_CALL,               // A N          R[A] = R[A](R[A + 1], ..., R[A + N])
+    ROP_TAIL_CALL,          // A N          like ROP_CALL, reusing the frame
+    ROP_CALL_KNOWN,         // A N K J J    like ROP_CALL then jump, unless R[A]
+                            //              is a closure of K: run the inlined
+                            //              body that follows instead
+    ROP_RETURN,             // RK
+    ROP_CLOSURE,            // A K (isLocal index)*
+    ROP_CLOSE_UPVALUE,      // A            close the upvalue of R[A]
+    ROP_CLASS,              // A K
+} RegisterOpCode;
+
+#define RK_CONSTANT     0x80
+#define RK_MAX          0x7f
+
+/**
+ * Translate the stack bytecode of *function* into register code, stored in
+ * function->registerCode. Functions using something the translator doesn't
+ * handle are left alone and keep running on the stack engine.
+ * @param function
+ * @return whether register code was produced
+ */
+bool compileRegisters(ObjFunction *function);
+
+/**
+ * The length of the register instruction at *offset* in the register code
+ * of *function*, operands included.
+ * @param function
+ * @param offset
+ * @return the number of bytes
+ */
+int registerInstructionLength(ObjFunction *function, int offset);
+
+#endif //CLOX_REGISTERS_H
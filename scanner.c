@@ -8,18 +8,12 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
 Scanner scanner;
 
-void initScanner(const char *source) {
+void initScanner(const char *source, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
 static bool isDigit(char c) {
@@ -120,7 +114,11 @@ static TokenType identifierType() {
                 switch (scanner.start[1]) {
                     case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
                     case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
-                    case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
+                    case 'o':
+                        if (scanner.current - scanner.start == 5) {
+                            return checkKeyword(2, 3, "nst", TOKEN_CONST);
+                        }
+                        return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
                 }
             }
         case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
@@ -135,6 +133,7 @@ static TokenType identifierType() {
             }
             break;
         case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
+        case 'm': return checkKeyword(1, 3, "emo", TOKEN_MEMO);
         case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
         case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
         case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
@@ -168,10 +167,12 @@ static Token number() {
     //                                 ^
     if(peek() == '.' && isDigit(peekNext())) {
         scanner.current++;
-        while(isDigit(peekNext())) scanner.current++;
+        while(isDigit(peek())) scanner.current++;
+        return makeToken(TOKEN_NUMBER);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    // No fractional part, it can be an int.
+    return makeToken(TOKEN_INTEGER);
 }
 
 static Token identifier() {
@@ -217,6 +218,7 @@ Token scanToken() {
         case '+': return makeToken(TOKEN_PLUS);
         case '/': return makeToken(TOKEN_SLASH);
         case '*': return makeToken(TOKEN_STAR);
+        case '%': return makeToken(TOKEN_PERCENT);
         case '!':
             return makeToken(
                     match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
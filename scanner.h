@@ -10,7 +10,7 @@ typedef enum {
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
-    TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+    TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_PERCENT,
     TOKEN_COLON,
 
     // One or two character tokens.
@@ -20,7 +20,7 @@ typedef enum {
     TOKEN_LESS, TOKEN_LESS_EQUAL,
 
     // Literals.
-    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER, TOKEN_INTEGER,
 
     // Keywords.
     TOKEN_AND,  TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
@@ -28,6 +28,7 @@ typedef enum {
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_SWITCH,
     TOKEN_CASE, TOKEN_DEFAULT, TOKEN_BREAK, TOKEN_CONTINUE,
+    TOKEN_CONST, TOKEN_MEMO,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -40,7 +41,17 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char *source);
+typedef struct {
+    const char *start;
+    const char *current;
+    int line;
+} Scanner;
+
+// Copied to scan some tokens ahead and then go back.
+extern Scanner scanner;
+
+// Scan *source* as if it started on *line*.
+void initScanner(const char *source, int line);
 Token scanToken();
 
 #endif //CLOX_SCANNER_H
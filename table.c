@@ -133,6 +133,16 @@ void tableAddAll(Table *from, Table *to) {
     }
 }
 
+void tableReserve(Table *table, int count) {
+    int capacity = table->capacity;
+    while (count > capacity * TABLE_LOAD_FACTOR) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    if (capacity > table->capacity) {
+        adjustCapacity(table, capacity);
+    }
+}
+
 ObjString *tableFindString(Table *table, const char *chars,
                            int length, uint32_t hash) {
     if(table->count == 0) {
@@ -175,4 +185,161 @@ void markTable(Table *table) {
         markObject((Obj *) entry->key);
         markValue(entry->value);
     }
-}
\ No newline at end of file
+}
+void initMemoTable(MemoTable *table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->width = 0;
+    table->entries = NULL;
+}
+
+void freeMemoTable(MemoTable *table) {
+    FREE_ARRAY(Value, table->entries, table->capacity * table->width);
+    initMemoTable(table);
+}
+
+static bool sameKey(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+        case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NUMBER:    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+        case VAL_INT:       return AS_INT(a) == AS_INT(b);
+        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        default:            return true;
+    }
+#endif
+}
+
+static uint32_t hashMemoKey(const Value *key, int count) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < count; i++) {
+        uint64_t bits;
+#ifdef NAN_BOXING
+        bits = key[i];
+#else
+        switch (key[i].type) {
+            case VAL_BOOL:      bits = AS_BOOL(key[i]); break;
+            case VAL_NUMBER:    memcpy(&bits, &key[i].as.number, sizeof(double)); break;
+            case VAL_INT:       bits = (uint64_t) AS_INT(key[i]); break;
+            case VAL_OBJ:       bits = (uint64_t) (uintptr_t) AS_OBJ(key[i]); break;
+            default:            bits = 0; break;
+        }
+        bits ^= (uint64_t) key[i].type << 56;
+#endif
+        // Small ints differ in their low bits only, mix them into the high
+        // ones before folding to 32 bits.
+        bits *= 0x9e3779b97f4a7c15u;
+        hash ^= (uint32_t) (bits >> 32);
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// The capacity is a power of two.
+static Value *findMemoEntry(Value *entries, int capacity, int width,
+                            const Value *key, uint32_t hash) {
+    uint32_t index = hash & (capacity - 1);
+    for (;;) {
+        Value *entry = entries + index * width;
+        if (IS_UNDEFINED(entry[0])) {
+            return entry;
+        }
+        int i = 1;
+        while (i < width && sameKey(entry[i], key[i - 1])) {
+            i++;
+        }
+        if (i == width) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+bool memoGet(MemoTable *table, const Value *key, int count, Value *result) {
+    if (table->count == 0) {
+        return false;
+    }
+
+    Value *entry = findMemoEntry(table->entries, table->capacity, table->width,
+                                 key, hashMemoKey(key, count));
+    if (IS_UNDEFINED(entry[0])) {
+        return false;
+    }
+    *result = entry[0];
+    return true;
+}
+
+static void adjustMemoCapacity(MemoTable *table, int capacity, int width) {
+    Value *entries = ALLOCATE(Value, capacity * width);
+    for (int i = 0; i < capacity; i++) {
+        entries[i * width] = UNDEFINED_VALUE;
+    }
+
+    for (int i = 0; i < table->capacity; i++) {
+        Value *old = table->entries + i * width;
+        if (IS_UNDEFINED(old[0])) {
+            continue;
+        }
+        Value *entry = findMemoEntry(entries, capacity, width, old + 1,
+                                     hashMemoKey(old + 1, width - 1));
+        memcpy(entry, old, sizeof(Value) * width);
+    }
+
+    FREE_ARRAY(Value, table->entries, table->capacity * table->width);
+    table->capacity = capacity;
+    table->width = width;
+    table->entries = entries;
+}
+
+void memoReserve(MemoTable *table, int capacity, int width) {
+    if (table->capacity > 0 || capacity <= 0) {
+        return;
+    }
+    int size = GROW_CAPACITY(0);
+    while (size < capacity && size < MEMO_CAPACITY_MAX) {
+        size = GROW_CAPACITY(size);
+    }
+    adjustMemoCapacity(table, size, width);
+}
+
+void memoSet(MemoTable *table, const Value *key, int count, Value result) {
+    uint32_t hash = hashMemoKey(key, count);
+    int width = count + 1;
+    if (table->count + 1 > table->capacity * TABLE_LOAD_FACTOR &&
+        table->capacity < MEMO_CAPACITY_MAX) {
+        adjustMemoCapacity(table, GROW_CAPACITY(table->capacity), width);
+    }
+
+    Value *entry = findMemoEntry(table->entries, table->capacity, width, key, hash);
+    if (IS_UNDEFINED(entry[0])) {
+        if (table->count + 1 > table->capacity * TABLE_LOAD_FACTOR) {
+            // Full, evict. Replacing an entry keeps every probe sequence
+            // going through its slot intact, an empty one has to stay empty.
+            entry = table->entries + (hash & (table->capacity - 1)) * width;
+            if (IS_UNDEFINED(entry[0])) {
+                return;
+            }
+        } else {
+            table->count++;
+        }
+    }
+    entry[0] = result;
+    memcpy(entry + 1, key, sizeof(Value) * count);
+}
+
+void markMemoTable(MemoTable *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Value *entry = table->entries + i * table->width;
+        if (IS_UNDEFINED(entry[0])) {
+            continue;
+        }
+        for (int j = 0; j < table->width; j++) {
+            markValue(entry[j]);
+        }
+    }
+}
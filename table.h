@@ -34,8 +34,47 @@ bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
+// Grow *table* so that *count* entries fit without growing it again.
+void tableReserve(Table *table, int count);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 void tableRemoveWhite(Table *table);
 void markTable(Table *table);
 
+/*
+ * The results of a "memo fun" by the key of the call, its arguments (see
+ * memoKey() in vm.c). An entry is the result followed by the key, *width*
+ * values in a row, and a result of UNDEFINED_VALUE marks it empty. Keys are
+ * compared by their bits, strings are interned and objects compare by
+ * identity anyway: 1 and 1.0 or 0 and -0 are different keys.
+ *
+ * The table grows up to MEMO_CAPACITY_MAX slots. Once that is full a new
+ * key takes the place of the entry in the first slot it hashes to, or isn't
+ * kept when that slot is empty.
+ */
+
+#define MEMO_CAPACITY_MAX (1 << 16)
+
+typedef struct {
+    int count;
+    int capacity;
+    int width;
+    Value *entries;
+} MemoTable;
+
+void initMemoTable(MemoTable *table);
+void freeMemoTable(MemoTable *table);
+/**
+ * @param table
+ * @param key
+ * @param count the number of values in *key*, the same for every call
+ * @param result where the result stored for *key* goes
+ * @return whether there is one
+ */
+bool memoGet(MemoTable *table, const Value *key, int count, Value *result);
+void memoSet(MemoTable *table, const Value *key, int count, Value result);
+// Start an empty table out with room for *capacity* entries of *width*
+// values, which must be the count of every key plus one.
+void memoReserve(MemoTable *table, int capacity, int width);
+void markMemoTable(MemoTable *table);
+
 #endif //CLOX_TABLE_H
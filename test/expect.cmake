@@ -0,0 +1,16 @@
+# Runs COMMAND (a ;-list) and checks its exit code against EXIT_CODE and its
+# output (stdout and stderr together) against the regex OUTPUT. The input
+# comes from the file INPUT when that is set.
+if (DEFINED INPUT)
+    set(input INPUT_FILE ${INPUT})
+endif ()
+execute_process(COMMAND ${COMMAND} ${input}
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE output)
+if (NOT result EQUAL EXIT_CODE)
+    message(FATAL_ERROR "Exit code ${result}, expected ${EXIT_CODE}:\n${output}")
+endif ()
+if (NOT output MATCHES "${OUTPUT}")
+    message(FATAL_ERROR "Output doesn't match \"${OUTPUT}\":\n${output}")
+endif ()
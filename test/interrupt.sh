@@ -0,0 +1,8 @@
+#!/bin/sh
+# Runs the interpreter $1 on the script $2 with an input that stays open
+# but empty, interrupts it once it had time to start and exits with its
+# exit code.
+sleep 2 2>/dev/null | "$1" "$2" &
+sleep 1
+kill -INT $!
+wait $!
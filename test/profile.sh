@@ -0,0 +1,32 @@
+#!/bin/sh
+# Runs the interpreter $1 with the profile $3 on the script $2 (after the
+# options in $4...) from no profile, from the one it left, from that one
+# with the types of its sites swapped, with sites that aren't OP_ADDs and
+# from damaged ones. Prints the output of each run without the GC log,
+# then the profile it left.
+clox=$1
+script=$2
+profile=$3
+shift 3
+
+run() {
+    echo "== $1"
+    shift
+    "$clox" "$@" --profile "$profile" "$script" > "$profile.out" 2>&1 || exit $?
+    grep -v '^0x' "$profile.out"
+    cat "$profile"
+}
+
+rm -f "$profile"
+run cold "$@"
+run warm "$@"
+sed '3,$ y/ns/sn/' "$profile" > "$profile.edit" && mv "$profile.edit" "$profile"
+run swapped "$@"
+sed '3,$ s/^\([0-9a-f]*\) \([0-9]*\) \([0-9]*\) \([0-9]*\)/& 0n 1s 2n/' "$profile" > "$profile.edit" &&
+    mv "$profile.edit" "$profile"
+run misplaced "$@"
+printf 'clox profile 1\nstrings 20\n' > "$profile"
+run old "$@"
+sed '3 s/n/x/' "$profile" > "$profile.edit" && mv "$profile.edit" "$profile"
+run damaged "$@"
+rm -f "$profile" "$profile.out"
@@ -10,6 +10,33 @@
 #include "object.h"
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Compare numbers by value so that NaN != NaN and 1 == 1.0, everything
+    // else is equal exactly when the bits are. An int and a double are
+    // compared without rounding, see compareIntDouble().
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        if (IS_INT(a) && IS_INT(b)) {
+            return a == b;
+        }
+        if (IS_INT(a)) {
+            return compareIntDouble(AS_INT(a), AS_NUMBER(b)) == 0;
+        }
+        if (IS_INT(b)) {
+            return compareIntDouble(AS_INT(b), AS_NUMBER(a)) == 0;
+        }
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
+    if (IS_INT(a) && IS_INT(b)) {
+        return AS_INT(a) == AS_INT(b);
+    }
+    if (IS_INT(a) && IS_DOUBLE(b)) {
+        return compareIntDouble(AS_INT(a), AS_NUMBER(b)) == 0;
+    }
+    if (IS_DOUBLE(a) && IS_INT(b)) {
+        return compareIntDouble(AS_INT(b), AS_NUMBER(a)) == 0;
+    }
     if(a.type != b.type) {
         return false;
     }
@@ -21,6 +48,7 @@ bool valuesEqual(Value a, Value b) {
         case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
         default:            return false; // Unreachable.
     }
+#endif
 }
 
 void initValueArray(ValueArray *array){
@@ -47,18 +75,22 @@ void freeValueArray(ValueArray *array){
 }
 
 void printValue(Value value){
-    switch (value.type) {
-        case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_NIL:
-            printf("nil");
-            break;
-        case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
-            break;
-        case VAL_OBJ:
-            printObject(value);
-            break;
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        char number[32];
+        formatNumber(value, number, sizeof(number));
+        printf("%s", number);
+    } else if (IS_OBJ(value)) {
+        printObject(value);
     }
-}
\ No newline at end of file
+}
+// Write *number* into *buffer* the way "print" shows it. Ints are in the
+// range doubles hold exactly and print like the double they equal, so
+// whether a number happens to be an int never shows. Returns the length of
+// the text.
+int formatNumber(Value number, char *buffer, int size) {
+    return snprintf(buffer, size, "%g", AS_NUMBER(number));
+}
@@ -6,15 +6,101 @@
 #define CLOX_VALUE_H
 
 #include "common.h"
+#include <math.h>
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+// UNDEFINED_VALUE fills the slot of a global variable that has been
+// referenced but not defined yet, Lox code never gets to see it.
+//
+// Numbers are either ints or doubles. IS_NUMBER() and AS_NUMBER() accept
+// both, so code that only cares about the value can ignore the difference.
+// Arithmetic on two ints stays an int as long as the result fits between
+// INT_VALUE_MIN and INT_VALUE_MAX, otherwise it is done on doubles. The
+// range is the 48 bits NaN boxing has room for in both layouts, so a
+// program computes the same numbers whichever one it was built with.
+
+#define INT_VALUE_MIN   (-((int64_t)1 << 47))
+#define INT_VALUE_MAX   (((int64_t)1 << 47) - 1)
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// A double is a NaN when all of its exponent bits are set, and the hardware
+// only ever produces one particular "quiet" NaN. Every other bit pattern with
+// the quiet NaN bits set is free for us: the low bits store a singleton tag or
+// an object pointer (48 bits are enough on current 64-bit machines), and the
+// sign bit tells an object pointer apart from the singletons.
+#define SIGN_BIT    ((uint64_t)0x8000000000000000)
+#define QNAN        ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL         1 // 001.
+#define TAG_FALSE       2 // 010.
+#define TAG_TRUE        3 // 011.
+#define TAG_UNDEFINED   4 // 100.
+
+// Ints get the 48 low bits, marked by a bit above them that the singletons
+// leave clear.
+#define TAG_INT         ((uint64_t)0x0002000000000000)
+#define INT_MASK        ((uint64_t)0x0000ffffffffffff)
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VALUE)
+#define IS_NIL(value)       ((value) == NIL_VALUE)
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
+// Both at once, with a single branch.
+#define ARE_INTS(a, b) \
+    (((((a) & (SIGN_BIT | QNAN | TAG_INT)) ^ (QNAN | TAG_INT)) | \
+      (((b) & (SIGN_BIT | QNAN | TAG_INT)) ^ (QNAN | TAG_INT))) == 0)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VALUE)
+
+#define AS_BOOL(value)      ((value) == TRUE_VALUE)
+#define AS_INT(value)       ((int64_t)((value) << 16) >> 16)
+#define AS_NUMBER(value) \
+    (IS_INT(value) ? (double)AS_INT(value) : valueToNumber(value))
+#define AS_OBJ(value)       ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VALUE(value)       ((value) ? TRUE_VALUE : FALSE_VALUE)
+#define FALSE_VALUE             ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VALUE              ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VALUE               ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VALUE         ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VALUE(value)     numberToValue(value)
+#define INT_VALUE(value) \
+    ((Value)(QNAN | TAG_INT | ((uint64_t)(int64_t)(value) & INT_MASK)))
+#define OBJ_VALUE(object) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+// memcpy is the portable way to reinterpret the bits, compilers turn it
+// into a plain register move.
+static inline double valueToNumber(Value value) {
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value numberToValue(double number) {
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_INT,
+    VAL_OBJ,
+    VAL_UNDEFINED
 } ValueType;
 
 typedef struct {
@@ -22,23 +108,34 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj *obj;
     } as;
 } Value;
 
 #define IS_BOOL(value)      ((value).type == VAL_BOOL)
 #define IS_NIL(value)       ((value).type == VAL_NIL)
-#define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value)    ((value).type == VAL_NUMBER)
+#define IS_INT(value)       ((value).type == VAL_INT)
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
+#define ARE_INTS(a, b)      ((((a).type ^ VAL_INT) | ((b).type ^ VAL_INT)) == 0)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)      ((value).as.boolean)
-#define AS_NUMBER(value)    ((value).as.number)
+#define AS_INT(value)       ((value).as.integer)
+#define AS_NUMBER(value) \
+    (IS_INT(value) ? (double)AS_INT(value) : (value).as.number)
 #define AS_OBJ(value)       ((value).as.obj)
 
 #define BOOL_VALUE(value)       ((Value){VAL_BOOL, {.boolean = (value)}})
 #define NIL_VALUE               ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VALUE(value)     ((Value){VAL_NUMBER, {.number = (value)}})
+#define INT_VALUE(value)        ((Value){VAL_INT, {.integer = (value)}})
 #define OBJ_VALUE(object)       ((Value){VAL_OBJ, {.obj = (Obj *)(object)}})
+#define UNDEFINED_VALUE         ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
 
 typedef struct {
     int capacity;
@@ -51,5 +148,153 @@ void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
 void printValue(Value value);
+int formatNumber(Value number, char *buffer, int size);
+
+/*
+ * Arithmetic on two numbers, the caller has checked that they are. Two ints
+ * give an int when the exact result fits in one, everything else is done
+ * on doubles. Shared by vm.c and the C that aot.c writes.
+ */
+
+// Checking for two ints first keeps the common case down to one branch.
+static inline bool areNumbers(Value a, Value b) {
+    return ARE_INTS(a, b) || (IS_NUMBER(a) && IS_NUMBER(b));
+}
+
+// Whether *value* is in the range of an int Value.
+static inline bool intFits(int64_t value) {
+    return value >= INT_VALUE_MIN && value <= INT_VALUE_MAX;
+}
+
+static inline bool addInts(int64_t a, int64_t b, int64_t *result) {
+#if defined(__GNUC__)
+    if (__builtin_add_overflow(a, b, result)) return false;
+#else
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return false;
+    *result = a + b;
+#endif
+    return intFits(*result);
+}
+
+static inline bool subtractInts(int64_t a, int64_t b, int64_t *result) {
+#if defined(__GNUC__)
+    if (__builtin_sub_overflow(a, b, result)) return false;
+#else
+    if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return false;
+    *result = a - b;
+#endif
+    return intFits(*result);
+}
+
+static inline bool multiplyInts(int64_t a, int64_t b, int64_t *result) {
+#if defined(__GNUC__)
+    if (__builtin_mul_overflow(a, b, result)) return false;
+#else
+    if (a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+              : (b > 0 ? a < INT64_MIN / b : (a != 0 && b < INT64_MAX / a))) {
+        return false;
+    }
+    *result = a * b;
+#endif
+    return intFits(*result);
+}
+
+static inline Value addNumbers(Value a, Value b) {
+    int64_t result;
+    if (ARE_INTS(a, b) && addInts(AS_INT(a), AS_INT(b), &result)) {
+        return INT_VALUE(result);
+    }
+    return NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+    int64_t result;
+    if (ARE_INTS(a, b) && subtractInts(AS_INT(a), AS_INT(b), &result)) {
+        return INT_VALUE(result);
+    }
+    return NUMBER_VALUE(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+// Ints have no -0, so zero products and quotients of operands with
+// different signs are doubles, as are negated zeros and remainders.
+static inline Value multiplyNumbers(Value a, Value b) {
+    int64_t result;
+    if (ARE_INTS(a, b) && multiplyInts(AS_INT(a), AS_INT(b), &result) &&
+        (result != 0 || (AS_INT(a) ^ AS_INT(b)) >= 0)) {
+        return INT_VALUE(result);
+    }
+    return NUMBER_VALUE(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+// Only exact quotients stay ints, 7 / 2 is still 3.5.
+static inline Value divideNumbers(Value a, Value b) {
+    if (ARE_INTS(a, b)) {
+        int64_t x = AS_INT(a);
+        int64_t y = AS_INT(b);
+        if (y != 0 && !(y == -1 && x == INT64_MIN) && x % y == 0 && intFits(x / y) &&
+            (x != 0 || y > 0)) {
+            return INT_VALUE(x / y);
+        }
+    }
+    return NUMBER_VALUE(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+// The remainder of truncating division, with the sign of *a* like fmod().
+static inline Value moduloNumbers(Value a, Value b) {
+    if (ARE_INTS(a, b) && AS_INT(b) != 0) {
+        // INT64_MIN % -1 traps, the remainder is 0 anyway.
+        int64_t result = AS_INT(b) == -1 ? 0 : AS_INT(a) % AS_INT(b);
+        if (result != 0 || AS_INT(a) >= 0) {
+            return INT_VALUE(result);
+        }
+    }
+    return NUMBER_VALUE(fmod(AS_NUMBER(a), AS_NUMBER(b)));
+}
+
+static inline Value negateNumber(Value a) {
+    if (IS_INT(a) && AS_INT(a) != INT_VALUE_MIN && AS_INT(a) != 0) {
+        return INT_VALUE(-AS_INT(a));
+    }
+    return NUMBER_VALUE(-AS_NUMBER(a));
+}
+
+// -1, 0 or 1 as the int *a* is less than, equal to or greater than the
+// double *b*, 2 when *b* is NaN. Converting *a* to a double instead would
+// round it once it has more bits than the mantissa, so *b* is split into
+// its whole part, which is an int when it is in range, and its fraction.
+static inline int compareIntDouble(int64_t a, double b) {
+    if (b != b) {
+        return 2;
+    }
+    if (b >= 9223372036854775808.0) {
+        return -1;
+    }
+    if (b < -9223372036854775808.0) {
+        return 1;
+    }
+    int64_t whole = (int64_t) b;
+    if (a != whole) {
+        return a < whole ? -1 : 1;
+    }
+    double fraction = b - (double) whole;
+    return fraction > 0 ? -1 : fraction < 0 ? 1 : 0;
+}
+
+static inline bool lessNumbers(Value a, Value b) {
+    if (ARE_INTS(a, b)) {
+        return AS_INT(a) < AS_INT(b);
+    }
+    if (IS_INT(a)) {
+        return compareIntDouble(AS_INT(a), AS_NUMBER(b)) == -1;
+    }
+    if (IS_INT(b)) {
+        return compareIntDouble(AS_INT(b), AS_NUMBER(a)) == 1;
+    }
+    return AS_NUMBER(a) < AS_NUMBER(b);
+}
+
+static inline bool greaterNumbers(Value a, Value b) {
+    return lessNumbers(b, a);
+}
 
 #endif //CLOX_VALUE_H
@@ -12,8 +12,11 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "intrinsic.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "registers.h"
 
 VM vm;
 
@@ -23,6 +26,40 @@ static void resetStack(){
     vm.openUpvalues = NULL;
 }
 
+// The function whose inlined body the instruction at *offset* is part of,
+// with the OP_CALL_KNOWN that stands for the call in *call*. NULL when it is
+// the chunk's own code. The last byte before the jump target is left out:
+// it is the final OP_POP of the body, and a call made instead of the body
+// returns right after it.
+static ObjFunction *inlinedAt(Chunk *chunk, int offset, int *call) {
+    for (int i = 0; i < chunk->count && i < offset; i += instructionLength(chunk, i)) {
+        if (chunk->code[i] == OP_CALL_KNOWN && offset < jumpTarget(chunk, i) - 1 &&
+            hasInlinedBody(chunk, i)) {
+            *call = i;
+            return AS_FUNCTION(chunk->constants.values[chunk->code[i + 4]]);
+        }
+    }
+    return NULL;
+}
+
+// inlinedAt() for the register code of *function*. There the body ends
+// with the move of its result, which can't fail.
+static ObjFunction *registerInlinedAt(ObjFunction *function, int offset, int *call) {
+    Chunk *code = &function->registerCode;
+    for (int i = 0; i < code->count && i < offset;
+         i += registerInstructionLength(function, i)) {
+        if (code->code[i] != ROP_CALL_KNOWN) {
+            continue;
+        }
+        int target = i + 6 + ((code->code[i + 4] << 8) | code->code[i + 5]);
+        if (offset < target - 1) {
+            *call = i;
+            return AS_FUNCTION(function->chunk.constants.values[code->code[i + 3]]);
+        }
+    }
+    return NULL;
+}
+
 static void runtimeError(const char *format, ...) {
     va_list args;
     va_start(args, format);
@@ -31,11 +68,28 @@ static void runtimeError(const char *format, ...) {
     fputs("\n", stderr);
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        // Deep recursion would bury the message under its own trace.
+        if (vm.frameCount - i > 32 && i > 0) {
+            fprintf(stderr, "... %d more frames\n", i);
+            i = 0;
+        }
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
+        // A function with register code never runs its stack code.
+        Chunk *chunk = function->registerCode.count > 0 ?
+                       &function->registerCode : &function->chunk;
+        size_t instruction = frame->ip - chunk->code - 1;
+        int call;
+        ObjFunction *inlined = chunk == &function->chunk ?
+                               inlinedAt(chunk, (int) instruction, &call) :
+                               registerInlinedAt(function, (int) instruction, &call);
+        if (inlined != NULL) {
+            // Where the call would have been.
+            fprintf(stderr, "[line %d] in %s()\n", chunk->lines[instruction], inlined->name->chars);
+            instruction = (size_t) call;
+        }
         fprintf(stderr, "[line %d] in ",
-                function->chunk.lines[instruction]);
+                chunk->lines[instruction]);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -46,38 +100,104 @@ static void runtimeError(const char *format, ...) {
     resetStack();
 }
 
-static Value clockNative(int argCount, Value* args) {
-    if (argCount != 0) {
-        runtimeError("Error on 'clock' function, expect 0 argument, but given %d.", argCount);
+static bool clockNative(int argCount, Value *args, Value *result) {
+    (void) argCount;
+    (void) args;
+    *result = NUMBER_VALUE((double) clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+static bool inputNative(int argCount, Value *args, Value *result) {
+    (void) argCount;
+    (void) args;
+    char input[1024];
+    if (scanf("%1023s", input) != 1) {
+        // A signal that interrupts the script also cuts the read short,
+        // the script stops here rather than going on with nil.
+        if (atomic_load(&vm.interruptRequested)) {
+            atomic_store(&vm.interruptRequested, false);
+            runtimeError("Interrupted.");
+            return false;
+        }
+        *result = NIL_VALUE;
+        return true;
     }
-    return NUMBER_VALUE((double) clock() / CLOCKS_PER_SEC);
+    *result = OBJ_VALUE(copyString(input, (int) strlen(input)));
+    return true;
 }
 
-static Value inputNative(int argCount, Value* args) {
-    if (argCount != 0) {
-        runtimeError("Error on 'clock' function, expect 0 argument, but given %d.", argCount);
+// The math builtins, when they are called rather than worked out in
+// place, see intrinsic.h.
+static bool intrinsicNative(uint8_t instruction, Value *args, Value *result) {
+    if (!mathIntrinsic(instruction, args, result)) {
+        runtimeError(intrinsicArity(instruction) == 1 ?
+                     "Operand must be number." : "Operands must be numbers.");
+        return false;
     }
-    char *input = ALLOCATE(char, 5);
-    scanf("%s", input);
-    char *string = ALLOCATE(char, (int) strlen(input) + 1);
-    memcpy(string, input, (int) strlen(input));
-    *(string + (int) strlen(input)) = '\0';
-    ObjString *result = takeString(string, (int)strlen(string));
-    return OBJ_VALUE(result);
+    return true;
 }
 
-static void defineNative(const char *name, NativeFn function) {
+#define INTRINSIC_NATIVE(name, instruction) \
+    static bool name##Native(int argCount, Value *args, Value *result) { \
+        (void) argCount; \
+        return intrinsicNative(instruction, args, result); \
+    }
+
+INTRINSIC_NATIVE(sqrt, OP_SQRT)
+INTRINSIC_NATIVE(floor, OP_FLOOR)
+INTRINSIC_NATIVE(ceil, OP_CEIL)
+INTRINSIC_NATIVE(abs, OP_ABS)
+INTRINSIC_NATIVE(sin, OP_SIN)
+INTRINSIC_NATIVE(cos, OP_COS)
+INTRINSIC_NATIVE(tan, OP_TAN)
+INTRINSIC_NATIVE(atan, OP_ATAN)
+INTRINSIC_NATIVE(min, OP_MIN)
+INTRINSIC_NATIVE(max, OP_MAX)
+INTRINSIC_NATIVE(pow, OP_POW)
+INTRINSIC_NATIVE(fmod, OP_FMOD)
+
+#undef INTRINSIC_NATIVE
+
+static ObjNative *defineNative(const char *name, NativeFn function, int arity, uint8_t flags) {
     push(OBJ_VALUE(copyString(name, (int)strlen(name))));
-    push(OBJ_VALUE(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VALUE(newNative(function, arity, flags)));
+    int slot = resolveGlobal(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
+    ObjNative *native = AS_NATIVE(vm.stack[1]);
     pop();
     pop();
+    return native;
+}
+
+static void defineIntrinsic(const char *name, NativeFn function, uint8_t instruction) {
+    ObjNative *native = defineNative(name, function, intrinsicArity(instruction),
+                                     NATIVE_PURE | NATIVE_NO_ALLOC);
+    native->instruction = instruction;
 }
 
 void initVM(){
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
     resetStack();
     vm.objects = NULL;
-    initTable(&vm.globals);
+    vm.registerEngine = false;
+    vm.lazyCompile = false;
+    vm.lazyCompileFailed = false;
+    vm.jitEnabled = true;
+    vm.jitDepth = 0;
+    vm.nativeStackBase = NULL;
+    vm.fuel = INTERRUPT_INTERVAL;
+    vm.budget = -1;
+    atomic_init(&vm.interruptRequested, false);
+    vm.interruptHandler = NULL;
+    initProfile(&vm.profile);
+    initTable(&vm.globalNames);
+    initTable(&vm.globalConstants);
+    initValueArray(&vm.globalConstantValues);
+    initTable(&vm.assignedGlobals);
+    initValueArray(&vm.globalValues);
     initTable(&vm.strings);
 
     vm.grayCount = 0;
@@ -86,16 +206,67 @@ void initVM(){
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
 
-    defineNative("clock", clockNative);
-    defineNative("input", inputNative);
+    vm.stack = GROW_ARRAY(Value, NULL, 0, STACK_INITIAL);
+    vm.stackCapacity = STACK_INITIAL;
+    vm.frames = GROW_ARRAY(CallFrame, NULL, 0, FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
+    resetStack();
+
+    defineNative("clock", clockNative, 0, NATIVE_NO_ALLOC);
+    defineNative("input", inputNative, 0, 0);
+    defineIntrinsic("sqrt", sqrtNative, OP_SQRT);
+    defineIntrinsic("floor", floorNative, OP_FLOOR);
+    defineIntrinsic("ceil", ceilNative, OP_CEIL);
+    defineIntrinsic("abs", absNative, OP_ABS);
+    defineIntrinsic("sin", sinNative, OP_SIN);
+    defineIntrinsic("cos", cosNative, OP_COS);
+    defineIntrinsic("tan", tanNative, OP_TAN);
+    defineIntrinsic("atan", atanNative, OP_ATAN);
+    defineIntrinsic("min", minNative, OP_MIN);
+    defineIntrinsic("max", maxNative, OP_MAX);
+    defineIntrinsic("pow", powNative, OP_POW);
+    defineIntrinsic("fmod", fmodNative, OP_FMOD);
 }
 
 void freeVM(){
-    freeTable(&vm.globals);
+    freeTable(&vm.globalNames);
+    freeTable(&vm.globalConstants);
+    freeValueArray(&vm.globalConstantValues);
+    freeTable(&vm.assignedGlobals);
+    freeValueArray(&vm.globalValues);
     freeTable(&vm.strings);
+    freeProfile(&vm.profile);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
     freeObjects();
 }
 
+int resolveGlobal(ObjString *name) {
+    Value slot;
+    if (tableGet(&vm.globalNames, name, &slot)) {
+        return (int) AS_INT(slot);
+    }
+
+    push(OBJ_VALUE(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VALUE);
+    tableSet(&vm.globalNames, name, INT_VALUE(vm.globalValues.count - 1));
+    pop();
+    return vm.globalValues.count - 1;
+}
+
+// Only needed for error messages and the disassembler, so a linear scan
+// is fine.
+ObjString *globalName(int slot) {
+    int i;
+    for (i = 0; i < vm.globalNames.capacity; i++) {
+        Entry *entry = &vm.globalNames.entries[i];
+        if (entry->key != NULL && (int) AS_INT(entry->value) == slot) {
+            return entry->key;
+        }
+    }
+    return NULL;
+}
+
 void push(Value value){
     *vm.stackTop++ = value;
 }
@@ -108,22 +279,214 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure *closure, int argCount) {
-    if (argCount != closure->function->arity) {
-        runtimeError("Expected %d argument but got %d.",
-                     closure->function->arity, argCount);
+// Make room for *count* more values above the stack top. The stack may move,
+// so everything pointing into it is moved along: the frames' slots, the open
+// upvalues and the stack top. Callers holding their own copies have to
+// reload them.
+static void ensureStack(int count) {
+    int used = (int) (vm.stackTop - vm.stack);
+    if (used + count <= vm.stackCapacity) {
+        return;
+    }
+
+    int capacity = vm.stackCapacity;
+    while (capacity < used + count) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    Value *oldStack = vm.stack;
+    vm.stack = GROW_ARRAY(Value, vm.stack, vm.stackCapacity, capacity);
+    vm.stackCapacity = capacity;
+    if (vm.stack == oldStack) {
+        return;
+    }
+
+    vm.stackTop = vm.stack + used;
+    int i;
+    for (i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+    }
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = vm.stack + (upvalue->location - oldStack);
+    }
+}
+
+// Function hotness stops counting here, nothing happens past it.
+#define HOTNESS_MAX JIT_THRESHOLD
+
+// Counts a call of *function* or an iteration of one of its loops. Hot
+// functions get compiled by useJit().
+static void warmUp(ObjFunction *function) {
+    if (function->hotness < HOTNESS_MAX) {
+        function->hotness++;
+    }
+}
+
+void setBudget(int64_t ticks) {
+    vm.budget = ticks;
+    // The next tick takes its fuel from the new budget.
+    vm.fuel = 0;
+}
+
+void requestInterrupt() {
+    // Only the flag, vm.fuel belongs to the thread running the script. The
+    // fuel never lasts more than INTERRUPT_INTERVAL ticks, the poll after
+    // that sees it.
+    atomic_store(&vm.interruptRequested, true);
+}
+
+// The tick that found vm.fuel used up takes one of the next stretch of the
+// budget.
+static void refuel() {
+    int fuel = INTERRUPT_INTERVAL;
+    if (vm.budget >= 0 && vm.budget < fuel) {
+        fuel = (int) vm.budget;
+    }
+    if (vm.budget > 0) {
+        vm.budget -= fuel;
+    }
+    vm.fuel = fuel - 1;
+}
+
+// Called by a tick once vm.fuel is used up. Returns false when the script
+// has to stop, after reporting why.
+NOINLINE static bool pollInterrupt() {
+    InterruptReason reason;
+    if (atomic_load(&vm.interruptRequested)) {
+        atomic_store(&vm.interruptRequested, false);
+        reason = INTERRUPT_REQUEST;
+    } else if (vm.budget == 0) {
+        reason = INTERRUPT_BUDGET;
+    } else {
+        refuel();
+        return true;
+    }
+
+    if (vm.interruptHandler == NULL || !vm.interruptHandler(reason)) {
+        runtimeError(reason == INTERRUPT_REQUEST ? "Interrupted." : "Out of budget.");
         return false;
     }
+    if (vm.budget == 0) {
+        vm.fuel = 0;
+    } else {
+        refuel();
+    }
+    return true;
+}
+
+// The tick every call spends, false when the script has to stop.
+static inline bool spendTick() {
+    return --vm.fuel >= 0 || pollInterrupt();
+}
 
+// Push the frame of a call whose arguments are known to match and whose
+// tick has been spent.
+static bool enterFrame(ObjClosure *closure, int argCount) {
     if (vm.frameCount == FRAMES_MAX) {
         runtimeError("Stack overflow.");
         return false;
     }
+    if (vm.frameCount == vm.frameCapacity) {
+        int capacity = vm.frameCapacity;
+        vm.frameCapacity = GROW_CAPACITY(capacity);
+        vm.frames = GROW_ARRAY(CallFrame, vm.frames, capacity, vm.frameCapacity);
+    }
+    // The only check the value stack gets, run() pushes without looking.
+    ensureStack(closure->function->maxStack - argCount - 1);
+
+    warmUp(closure->function);
 
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+
+    if (closure->function->registerCode.count > 0) {
+        // The registers past the arguments may still hold values of frames
+        // that already returned, which the GC must not see once they are
+        // below the stack top again.
+        frame->ip = closure->function->registerCode.code;
+        Value *end = frame->slots + closure->function->registerCount;
+        for (Value *slot = vm.stackTop; slot < end; slot++) {
+            *slot = NIL_VALUE;
+        }
+    }
+    return true;
+}
+
+// Push the frame of a call whose arguments are known to match.
+static bool pushFrame(ObjClosure *closure, int argCount) {
+    return spendTick() && enterFrame(closure, argCount);
+}
+
+// Where the key of the memo fun call at *callee* starts, its length goes in
+// *count*. The arguments must all be numbers, bools, nil or strings, NULL
+// when one isn't. Closures of a function with upvalues can give different
+// results for the same ones, the closure is part of the key then.
+static Value *memoKey(ObjFunction *function, Value *callee, int *count) {
+    for (int i = 1; i <= function->arity; i++) {
+        if (IS_OBJ(callee[i]) && !IS_STRING(callee[i])) {
+            return NULL;
+        }
+    }
+    Value *key = function->upvalueCount > 0 ? callee : callee + 1;
+    *count = (int) (callee + function->arity + 1 - key);
+    return key;
+}
+
+// A call of a memo fun is replaced by the result stored for its key if
+// there is one. Otherwise the callee and arguments are copied, the frame
+// starting above them as its parameters may well be assigned, and
+// OP_RETURN_MEMO stores the result under them before it takes their place.
+NOINLINE static bool callMemoized(ObjClosure *closure, int argCount) {
+    ObjFunction *function = closure->function;
+    Value *callee = vm.stackTop - argCount - 1;
+    int count;
+    Value *key = memoKey(function, callee, &count);
+    Value result;
+    if (key != NULL && memoGet(&function->memo, key, count, &result)) {
+        *callee = result;
+        vm.stackTop = callee + 1;
+        return true;
+    }
+
+    ensureStack(argCount + 1);
+    callee = vm.stackTop - argCount - 1;
+    memcpy(vm.stackTop, callee, sizeof(Value) * (argCount + 1));
+    vm.stackTop += argCount + 1;
+    return pushFrame(closure, argCount);
+}
+
+static bool checkArity(ObjClosure *closure, int argCount) {
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d argument but got %d.",
+                     closure->function->arity, argCount);
+        return false;
+    }
+    return true;
+}
+
+static bool call(ObjClosure *closure, int argCount) {
+    if (!checkArity(closure, argCount)) {
+        return false;
+    }
+    if (closure->function->memoized) {
+        return callMemoized(closure, argCount);
+    }
+    return pushFrame(closure, argCount);
+}
+
+// Call the native below the *argCount* arguments on top of the stack,
+// replacing it and them with the result.
+static bool callNative(ObjNative *native, int argCount) {
+    if (native->arity != -1 && argCount != native->arity) {
+        runtimeError("Expected %d argument but got %d.", native->arity, argCount);
+        return false;
+    }
+    Value *callee = vm.stackTop - argCount - 1;
+    if (!native->function(argCount, callee + 1, callee)) {
+        return false;
+    }
+    vm.stackTop = callee + 1;
     return true;
 }
 
@@ -132,13 +495,8 @@ static bool callValue(Value callee, int argCount) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
-            case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
-                return true;
-            }
+            case OBJ_NATIVE:
+                return callNative(AS_NATIVE(callee), argCount);
             default:
                 break;
         }
@@ -147,6 +505,9 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
+// Every captured local gets an ObjUpvalue, shared by the closures that
+// capture it, whether or not any of them outlives the frame: the compiler
+// doesn't tell closures that escape from ones that don't.
 static ObjUpvalue *captureUpvalue(Value *local) {
     ObjUpvalue* prevUpvalue = NULL;
     ObjUpvalue* upvalue = vm.openUpvalues;
@@ -180,6 +541,34 @@ static void closeUpvalues(Value* last) {
     }
 }
 
+// Whether a tail call of *callee* can take over the caller's frame. Natives
+// have none and a memo fun has to return to its caller to have its result
+// stored, a plain call and the OP_RETURN that follows it do for them.
+static bool reusesFrame(Value callee) {
+    return IS_CLOSURE(callee) && !AS_CLOSURE(callee)->function->memoized;
+}
+
+// Call *closure*, which reusesFrame() accepted, in place of the current
+// frame, which must be done with everything except the callee and arguments
+// on top of the stack.
+static bool tailCall(ObjClosure *closure, int argCount) {
+    // While the frame is still there to show up in the error.
+    if (!checkArity(closure, argCount) || !spendTick()) {
+        return false;
+    }
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    Value *callee = vm.stackTop - argCount - 1;
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+    // What was between the frame and the arguments is dead now.
+    for (Value *slot = frame->slots + argCount + 1; slot < vm.stackTop; slot++) {
+        *slot = NIL_VALUE;
+    }
+    vm.stackTop = frame->slots + argCount + 1;
+    vm.frameCount--;
+    return enterFrame(closure, argCount);
+}
+
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
@@ -200,322 +589,1659 @@ static void concatenate() {
     push(OBJ_VALUE(result));
 }
 
-static int lengthOfTheDigits(double number);
-static void copyNumber(char* string, int length, double number);
-
+// One operand is a string and the other one a number, which is appended or
+// prepended as "print" would show it.
 static void concatenateWithNumber() {
     Value b = peek(0);
     Value a = peek(1);
-    if (IS_STRING(a)) {
-        ObjString *string = AS_STRING(a);
-        double number = AS_NUMBER(b);
-        int numberLength = lengthOfTheDigits(number);
-        int newLength = string->length + numberLength;
-
-        char *chars = ALLOCATE(char, newLength + 1);
-        memcpy(chars, string->chars, string->length);
-        copyNumber(chars + string->length, numberLength, number);
-        chars[newLength] = '\0';
-        ObjString *result = takeString(chars, newLength);
-        pop();
-        pop();
-        push(OBJ_VALUE(result));
-    } else {
-        double number = AS_NUMBER(a);
-        ObjString *string = AS_STRING(b);
-        int numberLength = lengthOfTheDigits(number);
-        int newLength = numberLength + string->length;
+    bool numberFirst = !IS_STRING(a);
+    ObjString *string = AS_STRING(numberFirst ? b : a);
+    char number[32];
+    int numberLength = formatNumber(numberFirst ? a : b, number, sizeof(number));
+    int newLength = string->length + numberLength;
 
-        char *chars = ALLOCATE(char, newLength + 1);
-        copyNumber(chars, numberLength, number);
+    char *chars = ALLOCATE(char, newLength + 1);
+    if (numberFirst) {
+        memcpy(chars, number, numberLength);
         memcpy(chars + numberLength, string->chars, string->length);
-        chars[newLength] = '\0';
-        ObjString *result = takeString(chars, newLength);
-        pop();
-        pop();
-        push(OBJ_VALUE(result));
+    } else {
+        memcpy(chars, string->chars, string->length);
+        memcpy(chars + string->length, number, numberLength);
     }
+    chars[newLength] = '\0';
+    ObjString *result = takeString(chars, newLength);
+    pop();
+    pop();
+    push(OBJ_VALUE(result));
 }
 
-/** next several functions are turning *double* into character array **/
-
-// reverse the character between *start* and *end*, which is [start, end]
-static void reverse(char* string, int start, int end) {
-    while (start < end) {
-        char temp = *(string + start);
-        *(string + start) = *(string + end);
-        *(string + end) = temp;
-        start++;
-        end--;
+// The slow path of OP_ADD, when the two operands on top of the stack
+// aren't both numbers. Returns false after the runtime error when they
+// aren't strings or a string and a number either.
+static bool concatenateOperands() {
+    Value b = peek(0);
+    Value a = peek(1);
+    if (IS_STRING(a) && IS_STRING(b)) {
+        concatenate();
+    } else if ((IS_STRING(a) && IS_NUMBER(b)) || (IS_NUMBER(a) && IS_STRING(b))) {
+        concatenateWithNumber();
+    } else {
+        runtimeError("Operands must be numbers.");
+        return false;
     }
+    return true;
 }
 
-static void copyNumber(char* string, int length, double number) {
-    char *numberString = ALLOCATE(char, length);
-    char *p;
-    p = numberString;
-    int integer = (int) number;
-    while (integer != 0) {
-        *p = '0' + (char) (integer % 10);
-        integer /= 10;
-        p++;
-    }
-    reverse(numberString, 0, p - numberString - 1);
+static InterpretResult run(int baseFrame);
+static InterpretResult runRegisters(int baseFrame);
 
-    if (length != p - numberString) {
-        double decimal = number - integer;
-        while (p <= numberString + length) {
-            decimal *= 10;
-            *p = (int) decimal + '0';
-        }
+// The frame of the function this is expanded in, on the C stack.
+#if defined(__GNUC__)
+#define NATIVE_STACK_POINTER(local) ((char *) __builtin_frame_address(0))
+#else
+#define NATIVE_STACK_POINTER(local) ((char *) &(local))
+#endif
 
-        int i;
-        for (i = 0; i < length; i++) {
-            *(string + i) = *(numberString + i);
-        }
+// Runs the top frame on *engine* unless more than NATIVE_STACK_MAX of the C
+// stack is in use already.
+static InterpretResult enterEngine(InterpretResult (*engine)(int), int baseFrame) {
+    char *here = NATIVE_STACK_POINTER(baseFrame);
+    if (vm.nativeStackBase != NULL &&
+        (here < vm.nativeStackBase ? vm.nativeStackBase - here : here - vm.nativeStackBase) >
+        NATIVE_STACK_MAX) {
+        // Like pushFrame(), report it from the caller.
+        vm.frameCount--;
+        runtimeError("Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
     }
-
-    memcpy(string, numberString, length);
+    return engine(baseFrame);
 }
 
-static int lengthOfTheDigits(double number) {
-    int integer = (int) number;
-    double decimal = number - integer;
+// Whether *function* runs as machine code, either compiled ahead of time
+// (see aot.h) or by the JIT once it is hot.
+static bool useJit(ObjFunction *function) {
+    if (function->aot == NULL && function->jit == NULL) {
+#ifdef JIT_COMPILER
+        // A memo fun needs the OP_RETURN_MEMO of run().
+        if (!vm.jitEnabled || function->hotness < JIT_THRESHOLD || function->memoized ||
+            function->registerCode.count > 0 || !jitCompile(function)) {
+            return false;
+        }
+#else
+        return false;
+#endif
+    }
+    return vm.jitDepth < JIT_DEPTH_MAX;
+}
 
-    int digits = 0;
-    while (integer != 0) {
-        digits++;
-        integer /= 10;
+static JitResult enterMachineCode(CallFrame *frame) {
+    ObjFunction *function = frame->closure->function;
+    if (function->aot != NULL) {
+        return (JitResult) function->aot(frame->slots, (int) (frame->ip - function->chunk.code));
     }
+#ifdef JIT_COMPILER
+    return jitEnter(frame);
+#else
+    return JIT_EXITED;
+#endif
+}
+
+// Runs the top frame, whose function useJit() accepted, as machine code from
+// frame->ip. Returns true once the frame is done, with *result* saying how,
+// false when the interpreter has to continue it.
+static bool runJit(InterpretResult *result) {
+    for (;;) {
+        vm.jitDepth++;
+        JitResult status = enterMachineCode(&vm.frames[vm.frameCount - 1]);
+        vm.jitDepth--;
 
-    if (decimal != 0) {
-        digits++;
-        while (decimal != (int) decimal) {
-            decimal *= 10;
-            digits++;
+        switch (status) {
+            case JIT_RETURNED:
+                *result = INTERPRET_OK;
+                return true;
+            case JIT_ERROR:
+                *result = INTERPRET_RUNTIME_ERROR;
+                return true;
+            case JIT_EXITED:
+                return false;
+            case JIT_TAIL_CALLED: {
+                // Runs the callee in the same frame, without growing the C
+                // stack.
+                ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+                if (function->registerCode.count > 0) {
+                    *result = enterEngine(runRegisters, vm.frameCount - 1);
+                    return true;
+                }
+                if (!useJit(function)) {
+                    return false;
+                }
+                break;
+            }
         }
     }
+}
 
-    return digits;
+// Runs the frame call() has just pushed until it returns, on whichever
+// engine its function uses.
+static InterpretResult runCallee() {
+    int baseFrame = vm.frameCount - 1;
+    ObjFunction *function = vm.frames[baseFrame].closure->function;
+    if (function->registerCode.count > 0) {
+        return enterEngine(runRegisters, baseFrame);
+    }
+    InterpretResult result;
+    if (useJit(function) && runJit(&result)) {
+        return result;
+    }
+    return enterEngine(run, baseFrame);
 }
 
-/************************ end of the block ****************************/
+// Runs the stack code of the top frame until the frame at *baseFrame*
+// returns, calls into functions compiled for the register engine are handed
+// over to runRegisters().
+static InterpretResult run(int baseFrame) {
+    // The hot parts of the current frame are cached in locals so the compiler
+    // can keep them in registers. They must be written back (STORE_FRAME)
+    // before anything that may look at the frame or the stack from outside of
+    // run(): runtime errors, calls, returns and allocations (which can GC).
+    CallFrame *frame;
+    register uint8_t *ip;
+    register Value *slots;
+    register Value *constants;
+    register Value *stackTop;
+    uint8_t instruction;
 
-static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+#define STORE_FRAME() \
+    do { \
+        frame->ip = ip; \
+        vm.stackTop = stackTop; \
+    } while (false)
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+        stackTop = vm.stackTop; \
+    } while (false)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define PUSH(value) \
+    do { \
+        Value pushed = (value); \
+        *stackTop++ = pushed; \
+    } while (false)
+#define POP() (*(--stackTop))
+#define DROP() (stackTop--)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define BINARY_OP(valueType, op)       \
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+// Spends one tick of fuel, see INTERRUPT_INTERVAL.
+#define TICK() \
+    do { \
+        if (--vm.fuel < 0) { \
+            STORE_FRAME(); \
+            if (!pollInterrupt()) { \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+        } \
+    } while (false)
+// *result* is computed from the two numbers "a" and "b" popped off the stack.
+#define BINARY_OP(result)       \
     do{                                \
-        if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers.");   \
-            return INTERPRET_RUNTIME_ERROR; \
+        if(!areNumbers(PEEK(1), PEEK(0))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
         } \
-        double b = AS_NUMBER(pop());   \
-        double a = AS_NUMBER(pop());   \
-        push(valueType(a op b));       \
+        Value b = POP();   \
+        Value a = POP();   \
+        PUSH(result);       \
        } while(false)       \
 
-//    printf("\n== running ==\nv       v     v\n");
-    for(;;){
+#define COMPARE_JUMP(jumpIf) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        if(!areNumbers(PEEK(1), PEEK(0))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        Value b = POP(); \
+        Value a = POP(); \
+        if (jumpIf) { \
+            ip += offset; \
+        } \
+    } while (false)
+
+// The limit of a counting loop and whether the loop goes on, once the
+// counter and the limit are known to be numbers.
+#define FOR_LIMIT(operand, flags) \
+    ((flags) & FOR_CONSTANT_LIMIT ? constants[operand] : slots[operand])
+#define FOR_CONTINUES(counter, limit, flags) \
+    ((flags) & FOR_INCLUSIVE ? !greaterNumbers(counter, limit) : lessNumbers(counter, limit))
+
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          [ stack ] ");
-        for(Value *slot = vm.stack; slot < vm.stackTop; slot++){
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          [ stack ] "); \
+        for(Value *slot = vm.stack; slot < stackTop; slot++){ \
+            printf("[ "); \
+            printValue(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassembleInstruction(&frame->closure->function->chunk, \
+                               (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT:{
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+
+#ifdef THREADED_DISPATCH
+    // Every handler jumps straight to the next one through this table, so each
+    // opcode gets its own indirect branch for the predictor to learn.
+    static void *dispatchTable[] = {
+            [OP_CLASS]          = &&op_CLASS,
+            [OP_RETURN]         = &&op_RETURN,
+            [OP_CONSTANT]       = &&op_CONSTANT,
+            [OP_NIL]            = &&op_NIL,
+            [OP_TRUE]           = &&op_TRUE,
+            [OP_FALSE]          = &&op_FALSE,
+            [OP_POP]            = &&op_POP,
+            [OP_GET_LOCAL]      = &&op_GET_LOCAL,
+            [OP_SET_LOCAL]      = &&op_SET_LOCAL,
+            [OP_GET_GLOBAL]     = &&op_GET_GLOBAL,
+            [OP_SET_GLOBAL]     = &&op_SET_GLOBAL,
+            [OP_GET_UPVALUE]    = &&op_GET_UPVALUE,
+            [OP_SET_UPVALUE]    = &&op_SET_UPVALUE,
+            [OP_DEFINE_GLOBAL]  = &&op_DEFINE_GLOBAL,
+            [OP_EQUAL]          = &&op_EQUAL,
+            [OP_GREATER]        = &&op_GREATER,
+            [OP_LESS]           = &&op_LESS,
+            [OP_ADD]            = &&op_ADD,
+            [OP_SUBTRACT]       = &&op_SUBTRACT,
+            [OP_MULTIPLY]       = &&op_MULTIPLY,
+            [OP_DIVIDE]         = &&op_DIVIDE,
+            [OP_MODULO]         = &&op_MODULO,
+            [OP_NOT]            = &&op_NOT,
+            [OP_NEGATE]         = &&op_NEGATE,
+            [OP_PRINT]          = &&op_PRINT,
+            [OP_JUMP_IF_FALSE]  = &&op_JUMP_IF_FALSE,
+            [OP_JUMP]           = &&op_JUMP,
+            [OP_LOOP]           = &&op_LOOP,
+            [OP_DUP]            = &&op_DUP,
+            [OP_CALL]           = &&op_CALL,
+            [OP_TAIL_CALL]      = &&op_TAIL_CALL,
+            [OP_CLOSURE]        = &&op_CLOSURE,
+            [OP_CLOSE_UPVALUE]  = &&op_CLOSE_UPVALUE,
+            [OP_JUMP_IF_NOT_LESS]           = &&op_JUMP_IF_NOT_LESS,
+            [OP_JUMP_IF_NOT_LESS_EQUAL]     = &&op_JUMP_IF_NOT_LESS_EQUAL,
+            [OP_JUMP_IF_NOT_GREATER]        = &&op_JUMP_IF_NOT_GREATER,
+            [OP_JUMP_IF_NOT_GREATER_EQUAL]  = &&op_JUMP_IF_NOT_GREATER_EQUAL,
+            [OP_JUMP_IF_NOT_EQUAL]          = &&op_JUMP_IF_NOT_EQUAL,
+            [OP_JUMP_IF_EQUAL]              = &&op_JUMP_IF_EQUAL,
+            [OP_SWITCH]         = &&op_SWITCH,
+            [OP_CALL_KNOWN]     = &&op_CALL_KNOWN,
+            [OP_CALL_NATIVE]    = &&op_CALL_NATIVE,
+            [OP_FOR_PREP]       = &&op_FOR_PREP,
+            [OP_FOR_LOOP]       = &&op_FOR_LOOP,
+            [OP_RETURN_MEMO]    = &&op_RETURN_MEMO,
+            [OP_COMPILE]        = &&op_COMPILE,
+            [OP_SQRT]           = &&op_SQRT,
+            [OP_FLOOR]          = &&op_FLOOR,
+            [OP_CEIL]           = &&op_CEIL,
+            [OP_ABS]            = &&op_ABS,
+            [OP_SIN]            = &&op_SIN,
+            [OP_COS]            = &&op_COS,
+            [OP_TAN]            = &&op_TAN,
+            [OP_ATAN]           = &&op_ATAN,
+            [OP_MIN]            = &&op_MIN,
+            [OP_MAX]            = &&op_MAX,
+            [OP_POW]            = &&op_POW,
+            [OP_FMOD]           = &&op_FMOD,
+            [OP_GET_LOCAL_0]    = &&op_GET_LOCAL_0,
+            [OP_GET_LOCAL_1]    = &&op_GET_LOCAL_1,
+            [OP_GET_LOCAL_2]    = &&op_GET_LOCAL_2,
+            [OP_GET_LOCAL_3]    = &&op_GET_LOCAL_3,
+            [OP_POPN]           = &&op_POPN,
+            [OP_INC_LOCAL]      = &&op_INC_LOCAL,
+            [OP_ADD_LOCALS]     = &&op_ADD_LOCALS,
+            [OP_NOT_EQUAL]      = &&op_NOT_EQUAL,
+            [OP_GREATER_EQUAL]  = &&op_GREATER_EQUAL,
+            [OP_LESS_EQUAL]     = &&op_LESS_EQUAL,
+            [OP_ADD_NUMBER]     = &&op_ADD_NUMBER,
+            [OP_ADD_STRING]     = &&op_ADD_STRING,
+            [OP_GET_GLOBAL_DEFINED] = &&op_GET_GLOBAL_DEFINED,
+    };
+
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(name)      op_##name
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        switch (instruction = READ_BYTE())
+#define CASE(name)      case OP_##name
+#define DISPATCH()      goto loop
+#endif
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE(CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(NIL):      PUSH(NIL_VALUE); DISPATCH();
+        CASE(TRUE):     PUSH(BOOL_VALUE(true)); DISPATCH();
+        CASE(FALSE):    PUSH(BOOL_VALUE(false)); DISPATCH();
+        CASE(POP):      DROP(); DISPATCH();
+        CASE(GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if(IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
             }
-            case OP_NIL:    push(NIL_VALUE); break;
-            case OP_TRUE:   push(BOOL_VALUE(true)); break;
-            case OP_FALSE:  push(BOOL_VALUE(false)); break;
-            case OP_POP:    pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+            // Globals can't be undefined again, from now on the check is
+            // wasted.
+            ip[-3] = OP_GET_GLOBAL_DEFINED;
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = POP();
+            DISPATCH();
+        }
+        CASE(SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if(IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+            }
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = PEEK(0);
+            DISPATCH();
+        }
+        CASE(EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VALUE(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(GREATER): {
+            BINARY_OP(BOOL_VALUE(greaterNumbers(a, b)));
+            DISPATCH();
+        }
+        CASE(LESS): {
+            BINARY_OP(BOOL_VALUE(lessNumbers(a, b)));
+            DISPATCH();
+        }
+        CASE(ADD): {
+            // The first operands seen decide which quickened form this
+            // instruction becomes, mixed ones keep it generic.
+            if(areNumbers(PEEK(1), PEEK(0))) {
+                ip[-1] = OP_ADD_NUMBER;
+                Value b = POP();
+                Value a = POP();
+                PUSH(addNumbers(a, b));
+                DISPATCH();
+            }
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                ip[-1] = OP_ADD_STRING;
+            }
+
+            STORE_FRAME();
+            if (!concatenateOperands()) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            stackTop = vm.stackTop;
+            DISPATCH();
+        }
+        CASE(SUBTRACT): {
+            BINARY_OP(subtractNumbers(a, b));
+            DISPATCH();
+        }
+        CASE(MULTIPLY): {
+            BINARY_OP(multiplyNumbers(a, b));
+            DISPATCH();
+        }
+        CASE(DIVIDE): {
+            BINARY_OP(divideNumbers(a, b));
+            DISPATCH();
+        }
+        CASE(MODULO): {
+            BINARY_OP(moduloNumbers(a, b));
+            DISPATCH();
+        }
+        CASE(NOT):
+            PUSH(BOOL_VALUE(isFalsey(POP())));
+            DISPATCH();
+        CASE(NEGATE): {
+            if(!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be number.");
+            }
+
+            PUSH(negateNumber(POP()));
+            DISPATCH();
+        }
+        CASE(PRINT): {
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if(isFalsey(PEEK(0))) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(SWITCH): {
+            uint16_t offset = READ_SHORT();
+            ObjSwitch *table = AS_SWITCH(READ_CONSTANT());
+            int index = switchCase(table, PEEK(0));
+            if (index == -1) {
+                ip += offset - 1;
+            } else {
+                ip = frame->closure->function->chunk.code + table->cases[index];
+            }
+            DISPATCH();
+        }
+        CASE(LOOP): {
+            uint16_t offset = READ_SHORT();
+            TICK();
+            ip -= offset;
+        backEdge:;
+            ObjFunction *function = frame->closure->function;
+            if (function->hotness < HOTNESS_MAX) {
+                STORE_FRAME();
+                warmUp(function);
+                DISPATCH();
+            }
+#ifdef JIT_COMPILER
+            // A hot loop moves over to machine code at its next iteration.
+            InterpretResult result;
+            STORE_FRAME();
+            if (useJit(function) && runJit(&result) &&
+                (result != INTERPRET_OK || vm.frameCount == baseFrame)) {
+                return result;
             }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if(!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
+            LOAD_FRAME();
+#endif
+            DISPATCH();
+        }
+        CASE(FOR_PREP): {
+            uint16_t offset = READ_SHORT();
+            Value counter = slots[READ_BYTE()];
+            uint8_t limitOperand = READ_BYTE();
+            uint8_t flags = READ_BYTE();
+            Value limit = FOR_LIMIT(limitOperand, flags);
+            if (!areNumbers(counter, limit)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            if (!FOR_CONTINUES(counter, limit, flags)) {
+                ip += offset - 3;
+            }
+            DISPATCH();
+        }
+        CASE(FOR_LOOP): {
+            uint16_t offset = READ_SHORT();
+            uint8_t slot = READ_BYTE();
+            uint8_t limitOperand = READ_BYTE();
+            uint8_t flags = READ_BYTE();
+            Value step = READ_CONSTANT();
+            if (areNumbers(slots[slot], step)) {
+                slots[slot] = addNumbers(slots[slot], step);
+            } else {
+                PUSH(slots[slot]);
+                PUSH(step);
+                STORE_FRAME();
+                if (!concatenateOperands()) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
-                break;
+                stackTop = vm.stackTop;
+                slots[slot] = POP();
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+
+            Value limit = FOR_LIMIT(limitOperand, flags);
+            if (!areNumbers(slots[slot], limit)) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+            if (FOR_CONTINUES(slots[slot], limit, flags)) {
+                // Counts as an iteration like OP_LOOP does.
+                TICK();
+                ip -= offset + 4;
+                goto backEdge;
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if(tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(DUP):
+            PUSH(PEEK(0));
+            DISPATCH();
+        CASE(CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            int frameCount = vm.frameCount;
+            if (!callValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+            if (function->registerCode.count > 0) {
+                InterpretResult result = enterEngine(runRegisters, vm.frameCount - 1);
+                if (result != INTERPRET_OK) {
+                    return result;
                 }
-                break;
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            // Otherwise the callee keeps running here.
+            InterpretResult result;
+            if (vm.frameCount > frameCount && useJit(function) &&
+                runJit(&result) && result != INTERPRET_OK) {
+                return result;
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(CALL_KNOWN): {
+            uint16_t offset = READ_SHORT();
+            int argCount = READ_BYTE();
+            ObjFunction *known = AS_FUNCTION(READ_CONSTANT());
+            Value callee = PEEK(argCount);
+            bool bound = IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == known;
+            if (bound && offset != 2) {
+                // Run the inlined body.
+                DISPATCH();
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VALUE(valuesEqual(a, b)));
-                break;
+            ip += offset - 2;
+            STORE_FRAME();
+            int frameCount = vm.frameCount;
+            if (bound ? !pushFrame(AS_CLOSURE(callee), argCount) :
+                !callValue(callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GREATER: {
-                BINARY_OP(BOOL_VALUE, >);
-                break;
+            ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+            if (function->registerCode.count > 0) {
+                InterpretResult result = enterEngine(runRegisters, vm.frameCount - 1);
+                if (result != INTERPRET_OK) {
+                    return result;
+                }
             }
-            case OP_LESS: {
-                BINARY_OP(BOOL_VALUE, <);
-                break;
+            InterpretResult result;
+            if (vm.frameCount > frameCount && useJit(function) &&
+                runJit(&result) && result != INTERPRET_OK) {
+                return result;
             }
-            case OP_ADD:{
-                if(IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VALUE(a + b));
-                } else {
-                    concatenateWithNumber();
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(SQRT):
+        CASE(FLOOR):
+        CASE(CEIL):
+        CASE(ABS):
+        CASE(SIN):
+        CASE(COS):
+        CASE(TAN):
+        CASE(ATAN):
+        CASE(MIN):
+        CASE(MAX):
+        CASE(POW):
+        CASE(FMOD): {
+            Value *result = stackTop - ip[0] - 1;
+            if (IS_OBJ(*result) && AS_OBJ(*result) == AS_OBJ(constants[ip[1]]) &&
+                mathIntrinsic(ip[-1], result + 1, result)) {
+                ip += 2;
+                stackTop = result + 1;
+                DISPATCH();
+            }
+            // Anything else, a type error included, is left to the call.
+        }
+        CASE(CALL_NATIVE): {
+            int argCount = READ_BYTE();
+            Value native = READ_CONSTANT();
+            Value callee = PEEK(argCount);
+            STORE_FRAME();
+            if (IS_OBJ(callee) && AS_OBJ(callee) == AS_OBJ(native)) {
+                // The arity was checked when the call was bound.
+                Value *result = stackTop - argCount - 1;
+                if (!AS_NATIVE(native)->function(argCount, result + 1, result)) {
+                    return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                stackTop = result + 1;
+                DISPATCH();
             }
-            case OP_SUBTRACT: {
-                BINARY_OP(NUMBER_VALUE, -);
-                break;
+            int frameCount = vm.frameCount;
+            if (!callValue(callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_MULTIPLY: {
-                BINARY_OP(NUMBER_VALUE, *);
-                break;
+            ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+            if (function->registerCode.count > 0) {
+                InterpretResult result = enterEngine(runRegisters, vm.frameCount - 1);
+                if (result != INTERPRET_OK) {
+                    return result;
+                }
             }
-            case OP_DIVIDE: {
-                BINARY_OP(NUMBER_VALUE, /);
-                break;
+            InterpretResult result;
+            if (vm.frameCount > frameCount && useJit(function) &&
+                runJit(&result) && result != INTERPRET_OK) {
+                return result;
             }
-            case OP_NOT:
-                push(BOOL_VALUE(isFalsey(pop())));
-                break;
-            case OP_NEGATE: {
-                if(!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be number.");
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(TAIL_CALL): {
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            STORE_FRAME();
+            vm.stackTop = stackTop;
+            if (!reusesFrame(callee)) {
+                // The OP_RETURN that follows returns the result.
+                if (!callValue(callee, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                LOAD_FRAME();
+                DISPATCH();
+            }
 
-                push(NUMBER_VALUE(-AS_NUMBER(pop())));
-                break;
+            if (!tailCall(AS_CLOSURE(callee), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
+            ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+            if (function->registerCode.count > 0) {
+                // The register engine returns from this frame for us.
+                InterpretResult result = enterEngine(runRegisters, vm.frameCount - 1);
+                if (result != INTERPRET_OK || vm.frameCount == baseFrame) {
+                    return result;
+                }
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if(isFalsey(peek(0))) {
-                    frame->ip += offset;
+            InterpretResult result;
+            if (useJit(function) && runJit(&result) &&
+                (result != INTERPRET_OK || vm.frameCount == baseFrame)) {
+                return result;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(CLOSURE): {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure *closure = functionClosure(function);
+            PUSH(OBJ_VALUE(closure));
+            vm.stackTop = stackTop;
+            int i;
+            for (i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            DISPATCH();
+        }
+        CASE(CLOSE_UPVALUE):
+            closeUpvalues(stackTop - 1);
+            DROP();
+            DISPATCH();
+        CASE(RETURN_MEMO): {
+            // See callMemoized(), the result is still on the stack.
+            ObjFunction *function = frame->closure->function;
+            STORE_FRAME();
+            slots -= function->arity + 1;
+            int count;
+            Value *key = memoKey(function, slots, &count);
+            if (key != NULL) {
+                memoSet(&function->memo, key, count, PEEK(0));
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            // Then returns like OP_RETURN, from below the copy.
+        }
+        CASE(RETURN): {
+            Value result = POP();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            vm.stackTop = slots;
+            if (vm.frameCount == baseFrame) {
+                // The script's own closure isn't replaced by a result.
+                if (baseFrame > 0) {
+                    push(result);
+                }
+                return INTERPRET_OK;
             }
-            case OP_DUP:
-                push(peek(0));
-                break;
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+
+            push(result);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(COMPILE): {
+            // The body replaces this in the frame pushed for it, which has
+            // the arguments already.
+            ObjFunction *function = frame->closure->function;
+            STORE_FRAME();
+            if (!compileFunction(function)) {
+                resetStack();
+                vm.lazyCompileFailed = true;
+                return INTERPRET_COMPILE_ERROR;
+            }
+            if (vm.profile.enabled) {
+                profileFunction(function);
+            }
+            ensureStack(function->maxStack - (int) (vm.stackTop - frame->slots));
+            frame->ip = function->chunk.code;
+            if (function->registerCode.count > 0) {
+                frame->ip = function->registerCode.code;
+                Value *end = frame->slots + function->registerCount;
+                for (Value *slot = vm.stackTop; slot < end; slot++) {
+                    *slot = NIL_VALUE;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                InterpretResult result = enterEngine(runRegisters, vm.frameCount - 1);
+                if (result != INTERPRET_OK || vm.frameCount == baseFrame) {
+                    return result;
+                }
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(CLASS): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            PUSH(OBJ_VALUE(newClass(name)));
+            DISPATCH();
+        }
+        // Each one jumps exactly when the comparison/OP_NOT sequence it
+        // replaces would have left a falsey value, so NaN behaves the same.
+        CASE(JUMP_IF_NOT_LESS):
+            COMPARE_JUMP(!lessNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_LESS_EQUAL):
+            COMPARE_JUMP(greaterNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_GREATER):
+            COMPARE_JUMP(!greaterNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_GREATER_EQUAL):
+            COMPARE_JUMP(lessNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (!valuesEqual(a, b)) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(JUMP_IF_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (valuesEqual(a, b)) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(GET_LOCAL_0):  PUSH(slots[0]); DISPATCH();
+        CASE(GET_LOCAL_1):  PUSH(slots[1]); DISPATCH();
+        CASE(GET_LOCAL_2):  PUSH(slots[2]); DISPATCH();
+        CASE(GET_LOCAL_3):  PUSH(slots[3]); DISPATCH();
+        CASE(POPN):
+            stackTop -= READ_BYTE();
+            DISPATCH();
+        CASE(INC_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            Value constant = READ_CONSTANT();
+            if (areNumbers(slots[slot], constant)) {
+                slots[slot] = addNumbers(slots[slot], constant);
+                DISPATCH();
+            }
+
+            PUSH(slots[slot]);
+            PUSH(constant);
+            STORE_FRAME();
+            if (!concatenateOperands()) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            stackTop = vm.stackTop;
+            slots[slot] = POP();
+            DISPATCH();
+        }
+        CASE(ADD_LOCALS): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (areNumbers(a, b)) {
+                PUSH(addNumbers(a, b));
+                DISPATCH();
+            }
+
+            PUSH(a);
+            PUSH(b);
+            STORE_FRAME();
+            if (!concatenateOperands()) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            stackTop = vm.stackTop;
+            DISPATCH();
+        }
+        CASE(NOT_EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VALUE(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(GREATER_EQUAL): {
+            if(!areNumbers(PEEK(1), PEEK(0))) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VALUE(!lessNumbers(a, b)));
+            DISPATCH();
+        }
+        CASE(LESS_EQUAL): {
+            if(!areNumbers(PEEK(1), PEEK(0))) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VALUE(!greaterNumbers(a, b)));
+            DISPATCH();
+        }
+        // A quickened instruction whose guard fails turns back into the
+        // generic one and runs again as that.
+        CASE(ADD_NUMBER): {
+            if(!areNumbers(PEEK(1), PEEK(0))) {
+                *--ip = OP_ADD;
+                DISPATCH();
+            }
+            Value b = POP();
+            Value a = POP();
+            PUSH(addNumbers(a, b));
+            DISPATCH();
+        }
+        CASE(ADD_STRING): {
+            if(!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                *--ip = OP_ADD;
+                DISPATCH();
+            }
+            STORE_FRAME();
+            concatenate();
+            stackTop = vm.stackTop;
+            DISPATCH();
+        }
+        CASE(GET_GLOBAL_DEFINED):
+            PUSH(vm.globalValues.values[READ_SHORT()]);
+            DISPATCH();
+
+    }
+
+    return INTERPRET_RUNTIME_ERROR; // Unreachable.
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef RUNTIME_ERROR
+#undef TICK
+#undef BINARY_OP
+#undef COMPARE_JUMP
+#undef FOR_LIMIT
+#undef FOR_CONTINUES
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+// The register engine, see registers.h for the instruction format. It runs
+// the register code of the top frame until the frame at *baseFrame* returns.
+// Calls between register functions stay in this loop, calls to functions
+// that only have stack code go through run().
+static InterpretResult runRegisters(int baseFrame) {
+    CallFrame *frame;
+    register uint8_t *ip;
+    register Value *slots;
+    register Value *constants;
+    uint8_t instruction;
+    uint8_t operand;
+
+    // Unlike run() the stack top never moves inside a frame: it stays above
+    // the last register so that the GC sees all of them.
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+        vm.stackTop = slots + frame->closure->function->registerCount; \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+// Selecting the base pointer rather than the value lets the C compiler use
+// a conditional move instead of a branch the predictor can't learn.
+#define READ_RK() \
+    (operand = READ_BYTE(), \
+     (operand & RK_CONSTANT ? constants - RK_CONSTANT : slots)[operand])
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+// Spends one tick of fuel, see INTERRUPT_INTERVAL.
+#define TICK() \
+    do { \
+        if (--vm.fuel < 0) { \
+            STORE_FRAME(); \
+            if (!pollInterrupt()) { \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+        } \
+    } while (false)
+#define BINARY_OP(result) \
+    do { \
+        uint8_t dest = READ_BYTE(); \
+        Value a = READ_RK(); \
+        Value b = READ_RK(); \
+        if (!areNumbers(a, b)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        slots[dest] = (result); \
+    } while (false)
+#define COMPARE_JUMP(jumpIf) \
+    do { \
+        Value a = READ_RK(); \
+        Value b = READ_RK(); \
+        uint16_t offset = READ_SHORT(); \
+        if (!areNumbers(a, b)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        if (jumpIf) { \
+            ip += offset; \
+        } \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          [ registers ] "); \
+        for(Value *slot = slots; slot < vm.stackTop; slot++){ \
+            printf("[ "); \
+            printValue(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassembleRegisterInstruction(frame->closure->function, \
+                (int)(ip - frame->closure->function->registerCode.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef THREADED_DISPATCH
+    static void *dispatchTable[] = {
+            [ROP_MOVE]          = &&rop_MOVE,
+            [ROP_LOADK]         = &&rop_LOADK,
+            [ROP_LOADNIL]       = &&rop_LOADNIL,
+            [ROP_LOADTRUE]      = &&rop_LOADTRUE,
+            [ROP_LOADFALSE]     = &&rop_LOADFALSE,
+            [ROP_GET_GLOBAL]    = &&rop_GET_GLOBAL,
+            [ROP_SET_GLOBAL]    = &&rop_SET_GLOBAL,
+            [ROP_DEFINE_GLOBAL] = &&rop_DEFINE_GLOBAL,
+            [ROP_GET_UPVALUE]   = &&rop_GET_UPVALUE,
+            [ROP_SET_UPVALUE]   = &&rop_SET_UPVALUE,
+            [ROP_ADD]           = &&rop_ADD,
+            [ROP_SUBTRACT]      = &&rop_SUBTRACT,
+            [ROP_MULTIPLY]      = &&rop_MULTIPLY,
+            [ROP_DIVIDE]        = &&rop_DIVIDE,
+            [ROP_MODULO]        = &&rop_MODULO,
+            [ROP_EQUAL]         = &&rop_EQUAL,
+            [ROP_NOT_EQUAL]     = &&rop_NOT_EQUAL,
+            [ROP_GREATER]       = &&rop_GREATER,
+            [ROP_GREATER_EQUAL] = &&rop_GREATER_EQUAL,
+            [ROP_LESS]          = &&rop_LESS,
+            [ROP_LESS_EQUAL]    = &&rop_LESS_EQUAL,
+            [ROP_NOT]           = &&rop_NOT,
+            [ROP_NEGATE]        = &&rop_NEGATE,
+            [ROP_PRINT]         = &&rop_PRINT,
+            [ROP_JUMP]          = &&rop_JUMP,
+            [ROP_LOOP]          = &&rop_LOOP,
+            [ROP_JUMP_IF_FALSE] = &&rop_JUMP_IF_FALSE,
+            [ROP_JUMP_IF_NOT_LESS]          = &&rop_JUMP_IF_NOT_LESS,
+            [ROP_JUMP_IF_NOT_LESS_EQUAL]    = &&rop_JUMP_IF_NOT_LESS_EQUAL,
+            [ROP_JUMP_IF_NOT_GREATER]       = &&rop_JUMP_IF_NOT_GREATER,
+            [ROP_JUMP_IF_NOT_GREATER_EQUAL] = &&rop_JUMP_IF_NOT_GREATER_EQUAL,
+            [ROP_JUMP_IF_NOT_EQUAL]         = &&rop_JUMP_IF_NOT_EQUAL,
+            [ROP_JUMP_IF_EQUAL]             = &&rop_JUMP_IF_EQUAL,
+            [ROP_CALL]          = &&rop_CALL,
+            [ROP_TAIL_CALL]     = &&rop_TAIL_CALL,
+            [ROP_CALL_KNOWN]    = &&rop_CALL_KNOWN,
+            [ROP_RETURN]        = &&rop_RETURN,
+            [ROP_CLOSURE]       = &&rop_CLOSURE,
+            [ROP_CLOSE_UPVALUE] = &&rop_CLOSE_UPVALUE,
+            [ROP_CLASS]         = &&rop_CLASS,
+    };
+
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(name)      rop_##name
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        switch (instruction = READ_BYTE())
+#define CASE(name)      case ROP_##name
+#define DISPATCH()      goto loop
+#endif
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE(MOVE): {
+            uint8_t dest = READ_BYTE();
+            slots[dest] = slots[READ_BYTE()];
+            DISPATCH();
+        }
+        CASE(LOADK): {
+            uint8_t dest = READ_BYTE();
+            slots[dest] = constants[READ_BYTE()];
+            DISPATCH();
+        }
+        CASE(LOADNIL):      slots[READ_BYTE()] = NIL_VALUE; DISPATCH();
+        CASE(LOADTRUE):     slots[READ_BYTE()] = BOOL_VALUE(true); DISPATCH();
+        CASE(LOADFALSE):    slots[READ_BYTE()] = BOOL_VALUE(false); DISPATCH();
+        CASE(GET_GLOBAL): {
+            uint8_t dest = READ_BYTE();
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if(IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+            }
+            slots[dest] = value;
+            DISPATCH();
+        }
+        CASE(SET_GLOBAL): {
+            uint8_t source = READ_BYTE();
+            uint16_t slot = READ_SHORT();
+            if(IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+            }
+            vm.globalValues.values[slot] = slots[source];
+            DISPATCH();
+        }
+        CASE(DEFINE_GLOBAL): {
+            uint8_t source = READ_BYTE();
+            vm.globalValues.values[READ_SHORT()] = slots[source];
+            DISPATCH();
+        }
+        CASE(GET_UPVALUE): {
+            uint8_t dest = READ_BYTE();
+            slots[dest] = *frame->closure->upvalues[READ_BYTE()]->location;
+            DISPATCH();
+        }
+        CASE(SET_UPVALUE): {
+            uint8_t source = READ_BYTE();
+            *frame->closure->upvalues[READ_BYTE()]->location = slots[source];
+            DISPATCH();
+        }
+        CASE(ADD): {
+            uint8_t dest = READ_BYTE();
+            Value left = READ_RK();
+            Value right = READ_RK();
+            if (areNumbers(left, right)) {
+                slots[dest] = addNumbers(left, right);
+                DISPATCH();
+            }
+
+            STORE_FRAME();
+            push(left);
+            push(right);
+            if (!concatenateOperands()) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[dest] = pop();
+            DISPATCH();
+        }
+        CASE(SUBTRACT):     BINARY_OP(subtractNumbers(a, b)); DISPATCH();
+        CASE(MULTIPLY):     BINARY_OP(multiplyNumbers(a, b)); DISPATCH();
+        CASE(DIVIDE):       BINARY_OP(divideNumbers(a, b)); DISPATCH();
+        CASE(MODULO):       BINARY_OP(moduloNumbers(a, b)); DISPATCH();
+        CASE(GREATER):      BINARY_OP(BOOL_VALUE(greaterNumbers(a, b))); DISPATCH();
+        CASE(LESS):         BINARY_OP(BOOL_VALUE(lessNumbers(a, b))); DISPATCH();
+        CASE(GREATER_EQUAL): {
+            uint8_t dest = READ_BYTE();
+            Value left = READ_RK();
+            Value right = READ_RK();
+            if (!areNumbers(left, right)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            slots[dest] = BOOL_VALUE(!lessNumbers(left, right));
+            DISPATCH();
+        }
+        CASE(LESS_EQUAL): {
+            uint8_t dest = READ_BYTE();
+            Value left = READ_RK();
+            Value right = READ_RK();
+            if (!areNumbers(left, right)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            slots[dest] = BOOL_VALUE(!greaterNumbers(left, right));
+            DISPATCH();
+        }
+        CASE(EQUAL): {
+            uint8_t dest = READ_BYTE();
+            Value left = READ_RK();
+            Value right = READ_RK();
+            slots[dest] = BOOL_VALUE(valuesEqual(left, right));
+            DISPATCH();
+        }
+        CASE(NOT_EQUAL): {
+            uint8_t dest = READ_BYTE();
+            Value left = READ_RK();
+            Value right = READ_RK();
+            slots[dest] = BOOL_VALUE(!valuesEqual(left, right));
+            DISPATCH();
+        }
+        CASE(NOT): {
+            uint8_t dest = READ_BYTE();
+            slots[dest] = BOOL_VALUE(isFalsey(slots[READ_BYTE()]));
+            DISPATCH();
+        }
+        CASE(NEGATE): {
+            uint8_t dest = READ_BYTE();
+            Value value = slots[READ_BYTE()];
+            if(!IS_NUMBER(value)) {
+                RUNTIME_ERROR("Operand must be number.");
+            }
+            slots[dest] = negateNumber(value);
+            DISPATCH();
+        }
+        CASE(PRINT): {
+            printValue(slots[READ_BYTE()]);
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(LOOP): {
+            uint16_t offset = READ_SHORT();
+            TICK();
+            ip -= offset;
+            DISPATCH();
+        }
+        CASE(JUMP_IF_FALSE): {
+            Value condition = slots[READ_BYTE()];
+            uint16_t offset = READ_SHORT();
+            if(isFalsey(condition)) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(JUMP_IF_NOT_LESS):
+            COMPARE_JUMP(!lessNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_LESS_EQUAL):
+            COMPARE_JUMP(greaterNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_GREATER):
+            COMPARE_JUMP(!greaterNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_GREATER_EQUAL):
+            COMPARE_JUMP(lessNumbers(a, b));
+            DISPATCH();
+        CASE(JUMP_IF_NOT_EQUAL): {
+            Value left = READ_RK();
+            Value right = READ_RK();
+            uint16_t offset = READ_SHORT();
+            if (!valuesEqual(left, right)) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(JUMP_IF_EQUAL): {
+            Value left = READ_RK();
+            Value right = READ_RK();
+            uint16_t offset = READ_SHORT();
+            if (valuesEqual(left, right)) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(CALL): {
+            uint8_t callee = READ_BYTE();
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            // Everything above the arguments is dead. The callee's frame may
+            // end below it, so clear it now before the GC stops seeing it.
+            vm.stackTop = slots + callee + argCount + 1;
+            for (Value *slot = vm.stackTop;
+                 slot < slots + frame->closure->function->registerCount; slot++) {
+                *slot = NIL_VALUE;
+            }
+            int frameCount = vm.frameCount;
+            if (!callValue(slots[callee], argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // Calls may have moved the frames and the stack, so *frame*
+            // and *slots* are only good again after LOAD_FRAME().
+            if (vm.frameCount == frameCount ||
+                vm.frames[vm.frameCount - 1].closure->function->registerCode.count > 0) {
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            InterpretResult result = runCallee();
+            if (result != INTERPRET_OK) {
+                return result;
+            }
+            // The stack engine leaves popped values behind it.
+            Value *top = vm.stackTop;
+            LOAD_FRAME();
+            for (Value *slot = top; slot < vm.stackTop; slot++) {
+                *slot = NIL_VALUE;
+            }
+            DISPATCH();
+        }
+        CASE(CALL_KNOWN): {
+            uint8_t callee = READ_BYTE();
+            int argCount = READ_BYTE();
+            ObjFunction *known = AS_FUNCTION(constants[READ_BYTE()]);
+            uint16_t offset = READ_SHORT();
+            bool bound = IS_CLOSURE(slots[callee]) &&
+                         AS_CLOSURE(slots[callee])->function == known;
+            if (bound) {
+                // Run the inlined body.
+                DISPATCH();
+            }
+            ip += offset;
+            STORE_FRAME();
+            vm.stackTop = slots + callee + argCount + 1;
+            for (Value *slot = vm.stackTop;
+                 slot < slots + frame->closure->function->registerCount; slot++) {
+                *slot = NIL_VALUE;
+            }
+            int frameCount = vm.frameCount;
+            if (!callValue(slots[callee], argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (vm.frameCount == frameCount ||
+                vm.frames[vm.frameCount - 1].closure->function->registerCode.count > 0) {
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            InterpretResult result = runCallee();
+            if (result != INTERPRET_OK) {
+                return result;
+            }
+            Value *top = vm.stackTop;
+            LOAD_FRAME();
+            for (Value *slot = top; slot < vm.stackTop; slot++) {
+                *slot = NIL_VALUE;
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VALUE(closure));
-                int i;
-                for (i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] =
-                                captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+            DISPATCH();
+        }
+        CASE(TAIL_CALL): {
+            uint8_t callee = READ_BYTE();
+            int argCount = READ_BYTE();
+            Value function = slots[callee];
+            STORE_FRAME();
+            vm.stackTop = slots + callee + argCount + 1;
+            if (!reusesFrame(function)) {
+                int frameCount = vm.frameCount;
+                if (!callValue(function, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // A memo fun runs on the stack engine.
+                if (vm.frameCount > frameCount) {
+                    InterpretResult result = runCallee();
+                    if (result != INTERPRET_OK) {
+                        return result;
                     }
                 }
-                break;
+                Value *top = vm.stackTop;
+                LOAD_FRAME();
+                for (Value *slot = top; slot < vm.stackTop; slot++) {
+                    *slot = NIL_VALUE;
+                }
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
+
+            for (Value *slot = vm.stackTop;
+                 slot < slots + frame->closure->function->registerCount; slot++) {
+                *slot = NIL_VALUE;
+            }
+            if (!tailCall(AS_CLOSURE(function), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (frame->closure->function->registerCode.count > 0) {
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            // The stack engine returns from this frame for us.
+            InterpretResult result = runCallee();
+            if (result != INTERPRET_OK || vm.frameCount == baseFrame) {
+                return result;
+            }
+            Value *top = vm.stackTop;
+            LOAD_FRAME();
+            for (Value *slot = top; slot < vm.stackTop; slot++) {
+                *slot = NIL_VALUE;
+            }
+            DISPATCH();
+        }
+        CASE(RETURN): {
+            Value result = READ_RK();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == baseFrame) {
+                vm.stackTop = slots;
+                // The script's own closure isn't replaced by a result.
+                if (baseFrame > 0) {
+                    push(result);
                 }
+                return INTERPRET_OK;
+            }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            // The caller is a register frame as well, its registers above
+            // the result have been cleared by the call and are only the
+            // callee's leftovers, which the GC was seeing the whole time.
+            slots[0] = result;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(CLOSURE): {
+            uint8_t dest = READ_BYTE();
+            ObjFunction *function = AS_FUNCTION(constants[READ_BYTE()]);
+            STORE_FRAME();
+            ObjClosure *closure = functionClosure(function);
+            slots[dest] = OBJ_VALUE(closure);
+            int i;
+            for (i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                }
             }
-            case OP_CLASS:
-                push(OBJ_VALUE(newClass(READ_STRING())));
-                break;
+            DISPATCH();
+        }
+        CASE(CLOSE_UPVALUE):
+            closeUpvalues(slots + READ_BYTE());
+            DISPATCH();
+        CASE(CLASS): {
+            uint8_t dest = READ_BYTE();
+            ObjString *name = AS_STRING(constants[READ_BYTE()]);
+            STORE_FRAME();
+            ObjClass *klass = newClass(name);
+            slots[dest] = OBJ_VALUE(klass);
+            DISPATCH();
         }
     }
 
+    return INTERPRET_RUNTIME_ERROR; // Unreachable.
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_RK
+#undef RUNTIME_ERROR
+#undef TICK
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+/*
+ * The parts of the instructions compiled code leaves to the VM, each works
+ * on the top frame like the handler in run() would.
+ */
+
+static void storeIp(uint8_t *ip) {
+    vm.frames[vm.frameCount - 1].ip = ip;
+}
+
+bool jitBinary(uint8_t *ip, uint8_t op) {
+    storeIp(ip);
+    Value b = peek(0);
+    Value a = peek(1);
+    Value result;
+    switch (op) {
+        case OP_EQUAL:      result = BOOL_VALUE(valuesEqual(a, b)); break;
+        case OP_NOT_EQUAL:  result = BOOL_VALUE(!valuesEqual(a, b)); break;
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+            if (!areNumbers(a, b)) {
+                return concatenateOperands();
+            }
+            result = addNumbers(a, b);
+            break;
+        default:
+            if (!areNumbers(a, b)) {
+                runtimeError("Operands must be numbers.");
+                return false;
+            }
+            switch (op) {
+                case OP_SUBTRACT:       result = subtractNumbers(a, b); break;
+                case OP_MULTIPLY:       result = multiplyNumbers(a, b); break;
+                case OP_DIVIDE:         result = divideNumbers(a, b); break;
+                case OP_MODULO:         result = moduloNumbers(a, b); break;
+                case OP_GREATER:        result = BOOL_VALUE(greaterNumbers(a, b)); break;
+                case OP_GREATER_EQUAL:  result = BOOL_VALUE(!lessNumbers(a, b)); break;
+                case OP_LESS:           result = BOOL_VALUE(lessNumbers(a, b)); break;
+                default:                result = BOOL_VALUE(!greaterNumbers(a, b)); break;
+            }
+            break;
+    }
+    vm.stackTop -= 2;
+    push(result);
+    return true;
+}
+
+// Pops both operands and returns whether to jump, -1 after an error.
+int jitCompareJump(uint8_t *ip, uint8_t op) {
+    storeIp(ip);
+    Value b = pop();
+    Value a = pop();
+    switch (op) {
+        case OP_JUMP_IF_NOT_EQUAL:  return !valuesEqual(a, b);
+        case OP_JUMP_IF_EQUAL:      return valuesEqual(a, b);
+        default:
+            break;
+    }
+    if (!areNumbers(a, b)) {
+        runtimeError("Operands must be numbers.");
+        return -1;
+    }
+    switch (op) {
+        case OP_JUMP_IF_NOT_LESS:           return !lessNumbers(a, b);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:     return greaterNumbers(a, b);
+        case OP_JUMP_IF_NOT_GREATER:        return !greaterNumbers(a, b);
+        default:                            return lessNumbers(a, b);
+    }
+}
+
+bool jitUnary(uint8_t *ip, uint8_t op) {
+    storeIp(ip);
+    if (op == OP_NOT) {
+        push(BOOL_VALUE(isFalsey(pop())));
+        return true;
+    }
+    if (!IS_NUMBER(peek(0))) {
+        runtimeError("Operand must be number.");
+        return false;
+    }
+    push(negateNumber(pop()));
+    return true;
+}
+
+void jitPrint() {
+    printValue(pop());
+    printf("\n");
+}
+
+void jitUndefinedGlobal(uint8_t *ip, int slot) {
+    storeIp(ip);
+    runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+}
+
+// Returns the slots of the calling frame, which the call may have moved, or
+// NULL after an error.
+Value *jitCall(uint8_t *ip, int argCount) {
+    storeIp(ip);
+    int frameCount = vm.frameCount;
+    if (!callValue(peek(argCount), argCount)) {
+        return NULL;
+    }
+    if (vm.frameCount > frameCount && runCallee() != INTERPRET_OK) {
+        return NULL;
+    }
+    return vm.frames[vm.frameCount - 1].slots;
+}
+
+// After compiled code called compiled code directly, finishes running the
+// callee when it didn't simply return.
+bool jitFinishCall(JitResult status) {
+    switch (status) {
+        case JIT_ERROR:
+            return false;
+        case JIT_EXITED:
+            return enterEngine(run, vm.frameCount - 1) == INTERPRET_OK;
+        default:
+            // A tail call has set up the frame afresh.
+            return runCallee() == INTERPRET_OK;
+    }
+}
+
+// Returns 1 when the frame has been handed to a closure, 0 when the call
+// has left its result on the stack and -1 after an error.
+int jitTailCall(uint8_t *ip, int argCount) {
+    Value callee = peek(argCount);
+    if (!reusesFrame(callee)) {
+        return jitCall(ip, argCount) != NULL ? 0 : -1;
+    }
+    storeIp(ip);
+    return tailCall(AS_CLOSURE(callee), argCount) ? 1 : -1;
+}
+
+// *operands* are the bytes following the OP_CLOSURE.
+void jitClosure(uint8_t *operands) {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    ObjFunction *function = AS_FUNCTION(frame->closure->function->chunk.constants.values[*operands++]);
+    ObjClosure *closure = functionClosure(function);
+    push(OBJ_VALUE(closure));
+    int i;
+    for (i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *operands++;
+        uint8_t index = *operands++;
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
+
+void jitCloseUpvalue() {
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+}
+
+void jitReturn() {
+    Value result = pop();
+    Value *slots = vm.frames[vm.frameCount - 1].slots;
+    closeUpvalues(slots);
+    vm.frameCount--;
+    vm.stackTop = slots;
+    // Like in run(), the script's own closure isn't replaced by a result.
+    if (vm.frameCount > 0) {
+        push(result);
+    }
+}
+
+// Pushes a frame for the closure below the arguments, whose arity has been
+// checked already.
+bool jitPushFrame(uint8_t *ip, int argCount) {
+    storeIp(ip);
+    return call(AS_CLOSURE(peek(argCount)), argCount);
+}
+
+void jitExit(uint8_t *ip) {
+    storeIp(ip);
+}
+
+// Once the fuel of the backward jump ending at *ip* has run out.
+bool jitPoll(uint8_t *ip) {
+    storeIp(ip);
+    return pollInterrupt();
+}
+
+// The offset the OP_SWITCH ending at *ip* goes to.
+int jitSwitch(uint8_t *ip) {
+    Chunk *chunk = &vm.frames[vm.frameCount - 1].closure->function->chunk;
+    ObjSwitch *table = AS_SWITCH(chunk->constants.values[ip[-1]]);
+    int index = switchCase(table, peek(0));
+    if (index == -1) {
+        return jumpTarget(chunk, (int) (ip - chunk->code) - 4);
+    }
+    return table->cases[index];
 }
 
 InterpretResult interpret(const char *source){
@@ -523,12 +2249,27 @@ InterpretResult interpret(const char *source){
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
+    if (vm.profile.enabled) {
+        profileScript(function);
+    }
+    return interpretScript(function);
+}
 
+InterpretResult interpretScript(ObjFunction *function) {
+    vm.nativeStackBase = NATIVE_STACK_POINTER(function);
     push(OBJ_VALUE(function));
     ObjClosure *closure = newClosure(function);
     pop();
     push(OBJ_VALUE(closure));
-    call(closure, 0);
+    // The first tick may already find the budget spent.
+    if (!call(closure, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
 
-    return run();
+    InterpretResult result = runCallee();
+    if (vm.lazyCompileFailed) {
+        vm.lazyCompileFailed = false;
+        return INTERPRET_COMPILE_ERROR;
+    }
+    return result;
 }
@@ -5,12 +5,44 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include <stdatomic.h>
+
 #include "object.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start small and grow on demand, FRAMES_MAX only stops a
+// runaway recursion before it takes all the memory.
+#define FRAMES_MAX (1 << 20)
+// run() and runRegisters() call each other on the C stack. How deep a frame
+// gets depends on the compiler and its flags, so instead of counting them
+// no engine is entered once this many bytes of the C stack are in use,
+// half of the usual 8 MiB.
+#define NATIVE_STACK_MAX (4 * 1024 * 1024)
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL 256
+
+/*
+ * A script only keeps running through calls and backward jumps, so those
+ * are what a host can bound. Each one takes a tick off vm.fuel, a single
+ * decrement and branch. When the fuel runs out the VM looks at the budget
+ * set with setBudget() and at requestInterrupt(), at least every
+ * INTERRUPT_INTERVAL ticks, and either hands out the next stretch of the
+ * budget or stops to call vm.interruptHandler. Without a handler, or when
+ * it returns false, the script stops with a runtime error.
+ */
+
+#define INTERRUPT_INTERVAL 1024
+
+typedef enum {
+    INTERRUPT_BUDGET,   // the budget is used up
+    INTERRUPT_REQUEST,  // requestInterrupt() was called
+} InterruptReason;
+
+// Returns true to let the script go on, which it does with whatever budget
+// there is by then: one that is still used up stops it at the next tick.
+typedef bool (*InterruptHandler)(InterruptReason reason);
 
 typedef struct {
     ObjClosure *closure;
@@ -19,15 +51,55 @@ typedef struct {
 } CallFrame;
 
 typedef struct{
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stackTop;
-    Table globals;
+    int stackCapacity;
+    // Global variables are resolved to a slot in globalValues at compile
+    // time, globalNames maps every name seen so far to its slot.
+    Table globalNames;
+    ValueArray globalValues;
+    // The "const"s declared at the top level of the scripts compiled so
+    // far, so the lines the REPL compiles later still fold them. The table
+    // maps each name to the index of its value in globalConstantValues,
+    // which keeps them in the order they were declared.
+    Table globalConstants;
+    ValueArray globalConstantValues;
+    // The globals some compiled code assigns to, which a "const" can't
+    // take over any more.
+    Table assignedGlobals;
     Table strings;
 
     ObjUpvalue *openUpvalues;
+    // Compile functions for the register engine (see registers.h).
+    bool registerEngine;
+    // Leave the bodies of functions declared at the top level of a script
+    // until they are called (see compiler.h). One failing sets
+    // lazyCompileFailed, the JIT and the register engine only pass a
+    // runtime error on to interpret().
+    bool lazyCompile;
+    bool lazyCompileFailed;
+    // Compile hot functions to machine code (see jit.h), jitDepth counts the
+    // compiled activations currently on the C stack.
+    bool jitEnabled;
+    int jitDepth;
+    // Where the C stack was when interpretScript() started, see
+    // NATIVE_STACK_MAX.
+    char *nativeStackBase;
+
+    // Ticks left before the budget and interrupt requests are looked at,
+    // and what is left of the budget beyond them, -1 for no limit.
+    int fuel;
+    int64_t budget;
+    atomic_bool interruptRequested;
+    InterruptHandler interruptHandler;
+
+    // Warms up scripts from and saves them to a profile file, see
+    // profile.h.
+    Profile profile;
 
     size_t bytesAllocated;
     size_t nextGC;
@@ -48,6 +120,21 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+// Runs the function compile() returned for a script.
+InterpretResult interpretScript(ObjFunction *function);
+/**
+ * Let the script make *ticks* more calls and backward jumps before it is
+ * interrupted, replacing what was left.
+ * @param ticks -1 for no limit, the default
+ */
+void setBudget(int64_t ticks);
+// Interrupt the script within INTERRUPT_INTERVAL ticks, or stop the
+// input() it is waiting in when a signal cut the read short. Safe to call
+// from a signal handler or another thread, it only sets
+// vm.interruptRequested.
+void requestInterrupt();
+int resolveGlobal(ObjString *name);
+ObjString *globalName(int slot);
 void push(Value value);
 Value pop();
 